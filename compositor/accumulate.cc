@@ -0,0 +1,310 @@
+// Accumulate: weighted sum of images with SIMD kernels
+// Copyright 2015 Light Transport Entertainment.
+
+#include "accumulate.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ACCUMULATE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+float HalfToFloat(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+
+  uint32_t bits;
+  if (exponent == 0x1f) {
+    // Inf or NaN.
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {
+    // Denormal; normalize it.
+    int shift = 0;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      ++shift;
+    }
+    bits = sign | ((113 - shift) << 23) | ((mantissa & 0x3ff) << 13);
+  }
+
+  float result;
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+// Adds weight * src[i] to sum[i] with Kahan compensation.
+typedef void (*AccumulateKernel)(const void *src, float weight,
+                                 float *sum, float *compensation, size_t n);
+
+struct KernelSet {
+  const char *name;
+  AccumulateKernel kernels[3];  // Indexed by PixelType.
+};
+
+inline void KahanAdd(float x, float weight, float *sum, float *compensation) {
+  const float y = x * weight - *compensation;
+  const float t = *sum + y;
+  *compensation = (t - *sum) - y;
+  *sum = t;
+}
+
+void AccumulateU8Scalar(const void *src, float weight,
+                        float *sum, float *compensation, size_t n) {
+  const uint8_t *pixels = static_cast<const uint8_t*>(src);
+  for (size_t i = 0; i < n; ++i) {
+    KahanAdd(pixels[i], weight, &sum[i], &compensation[i]);
+  }
+}
+
+void AccumulateHalfScalar(const void *src, float weight,
+                          float *sum, float *compensation, size_t n) {
+  const uint16_t *pixels = static_cast<const uint16_t*>(src);
+  for (size_t i = 0; i < n; ++i) {
+    KahanAdd(HalfToFloat(pixels[i]), weight, &sum[i], &compensation[i]);
+  }
+}
+
+void AccumulateFloatScalar(const void *src, float weight,
+                           float *sum, float *compensation, size_t n) {
+  const float *pixels = static_cast<const float*>(src);
+  for (size_t i = 0; i < n; ++i) {
+    KahanAdd(pixels[i], weight, &sum[i], &compensation[i]);
+  }
+}
+
+const KernelSet kScalarKernels = {
+  "scalar",
+  {AccumulateU8Scalar, AccumulateHalfScalar, AccumulateFloatScalar}
+};
+
+#ifdef ACCUMULATE_X86
+
+__attribute__((target("sse4.1")))
+inline void KahanAddSse(__m128 x, __m128 weight,
+                        float *sum, float *compensation) {
+  const __m128 s = _mm_loadu_ps(sum);
+  const __m128 c = _mm_loadu_ps(compensation);
+  const __m128 y = _mm_sub_ps(_mm_mul_ps(x, weight), c);
+  const __m128 t = _mm_add_ps(s, y);
+  _mm_storeu_ps(compensation, _mm_sub_ps(_mm_sub_ps(t, s), y));
+  _mm_storeu_ps(sum, t);
+}
+
+__attribute__((target("sse4.1")))
+void AccumulateU8Sse(const void *src, float weight,
+                     float *sum, float *compensation, size_t n) {
+  const uint8_t *pixels = static_cast<const uint8_t*>(src);
+  const __m128 w = _mm_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    int32_t packed;
+    memcpy(&packed, pixels + i, sizeof(packed));
+    const __m128 x =
+      _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+    KahanAddSse(x, w, sum + i, compensation + i);
+  }
+  AccumulateU8Scalar(pixels + i, weight, sum + i, compensation + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+void AccumulateHalfSse(const void *src, float weight,
+                       float *sum, float *compensation, size_t n) {
+  // Without F16C, halves are converted one by one.
+  const uint16_t *pixels = static_cast<const uint16_t*>(src);
+  const __m128 w = _mm_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m128 x = _mm_setr_ps(
+        HalfToFloat(pixels[i + 0]), HalfToFloat(pixels[i + 1]),
+        HalfToFloat(pixels[i + 2]), HalfToFloat(pixels[i + 3]));
+    KahanAddSse(x, w, sum + i, compensation + i);
+  }
+  AccumulateHalfScalar(pixels + i, weight, sum + i, compensation + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+void AccumulateFloatSse(const void *src, float weight,
+                        float *sum, float *compensation, size_t n) {
+  const float *pixels = static_cast<const float*>(src);
+  const __m128 w = _mm_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    KahanAddSse(_mm_loadu_ps(pixels + i), w, sum + i, compensation + i);
+  }
+  AccumulateFloatScalar(pixels + i, weight, sum + i, compensation + i, n - i);
+}
+
+const KernelSet kSseKernels = {
+  "sse4.1",
+  {AccumulateU8Sse, AccumulateHalfSse, AccumulateFloatSse}
+};
+
+__attribute__((target("avx2,f16c")))
+inline void KahanAddAvx(__m256 x, __m256 weight,
+                        float *sum, float *compensation) {
+  const __m256 s = _mm256_loadu_ps(sum);
+  const __m256 c = _mm256_loadu_ps(compensation);
+  const __m256 y = _mm256_sub_ps(_mm256_mul_ps(x, weight), c);
+  const __m256 t = _mm256_add_ps(s, y);
+  _mm256_storeu_ps(compensation, _mm256_sub_ps(_mm256_sub_ps(t, s), y));
+  _mm256_storeu_ps(sum, t);
+}
+
+__attribute__((target("avx2,f16c")))
+void AccumulateU8Avx2(const void *src, float weight,
+                      float *sum, float *compensation, size_t n) {
+  const uint8_t *pixels = static_cast<const uint8_t*>(src);
+  const __m256 w = _mm256_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m128i packed =
+      _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixels + i));
+    const __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(packed));
+    KahanAddAvx(x, w, sum + i, compensation + i);
+  }
+  AccumulateU8Scalar(pixels + i, weight, sum + i, compensation + i, n - i);
+}
+
+__attribute__((target("avx2,f16c")))
+void AccumulateHalfAvx2(const void *src, float weight,
+                        float *sum, float *compensation, size_t n) {
+  const uint16_t *pixels = static_cast<const uint16_t*>(src);
+  const __m256 w = _mm256_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 x = _mm256_cvtph_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i)));
+    KahanAddAvx(x, w, sum + i, compensation + i);
+  }
+  AccumulateHalfScalar(pixels + i, weight, sum + i, compensation + i, n - i);
+}
+
+__attribute__((target("avx2,f16c")))
+void AccumulateFloatAvx2(const void *src, float weight,
+                         float *sum, float *compensation, size_t n) {
+  const float *pixels = static_cast<const float*>(src);
+  const __m256 w = _mm256_set1_ps(weight);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    KahanAddAvx(_mm256_loadu_ps(pixels + i), w, sum + i, compensation + i);
+  }
+  AccumulateFloatScalar(pixels + i, weight, sum + i, compensation + i, n - i);
+}
+
+const KernelSet kAvx2Kernels = {
+  "avx2",
+  {AccumulateU8Avx2, AccumulateHalfAvx2, AccumulateFloatAvx2}
+};
+
+#endif  // ACCUMULATE_X86
+
+const KernelSet *DetectKernels() {
+#ifdef ACCUMULATE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+    return &kAvx2Kernels;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return &kSseKernels;
+  }
+#endif
+  return &kScalarKernels;
+}
+
+const KernelSet *g_kernels = DetectKernels();
+
+}  // namespace
+
+size_t PixelTypeSize(PixelType type) {
+  switch (type) {
+    case kPixelU8:
+      return 1;
+    case kPixelHalf:
+      return 2;
+    case kPixelFloat:
+      return 4;
+  }
+  return 0;
+}
+
+Accumulator::Accumulator(size_t size) {
+  Reset(size);
+}
+
+void Accumulator::Reset(size_t size) {
+  sum_.assign(size, 0.0f);
+  compensation_.assign(size, 0.0f);
+}
+
+void Accumulator::Add(PixelType type, const void *pixels, float weight) {
+  AddRange(type, pixels, weight, 0, sum_.size());
+}
+
+void Accumulator::AddRange(PixelType type, const void *pixels, float weight,
+                           size_t begin, size_t count) {
+  g_kernels->kernels[type](pixels, weight,
+                           sum_.data() + begin, compensation_.data() + begin,
+                           count);
+}
+
+void Accumulator::Resolve(float scale, float *out) const {
+  for (size_t i = 0; i < sum_.size(); ++i) {
+    out[i] = sum_[i] * scale;
+  }
+}
+
+double SumOfSquaredColors(PixelType type, const void *rgba,
+                          size_t num_pixels) {
+  double sum = 0.0;
+  for (size_t i = 0; i < num_pixels; ++i) {
+    for (int c = 0; c < 3; ++c) {
+      float x = 0.0f;
+      switch (type) {
+        case kPixelU8:
+          x = static_cast<const uint8_t*>(rgba)[i * 4 + c];
+          break;
+        case kPixelHalf:
+          x = HalfToFloat(static_cast<const uint16_t*>(rgba)[i * 4 + c]);
+          break;
+        case kPixelFloat:
+          x = static_cast<const float*>(rgba)[i * 4 + c];
+          break;
+      }
+      sum += static_cast<double>(x) * x;
+    }
+  }
+  return sum;
+}
+
+const char *AccumulateKernelName() {
+  return g_kernels->name;
+}
+
+bool SetAccumulateKernel(const std::string& name) {
+  if (name == kScalarKernels.name) {
+    g_kernels = &kScalarKernels;
+    return false;
+  }
+#ifdef ACCUMULATE_X86
+  __builtin_cpu_init();
+  if (name == kSseKernels.name && __builtin_cpu_supports("sse4.1")) {
+    g_kernels = &kSseKernels;
+    return false;
+  }
+  if (name == kAvx2Kernels.name &&
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+    g_kernels = &kAvx2Kernels;
+    return false;
+  }
+#endif
+  return true;
+}
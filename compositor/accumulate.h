@@ -0,0 +1,63 @@
+// Accumulate: weighted sum of images with SIMD kernels
+// Copyright 2015 Light Transport Entertainment.
+
+#ifndef COMPOSITOR_ACCUMULATE_H_
+#define COMPOSITOR_ACCUMULATE_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Channel type of the pixels to accumulate.
+enum PixelType {
+  kPixelU8,
+  kPixelHalf,
+  kPixelFloat
+};
+
+// Size of a channel in bytes.
+size_t PixelTypeSize(PixelType type);
+
+// Sums weighted images in float32 with Kahan compensation, so that hundreds
+// of inputs can be summed without losing the low bits.
+//
+// The kernel converting the input channels to float is fused with the
+// weighted add, and is picked at runtime from AVX2, SSE4.1 and scalar.
+class Accumulator {
+ public:
+  explicit Accumulator(size_t size = 0);
+
+  // Clears the accumulator to size channels of zero.
+  void Reset(size_t size);
+  size_t size() const { return sum_.size(); }
+
+  // Adds weight * pixels[i] to every channel i.
+  void Add(PixelType type, const void *pixels, float weight);
+
+  // Adds weight * pixels[i] to the channels [begin, begin + count) only.
+  // pixels points to the channel at begin.
+  void AddRange(PixelType type, const void *pixels, float weight,
+                size_t begin, size_t count);
+
+  // Stores sum[i] * scale to out, e.g. scale = 1 / sum of weights.
+  void Resolve(float scale, float *out) const;
+
+  const float *sum() const { return sum_.data(); }
+
+ private:
+  std::vector<float> sum_;
+  std::vector<float> compensation_;
+};
+
+// Sum of the squares of the red, green and blue channels of num_pixels RGBA
+// pixels, e.g. for variance estimates.
+double SumOfSquaredColors(PixelType type, const void *rgba, size_t num_pixels);
+
+// Name of the kernel in use: "avx2", "sse4.1" or "scalar".
+const char *AccumulateKernelName();
+
+// Forces a kernel, e.g. for benchmarks.
+// Returns true if the kernel is not supported on this CPU.
+bool SetAccumulateKernel(const std::string& name);
+
+#endif
@@ -1,2 +1,2 @@
 #!/bin/sh
-g++ -o compositor *.cc *.cpp
+g++ -o compositor *.cc *.cpp -pthread -lz
@@ -0,0 +1,238 @@
+// Compose: weighted average of image files, one scanline at a time
+// Copyright 2015 Light Transport Entertainment.
+
+#include "compose.h"
+
+#include <cstdio>
+#include <memory>
+
+#include "accumulate.h"
+#include "png_stream.h"
+
+namespace {
+
+// Reads an input image one RGBA scanline at a time.
+class RowSource {
+ public:
+  RowSource() : streaming_(false), row_(0) {
+    image_.width = 0;
+    image_.height = 0;
+  }
+
+  // Returns non-zero if failed.
+  int Open(const std::string& file_name) {
+    if (!png_.Open(file_name)) {
+      streaming_ = true;
+      image_.type = kPixelU8;
+      image_.width = png_.width();
+      image_.height = png_.height();
+      image_.samples = 0;
+      image_.weight = 0;
+      image_.pixels.resize(image_.width * 4);
+      return 0;
+    }
+
+    // Not a PNG that can be streamed.
+    std::string content;
+    return ReadFileContent(file_name, &content) || OpenContent(content);
+  }
+
+  // Decodes an image in memory as a whole.
+  // Returns non-zero if failed.
+  int OpenContent(const std::string& content) {
+    return DecodeImage(content.data(), content.size(), &image_);
+  }
+
+  int width() const { return image_.width; }
+  int height() const { return image_.height; }
+  PixelType type() const { return image_.type; }
+  // Metadata of partial images; 0 for the others.
+  uint64_t samples() const { return image_.samples; }
+  uint64_t weight() const { return image_.weight; }
+
+  // Returns the next row of width() * 4 channels, or NULL if failed.
+  const void *NextRow() {
+    if (streaming_) {
+      return png_.ReadRow(image_.pixels.data()) ? NULL : image_.pixels.data();
+    }
+    const size_t stride = image_.width * 4 * PixelTypeSize(image_.type);
+    return image_.pixels.data() + stride * row_++;
+  }
+
+ private:
+  RowSource(const RowSource&);
+  RowSource& operator=(const RowSource&);
+
+  PngRowReader png_;
+  bool streaming_;
+  // The current row if streaming, or the whole image otherwise.
+  DecodedImage image_;
+  int row_;
+};
+
+// Inputs of a composition, weighted and checked to be of the same size.
+struct Composition {
+  Composition() : count(0), samples(0), width(0), height(0) {
+  }
+
+  // Returns non-zero if the source does not match the sources so far.
+  int Add(std::unique_ptr<RowSource> source, const std::string& name,
+          uint64_t given_weight) {
+    if (sources.empty()) {
+      width = source->width();
+      height = source->height();
+    } else if (source->width() != width || source->height() != height) {
+      fprintf(stderr, "size of image %s does not match\n", name.c_str());
+      return 1;
+    }
+
+    // Partial images are weighted by the inputs they were composed from,
+    // unless the weight is given. Other images count as a single sample.
+    uint64_t weight = 1;
+    if (given_weight > 0) {
+      weight = given_weight;
+    } else if (source->weight() > 0) {
+      weight = source->weight();
+    }
+    weights.push_back(weight);
+    count += weight;
+    samples += source->samples() > 0 ? source->samples() : weight;
+    sources.push_back(std::move(source));
+    names.push_back(name);
+    return 0;
+  }
+
+  // Stores the weighted mean of the next row of the sources to row.
+  // Returns non-zero if failed.
+  int NextRow(Accumulator *accumulator, float *row) {
+    const size_t stride = width * 4;
+    accumulator->Reset(stride);
+    for (size_t i = 0; i < sources.size(); ++i) {
+      const void *pixels = sources[i]->NextRow();
+      if (pixels == NULL) {
+        fprintf(stderr, "failed to load image %s\n", names[i].c_str());
+        return 1;
+      }
+      accumulator->Add(sources[i]->type(), pixels, weights[i]);
+    }
+    accumulator->Resolve(1.0 / count, row);
+    return 0;
+  }
+
+  // Composes all the rows and encodes them.
+  // Returns non-zero if failed.
+  int Encode(ImageFormat output_format, std::string *content) {
+    const size_t stride = width * 4;
+    Accumulator accumulator;
+    std::vector<float> accumulated(stride * height);
+    for (int y = 0; y < height; ++y) {
+      if (NextRow(&accumulator, &accumulated[stride * y])) {
+        return 1;
+      }
+    }
+
+    // Partial images keep the total weight for the next reduction.
+    return EncodeImage(output_format, accumulated.data(), width, height,
+                       samples, count, content);
+  }
+
+  std::vector<std::unique_ptr<RowSource> > sources;
+  std::vector<std::string> names;
+  std::vector<float> weights;
+  uint64_t count;
+  uint64_t samples;
+  int width;
+  int height;
+};
+
+}  // namespace
+
+int ComposeFiles(ImageFormat output_format,
+                 const std::string& output_file_name,
+                 const std::vector<ComposeInput>& inputs) {
+  if (output_format == kFormatError) {
+    fprintf(stderr, "unsupported output file format\n");
+    return 1;
+  }
+  if (inputs.empty()) {
+    fprintf(stderr, "no input images\n");
+    return 1;
+  }
+
+  Composition composition;
+  for (auto&& input : inputs) {
+    std::unique_ptr<RowSource> source(new RowSource());
+    if (source->Open(input.file_name)) {
+      fprintf(stderr, "failed to load image %s\n", input.file_name.c_str());
+      return 1;
+    }
+    if (composition.Add(std::move(source), input.file_name, input.weight)) {
+      return 1;
+    }
+  }
+
+  if (output_format != kFormatPng) {
+    std::string content;
+    return composition.Encode(output_format, &content) ||
+      WriteFileContent(output_file_name, content);
+  }
+
+  // Accumulate one row of all the inputs at a time.
+  const int width = composition.width;
+  const int height = composition.height;
+  PngRowWriter png_writer;
+  if (png_writer.Open(output_file_name, width, height)) {
+    fprintf(stderr, "failed to encode png image\n");
+    return 1;
+  }
+
+  const size_t stride = width * 4;
+  Accumulator accumulator;
+  std::vector<float> row(stride);
+  std::vector<unsigned char> output_row(stride);
+  for (int y = 0; y < height; ++y) {
+    if (composition.NextRow(&accumulator, row.data())) {
+      return 1;
+    }
+    for (size_t x = 0; x < stride; ++x) {
+      output_row[x] = QuantizeChannel(row[x]);
+    }
+    if (png_writer.WriteRow(output_row.data())) {
+      fprintf(stderr, "failed to encode png image\n");
+      return 1;
+    }
+  }
+
+  if (png_writer.Close()) {
+    fprintf(stderr, "failed to encode png image\n");
+    return 1;
+  }
+  return 0;
+}
+
+int ComposeImages(ImageFormat output_format,
+                  const std::vector<ComposeBuffer>& inputs,
+                  std::string *content) {
+  if (output_format == kFormatError) {
+    fprintf(stderr, "unsupported output file format\n");
+    return 1;
+  }
+  if (inputs.empty()) {
+    fprintf(stderr, "no input images\n");
+    return 1;
+  }
+
+  Composition composition;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    const std::string name = "#" + std::to_string(i);
+    std::unique_ptr<RowSource> source(new RowSource());
+    if (source->OpenContent(inputs[i].content)) {
+      fprintf(stderr, "failed to decode image %s\n", name.c_str());
+      return 1;
+    }
+    if (composition.Add(std::move(source), name, inputs[i].weight)) {
+      return 1;
+    }
+  }
+  return composition.Encode(output_format, content);
+}
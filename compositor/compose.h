@@ -0,0 +1,43 @@
+// Compose: weighted average of image files, one scanline at a time
+// Copyright 2015 Light Transport Entertainment.
+
+#ifndef COMPOSITOR_COMPOSE_H_
+#define COMPOSITOR_COMPOSE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "image_io.h"
+
+struct ComposeInput {
+  std::string file_name;
+  // 0 takes the weight stored in a partial image, or 1 for the others.
+  uint64_t weight;
+};
+
+// An input image already in memory, e.g. received from another worker.
+struct ComposeBuffer {
+  // Encoded image of any format DecodeImage takes.
+  std::string content;
+  // 0 takes the weight stored in a partial image, or 1 for the others.
+  uint64_t weight;
+};
+
+// Composes the input files into the output file of the format.
+// PNG inputs and outputs are streamed, so that composing hundreds of large
+// inputs needs only a few rows of each in memory. Other formats are decoded
+// as a whole up front.
+// Returns non-zero if failed.
+int ComposeFiles(ImageFormat output_format,
+                 const std::string& output_file_name,
+                 const std::vector<ComposeInput>& inputs);
+
+// Composes the input images in memory into an image of the format, so that
+// reductions do not write their inputs to files and read them back.
+// Returns non-zero if failed.
+int ComposeImages(ImageFormat output_format,
+                  const std::vector<ComposeBuffer>& inputs,
+                  std::string *content);
+
+#endif
@@ -1,290 +1,217 @@
 // Compositor: composite PNG, JPEG, EXR images
 // Copyright 2015 Light Transport Entertainment.
 
-#include <cassert>
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
 #include <string>
 #include <vector>
 
-#include "jpgd.h"
-#include "jpge.h"
-#include "lodepng.h"
-#include "tinyexr.h"
+#include "compose.h"
 
 namespace {
 
-enum ImageFileFormats {
-  kFormatError,
-  kFormatPng,
-  kFormatJpg,
-  kFormatExr
-};
+// Images of buffer requests larger than this are rejected instead of
+// allocated, e.g. for a corrupt header. It holds a float RGBA image of
+// 8192 x 8192 pixels.
+const unsigned long long kMaxBufferSize = 1ULL << 30;
 
-int LoadPng(const std::string& file_name,
-            std::vector<double>* image,
-            int* width, int* height) {
-  std::vector<unsigned char> decoded_image;
-  unsigned unsigned_with, unsigned_height;
-
-  unsigned error = lodepng::decode(decoded_image,
-                                   unsigned_with, unsigned_height, file_name);
-  if (error) {
-    fprintf(stderr, "failed to decode png image\n");
-    return 1;
-  }
-
-  *width = unsigned_with;
-  *height = unsigned_height;
-
-  image->resize(decoded_image.size());
-  for (int i = 0; i < decoded_image.size(); ++i) {
-    (*image)[i] = decoded_image[i];
+// Composes with the arguments of the command line.
+int Compose(const std::vector<std::string>& args) {
+  size_t i = 0;
+  bool hasWeight = false;
+  if (i < args.size() && args[i] == "--weight") {
+    hasWeight = true;
+    ++i;
   }
-  return 0;
-}
-
-int LoadJpg(const std::string& file_name,
-            std::vector<double>* image,
-            int* width, int* height) {
-  int actual_comps;
-
-  unsigned char* decoded_image =
-    jpgd::decompress_jpeg_image_from_file(file_name.c_str(),
-                                          width, height, &actual_comps, 4);
-
-  if (decoded_image == NULL) {
-    fprintf(stderr, "failed to decode JPEG image\n");
+  if (args.size() < i + 3) {
+    fprintf(stderr, "not enough arguments\n");
     return 1;
   }
 
-  image->resize(*width * *height * 4);
-  for (int i = 0; i < image->size(); ++i) {
-    (*image)[i] = decoded_image[i];
+  const std::string output_type = args[i++];
+  const std::string output_file_name = args[i++];
+  std::vector<ComposeInput> inputs;
+  while (i < args.size()) {
+    ComposeInput input;
+    input.weight = 0;
+    if (hasWeight) {
+      input.weight = strtoull(args[i++].c_str(), NULL, 10);
+      if (i >= args.size()) {
+        fprintf(stderr, "input file is missing for the weight\n");
+        return 1;
+      }
+    }
+    input.file_name = args[i++];
+    inputs.push_back(input);
   }
-  return 0;
-}
 
-int LoadExr(const std::string& file_name,
-            std::vector<double>* image,
-            int* width, int* height) {
-  float* out_rgba;
-  const char* error;
-
-  if (LoadEXR(&out_rgba, width, height, file_name.c_str(), &error)) {
-    fprintf(stderr, "failed to decode EXR image: %s\n", error);
+  const ImageFormat output_format = ParseImageFormat(output_type);
+  if (output_format == kFormatError) {
+    fprintf(stderr, "unsupported output file format %s\n", output_type.c_str());
     return 1;
   }
-
-  image->resize(*width * *height * 4);
-  for (int i = 0; i < image->size(); ++i) {
-    (*image)[i] = out_rgba[i];
-  }
-  return 0;
-}
-
-ImageFileFormats ReadFileSignature(const std::string& file_name) {
-  FILE *fp = fopen(file_name.c_str(), "r");
-  if (fp == NULL) {
-    return kFormatError;
-  }
-
-  ImageFileFormats result = kFormatError;
-
-  unsigned char sig[4];
-  fread(sig, 4, 1, fp);
-
-  if (sig[0] == 0x89 &&
-      sig[1] == 0x50 &&
-      sig[2] == 0x4E &&
-      sig[3] == 0x47) {
-    result = kFormatPng;
-  } else if (sig[0] == 0xFF &&
-             sig[1] == 0xD8 &&
-             sig[2] == 0xFF &&
-             sig[3] == 0xE0) {
-    result = kFormatJpg;
-  } else if (sig[0] == 0x76 &&
-             sig[1] == 0x2F &&
-             sig[2] == 0x31 &&
-             sig[3] == 0x01) {
-    result = kFormatExr;
-  }
-
-  fclose(fp);
-
-  return result;
+  return ComposeFiles(output_format, output_file_name, inputs);
 }
 
-int LoadImage(const std::string& file_name,
-              std::vector<double>* image,
-              int* width, int* height) {
-  switch (ReadFileSignature(file_name)) {
-    case kFormatError:
-      fprintf(stderr,
-              "failed to get the format of the input file %s",
-              file_name.c_str());
-      return 1;
-    case kFormatPng:
-      return LoadPng(file_name, image, width, height);
-    case kFormatJpg:
-      return LoadJpg(file_name, image, width, height);
-    case kFormatExr:
-      return LoadExr(file_name, image, width, height);
+std::vector<std::string> SplitTabs(const std::string& line) {
+  std::vector<std::string> fields;
+  std::stringstream ss(line);
+  std::string field;
+  while (std::getline(ss, field, '\t')) {
+    fields.push_back(field);
   }
+  return fields;
 }
 
-int SavePng(const std::string& file_name,
-            const std::vector<double>& image,
-            int width, int height) {
-  std::vector<unsigned char> output_image(image.size());
-  for (int i = 0; i < image.size(); ++i) {
-    output_image[i] = image[i];
-  }
-
-  unsigned error = lodepng::encode(file_name, output_image, width, height);
-  if (error) {
-    fprintf(stderr, "failed to encode png image\n");
+// Parses a decimal number. Returns non-zero if failed.
+int ParseNumber(const std::string& field, unsigned long long *number) {
+  if (field.empty() || field[0] < '0' || field[0] > '9') {
     return 1;
   }
-  return 0;
+  char *end;
+  errno = 0;
+  *number = strtoull(field.c_str(), &end, 10);
+  return *end != '\0' || errno == ERANGE;
 }
 
-int SaveJpg(const std::string& file_name,
-            const std::vector<double>& image,
-            int width, int height) {
-  std::vector<unsigned char> three_channel_image(image.size() / 4 * 3);
-  for (int i = 0, i_max = image.size() / 4; i < i_max; ++i) {
-    three_channel_image[3 * i + 0] = image[4 * i + 0];
-    three_channel_image[3 * i + 1] = image[4 * i + 1];
-    three_channel_image[3 * i + 2] = image[4 * i + 2];
+// Discards size bytes of stdin. Returns non-zero if failed.
+int SkipInput(unsigned long long size) {
+  char buffer[64 * 1024];
+  while (size > 0) {
+    const size_t count = std::min<unsigned long long>(size, sizeof(buffer));
+    if (!std::cin.read(buffer, count)) {
+      return 1;
+    }
+    size -= count;
   }
-  jpge::compress_image_to_jpeg_file(file_name.c_str(),
-                                    width, height, 3,
-                                    &three_channel_image[0]);
   return 0;
 }
 
-int SaveExr(const std::string& file_name,
-            const std::vector<double>& image,
-            int width, int height) {
-  EXRImage exr;
-
-  exr.num_channels = 4;
-
-  const char *channel_names[] = {"R", "G", "B", "A"};
-  exr.channel_names = channel_names;
-
-  int pixel_types[] = {
-    TINYEXR_PIXELTYPE_FLOAT,
-    TINYEXR_PIXELTYPE_FLOAT,
-    TINYEXR_PIXELTYPE_FLOAT,
-    TINYEXR_PIXELTYPE_FLOAT};
-  exr.pixel_types = pixel_types;
-
-  exr.width = width;
-  exr.height = height;
-
-  std::vector<std::vector<float> > output_image(
-      4,
-      std::vector<float>(2 * width * height));
-
-  for (int i = 0, i_max = image.size() / 4; i < i_max; ++i) {
-    output_image[0][i] = image[4 * i + 0];
-    output_image[1][i] = image[4 * i + 1];
-    output_image[2][i] = image[4 * i + 2];
-    output_image[3][i] = image[4 * i + 3];
-  }
-
-  unsigned char *images[4];
-  for (int i = 0; i < 4; ++i) {
-    images[i] = reinterpret_cast<unsigned char*>(&output_image[i]);
-  }
+// Reads the inputs of a buffer request from stdin: for each of them, a line
+// of the weight and the size separated by a tab, followed by the image.
+// Once an image is larger than kMaxBufferSize, it and the rest of the images
+// are skipped, and *oversized is set.
+// Returns non-zero if the request is malformed, after which the stream
+// cannot be followed any more.
+int ReadComposeBuffers(size_t num_inputs, std::vector<ComposeBuffer> *inputs,
+                       bool *oversized) {
+  *oversized = false;
+  for (size_t i = 0; i < num_inputs; ++i) {
+    std::string line;
+    if (!std::getline(std::cin, line)) {
+      return 1;
+    }
+    const std::vector<std::string> fields = SplitTabs(line);
+    unsigned long long weight, size;
+    if (fields.size() != 2 || ParseNumber(fields[0], &weight) ||
+        ParseNumber(fields[1], &size)) {
+      fprintf(stderr, "malformed input header %s\n", line.c_str());
+      return 1;
+    }
 
-  exr.images = images;
+    if (size > kMaxBufferSize && !*oversized) {
+      fprintf(stderr, "input image of %llu bytes is too large\n", size);
+      *oversized = true;
+      inputs->clear();
+    }
+    if (*oversized) {
+      if (SkipInput(size)) {
+        fprintf(stderr, "input image is truncated\n");
+        return 1;
+      }
+      continue;
+    }
 
-  const char *error;
-  if (SaveMultiChannelEXRToFile(&exr, file_name.c_str(), &error)) {
-    fprintf(stderr, "failed to encode EXR image: %s\n", error);
-    return 1;
+    ComposeBuffer input;
+    input.weight = weight;
+    input.content.resize(size);
+    if (!std::cin.read(&input.content[0], input.content.size())) {
+      fprintf(stderr, "input image is truncated\n");
+      return 1;
+    }
+    inputs->push_back(std::move(input));
   }
-
   return 0;
 }
 
-}  // namespace
-
-int main(int argc, char *argv[]) {
-  if (argc < 4) {
-    fprintf(stderr,
-            "usage: compositor [--weight] <output type> "
-            "<output file> [weight] <input files> ...\n");
-    fprintf(stderr, "<output type> = png | jpg | exr\n");
-    return 1;
-  }
-
-  int i = 1;
-  std::string output_type = argv[i++];
-  bool hasWeight = false;
-  if (output_type == "--weight") {
-    hasWeight = true;
-    output_type = argv[i++];
-  }
-  std::string output_file_name = argv[i++];
-  std::vector<int> input_weights;
-  std::vector<std::string> input_file_names;
-  while (i < argc) {
-    if (hasWeight) {
-      input_weights.push_back(atoi(argv[i++]));
+// Keeps composing for the requests from stdin, so that reducers do not pay
+// a process spawn for each reduction. A request is either
+//
+//   - a line of the command line arguments separated by tabs, composing
+//     files, answered by a line of "ok" or "error", or
+//   - a line of "--buffers", the output type and the number of inputs
+//     separated by tabs, followed by the inputs as ReadComposeBuffers()
+//     reads them, answered by a line of "ok" and the size of the composed
+//     image separated by a tab followed by the image, or by "error".
+//     Requests with an image over kMaxBufferSize are answered by "error"
+//     without composing.
+//
+// Buffer requests pass the images through the pipes, so that reductions do
+// not write their inputs to files and read them back.
+int Serve() {
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    const std::vector<std::string> args = SplitTabs(line);
+
+    if (args.empty() || args[0] != "--buffers") {
+      const int error = Compose(args);
+      fflush(stderr);
+      printf("%s\n", error ? "error" : "ok");
+      fflush(stdout);
+      continue;
     }
-    input_file_names.push_back(argv[i++]);
-  }
-
-  std::vector<double> accumulated;
-  double count = 0;
-  int width, height;
 
-  for (i = 0; i < input_file_names.size(); ++i) {
-    std::vector<double> image;
-    int current_width, current_height;
-    if (LoadImage(
-            input_file_names[i], &image, &current_width, &current_height)) {
-      fprintf(stderr, "failed to load image %s\n", input_file_names[i].c_str());
+    std::vector<ComposeBuffer> inputs;
+    unsigned long long num_inputs;
+    bool oversized;
+    if (args.size() != 3 || ParseNumber(args[2], &num_inputs) ||
+        ReadComposeBuffers(num_inputs, &inputs, &oversized)) {
+      fprintf(stderr, "malformed buffer request\n");
+      printf("error\n");
       return 1;
     }
-
-    if (accumulated.size() == 0) {
-      accumulated.resize(image.size());
-      width = current_width;
-      height = current_height;
+    if (oversized) {
+      // The images were skipped, so the next request can still be read.
+      fflush(stderr);
+      printf("error\n");
+      fflush(stdout);
+      continue;
     }
 
-    for (int j = 0; j < image.size(); ++j) {
-      if (hasWeight) {
-        accumulated[j] += image[j] * input_weights[i];
-      } else {
-        accumulated[j] += image[j];
-      }
-    }
-
-    if (hasWeight) {
-      count += input_weights[i];
+    std::string content;
+    const ImageFormat output_format = ParseImageFormat(args[1]);
+    const int error = ComposeImages(output_format, inputs, &content);
+    fflush(stderr);
+    if (error) {
+      printf("error\n");
     } else {
-      ++count;
+      printf("ok\t%zu\n", content.size());
+      fwrite(content.data(), 1, content.size(), stdout);
     }
+    fflush(stdout);
   }
+  return 0;
+}
 
-  for (int i = 0; i < accumulated.size(); ++i) {
-    accumulated[i] /= count;
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc == 2 && std::string(argv[1]) == "--server") {
+    return Serve();
   }
 
-  if (output_type == "png") {
-    return SavePng(output_file_name, accumulated, width, height);
-  } else if (output_type == "jpg") {
-    return SaveJpg(output_file_name, accumulated, width, height);
-  } else if (output_type == "exr") {
-    return SaveExr(output_file_name, accumulated, width, height);
-  } else {
-    fprintf(stderr, "unsupported output file format %s\n", output_type.c_str());
+  if (argc < 4) {
+    fprintf(stderr,
+            "usage: compositor [--weight] <output type> "
+            "<output file> [weight] <input files> ...\n"
+            "       compositor --server\n");
+    fprintf(stderr, "<output type> = png | jpg | exr | partial\n");
     return 1;
   }
+
+  return Compose(std::vector<std::string>(argv + 1, argv + argc));
 }
@@ -0,0 +1,386 @@
+// ImageIO: in-memory image codecs shared by the compositor and the worker
+// Copyright 2015 Light Transport Entertainment.
+
+#include "image_io.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <zlib.h>
+
+#include "jpgd.h"
+#include "jpge.h"
+#include "lodepng.h"
+#include "partial_image.h"
+#include "png_stream.h"
+#include "tinyexr.h"
+
+namespace {
+
+int DecodePng(const void *data, size_t size, DecodedImage *image) {
+  unsigned width, height;
+  unsigned error = lodepng::decode(
+      image->pixels, width, height,
+      static_cast<const unsigned char*>(data), size);
+  if (error) {
+    fprintf(stderr, "failed to decode png image\n");
+    return 1;
+  }
+
+  image->type = kPixelU8;
+  image->width = width;
+  image->height = height;
+  return 0;
+}
+
+int DecodeJpg(const void *data, size_t size, DecodedImage *image) {
+  int actual_comps;
+  unsigned char *decoded = jpgd::decompress_jpeg_image_from_memory(
+      static_cast<const unsigned char*>(data), size,
+      &image->width, &image->height, &actual_comps, 4);
+  if (decoded == NULL) {
+    fprintf(stderr, "failed to decode JPEG image\n");
+    return 1;
+  }
+
+  image->type = kPixelU8;
+  image->pixels.assign(decoded, decoded + image->width * image->height * 4);
+  free(decoded);
+  return 0;
+}
+
+void FreeExrImage(EXRImage *exr) {
+  for (int c = 0; c < exr->num_channels; ++c) {
+    free(exr->images[c]);
+    free(const_cast<char*>(exr->channel_names[c]));
+  }
+  free(exr->images);
+  free(exr->channel_names);
+  free(exr->pixel_types);
+}
+
+int DecodeExr(const void *data, size_t size, DecodedImage *image) {
+  EXRImage exr;
+  const char *error;
+  if (LoadMultiChannelEXRFromMemory(
+        &exr, static_cast<const unsigned char*>(data), &error)) {
+    fprintf(stderr, "failed to decode EXR image: %s\n", error);
+    return 1;
+  }
+
+  // Channels are sorted by name in the file, and decoded to float.
+  const char *names[] = {"R", "G", "B", "A"};
+  const float *channels[4] = {NULL, NULL, NULL, NULL};
+  for (int c = 0; c < exr.num_channels; ++c) {
+    for (int i = 0; i < 4; ++i) {
+      if (!strcmp(exr.channel_names[c], names[i])) {
+        channels[i] = reinterpret_cast<float*>(exr.images[c]);
+      }
+    }
+  }
+  if (channels[0] == NULL || channels[1] == NULL || channels[2] == NULL) {
+    fprintf(stderr, "failed to decode EXR image: RGB channels not found\n");
+    FreeExrImage(&exr);
+    return 1;
+  }
+
+  image->type = kPixelFloat;
+  image->width = exr.width;
+  image->height = exr.height;
+
+  const size_t num_pixels = static_cast<size_t>(exr.width) * exr.height;
+  image->pixels.resize(num_pixels * 4 * sizeof(float));
+  float *rgba = reinterpret_cast<float*>(image->pixels.data());
+  for (size_t i = 0; i < num_pixels; ++i) {
+    for (int c = 0; c < 4; ++c) {
+      rgba[4 * i + c] = kExrScale * (channels[c] ? channels[c][i] : 1.0f);
+    }
+  }
+
+  FreeExrImage(&exr);
+  return 0;
+}
+
+int DecodePartial(const void *data, size_t size, DecodedImage *image) {
+  PartialImage partial;
+  if (DecodePartialImage(data, size, &partial)) {
+    fprintf(stderr, "failed to decode partial image\n");
+    return 1;
+  }
+
+  image->type = partial.type;
+  image->pixels.swap(partial.pixels);
+  image->width = partial.width;
+  image->height = partial.height;
+  image->samples = partial.samples;
+  image->weight = partial.weight;
+  return 0;
+}
+
+int EncodePng(const float *rgba, int width, int height, PngProfile profile,
+              int num_threads, std::string *content) {
+  const size_t size = static_cast<size_t>(width) * height * 4;
+  std::vector<unsigned char> output_image(size);
+  for (size_t i = 0; i < size; ++i) {
+    output_image[i] = QuantizeChannel(rgba[i]);
+  }
+  return EncodePngImage(output_image.data(), width, height, profile,
+                        content, num_threads);
+}
+
+int EncodeJpg(const float *rgba, int width, int height,
+              std::string *content) {
+  const size_t num_pixels = static_cast<size_t>(width) * height;
+  std::vector<unsigned char> three_channel_image(num_pixels * 3);
+  for (size_t i = 0; i < num_pixels; ++i) {
+    three_channel_image[3 * i + 0] = QuantizeChannel(rgba[4 * i + 0]);
+    three_channel_image[3 * i + 1] = QuantizeChannel(rgba[4 * i + 1]);
+    three_channel_image[3 * i + 2] = QuantizeChannel(rgba[4 * i + 2]);
+  }
+
+  // jpge needs a buffer large enough for the whole output.
+  int jpg_size = num_pixels * 3 + 1024;
+  std::vector<unsigned char> jpg(jpg_size);
+  if (!jpge::compress_image_to_jpeg_file_in_memory(
+        jpg.data(), jpg_size, width, height, 3, three_channel_image.data())) {
+    fprintf(stderr, "failed to encode JPEG image\n");
+    return 1;
+  }
+
+  content->assign(jpg.begin(), jpg.begin() + jpg_size);
+  return 0;
+}
+
+int EncodeExr(const float *rgba, int width, int height,
+              std::string *content) {
+  EXRImage exr;
+
+  exr.num_channels = 4;
+
+  const char *channel_names[] = {"R", "G", "B", "A"};
+  exr.channel_names = channel_names;
+
+  int pixel_types[] = {
+    TINYEXR_PIXELTYPE_FLOAT,
+    TINYEXR_PIXELTYPE_FLOAT,
+    TINYEXR_PIXELTYPE_FLOAT,
+    TINYEXR_PIXELTYPE_FLOAT};
+  exr.pixel_types = pixel_types;
+
+  exr.width = width;
+  exr.height = height;
+
+  const size_t num_pixels = static_cast<size_t>(width) * height;
+  std::vector<std::vector<float> > output_image(
+      4, std::vector<float>(num_pixels));
+  for (size_t i = 0; i < num_pixels; ++i) {
+    output_image[0][i] = rgba[4 * i + 0] / kExrScale;
+    output_image[1][i] = rgba[4 * i + 1] / kExrScale;
+    output_image[2][i] = rgba[4 * i + 2] / kExrScale;
+    output_image[3][i] = rgba[4 * i + 3] / kExrScale;
+  }
+
+  unsigned char *images[4];
+  for (int i = 0; i < 4; ++i) {
+    images[i] = reinterpret_cast<unsigned char*>(output_image[i].data());
+  }
+  exr.images = images;
+
+  unsigned char *memory;
+  const char *error;
+  const size_t size = SaveMultiChannelEXRToMemory(&exr, &memory, &error);
+  if (size == 0 || size == static_cast<size_t>(-1)) {
+    fprintf(stderr, "failed to encode EXR image: %s\n", error);
+    return 1;
+  }
+
+  content->assign(reinterpret_cast<char*>(memory), size);
+  free(memory);
+  return 0;
+}
+
+}  // namespace
+
+ImageFormat ParseImageFormat(const std::string& name) {
+  if (name == "png") {
+    return kFormatPng;
+  } else if (name == "jpg") {
+    return kFormatJpg;
+  } else if (name == "exr") {
+    return kFormatExr;
+  } else if (name == "partial") {
+    return kFormatPartial;
+  }
+  return kFormatError;
+}
+
+ImageFormat DetectImageFormat(const void *data, size_t size) {
+  if (size < 4) {
+    return kFormatError;
+  }
+
+  const unsigned char *sig = static_cast<const unsigned char*>(data);
+  if (sig[0] == 0x89 &&
+      sig[1] == 0x50 &&
+      sig[2] == 0x4E &&
+      sig[3] == 0x47) {
+    return kFormatPng;
+  } else if (sig[0] == 0xFF &&
+             sig[1] == 0xD8 &&
+             sig[2] == 0xFF) {
+    // Any marker may follow SOI; not only JFIF APP0 but e.g. Exif APP1.
+    return kFormatJpg;
+  } else if (sig[0] == 0x76 &&
+             sig[1] == 0x2F &&
+             sig[2] == 0x31 &&
+             sig[3] == 0x01) {
+    return kFormatExr;
+  } else if (IsPartialImage(data, size)) {
+    return kFormatPartial;
+  }
+  return kFormatError;
+}
+
+int DecodeImage(const void *data, size_t size, DecodedImage *image) {
+  image->samples = 0;
+  image->weight = 0;
+
+  switch (DetectImageFormat(data, size)) {
+    case kFormatError:
+      fprintf(stderr, "failed to get the format of the image\n");
+      return 1;
+    case kFormatPng:
+      return DecodePng(data, size, image);
+    case kFormatJpg:
+      return DecodeJpg(data, size, image);
+    case kFormatExr:
+      return DecodeExr(data, size, image);
+    case kFormatPartial:
+      return DecodePartial(data, size, image);
+  }
+  return 1;
+}
+
+PngProfile ParsePngProfile(const std::string& name) {
+  if (name == "best") {
+    return kPngBest;
+  } else if (name == "fast") {
+    return kPngFast;
+  } else if (name == "rle") {
+    return kPngRle;
+  } else if (name == "store") {
+    return kPngStore;
+  }
+  return kPngError;
+}
+
+int EncodePngImage(const unsigned char *rgba, int width, int height,
+                   PngProfile profile, std::string *content, int num_threads) {
+  int level = 9;
+  int strategy = Z_DEFAULT_STRATEGY;
+  bool adaptive = true;
+  switch (profile) {
+    case kPngBest:
+      break;
+    case kPngFast:
+      level = 1;
+      break;
+    case kPngRle:
+      level = 1;
+      strategy = Z_RLE;
+      adaptive = false;
+      break;
+    case kPngStore:
+      level = 0;
+      adaptive = false;
+      break;
+    case kPngError:
+      fprintf(stderr, "unknown png profile\n");
+      return 1;
+  }
+
+  const size_t num_pixels = static_cast<size_t>(width) * height;
+  bool opaque = true;
+  bool grey = true;
+  for (size_t i = 0; i < num_pixels; ++i) {
+    const unsigned char *pixel = rgba + i * 4;
+    opaque &= pixel[3] == 255;
+    grey &= pixel[0] == pixel[1] && pixel[0] == pixel[2];
+  }
+  const int channels = !opaque ? 4 : grey ? 1 : 3;
+  std::vector<unsigned char> reduced;
+  const unsigned char *pixels = rgba;
+  if (channels < 4) {
+    reduced.resize(num_pixels * channels);
+    for (size_t i = 0; i < num_pixels; ++i) {
+      memcpy(&reduced[i * channels], rgba + i * 4, channels);
+    }
+    pixels = reduced.data();
+  }
+
+  if (EncodePngParallel(pixels, width, height, channels, level, strategy,
+                        adaptive, num_threads, content)) {
+    fprintf(stderr, "failed to encode png image\n");
+    return 1;
+  }
+  return 0;
+}
+
+int EncodeImage(ImageFormat format, const float *rgba, int width, int height,
+                uint64_t samples, uint64_t weight, std::string *content,
+                PngProfile png_profile, int num_threads) {
+  switch (format) {
+    case kFormatError:
+      break;
+    case kFormatPng:
+      return EncodePng(rgba, width, height, png_profile, num_threads, content);
+    case kFormatJpg:
+      return EncodeJpg(rgba, width, height, content);
+    case kFormatExr:
+      return EncodeExr(rgba, width, height, content);
+    case kFormatPartial:
+      if (EncodePartialImage(rgba, width, height, samples, weight,
+                             kPixelFloat, kPartialShuffleDeflate, content)) {
+        fprintf(stderr, "failed to encode partial image\n");
+        return 1;
+      }
+      return 0;
+  }
+  fprintf(stderr, "unsupported output image format\n");
+  return 1;
+}
+
+int ReadFileContent(const std::string& file_name, std::string *content) {
+  FILE *fp = fopen(file_name.c_str(), "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s\n", file_name.c_str());
+    return 1;
+  }
+
+  content->clear();
+  char buffer[65536];
+  size_t read_size;
+  while ((read_size = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    content->append(buffer, read_size);
+  }
+  const bool failed = ferror(fp);
+  fclose(fp);
+  return failed;
+}
+
+int WriteFileContent(const std::string& file_name,
+                     const std::string& content) {
+  FILE *fp = fopen(file_name.c_str(), "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "failed to open %s\n", file_name.c_str());
+    return 1;
+  }
+
+  const bool failed = !content.empty() &&
+    fwrite(content.data(), content.size(), 1, fp) != 1;
+  if (fclose(fp) || failed) {
+    fprintf(stderr, "failed to write %s\n", file_name.c_str());
+    return 1;
+  }
+  return 0;
+}
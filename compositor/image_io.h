@@ -0,0 +1,100 @@
+// ImageIO: in-memory image codecs shared by the compositor and the worker
+// Copyright 2015 Light Transport Entertainment.
+
+#ifndef COMPOSITOR_IMAGE_IO_H_
+#define COMPOSITOR_IMAGE_IO_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "accumulate.h"
+
+enum ImageFormat {
+  kFormatError,
+  kFormatPng,
+  kFormatJpg,
+  kFormatExr,
+  kFormatPartial
+};
+
+// Parses "png", "jpg", "exr" or "partial".
+ImageFormat ParseImageFormat(const std::string& name);
+
+// Tradeoffs of PNG encoding between size and time, from the smallest images
+// to the fastest encoding. All profiles drop the alpha channel of opaque
+// images and the colors of grey ones, and deflate with zlib in parallel.
+enum PngProfile {
+  // Level 9 of zlib with the filter of each row picked as lodepng does, for
+  // final images.
+  kPngBest,
+  // Level 1 of zlib with the filters of kPngBest, for intermediate and
+  // interactive images.
+  kPngFast,
+  // No filters, and runs of equal bytes only.
+  kPngRle,
+  // Uncompressed.
+  kPngStore,
+  kPngError
+};
+
+// Parses "best", "fast", "rle" or "store".
+PngProfile ParsePngProfile(const std::string& name);
+
+// Encodes width * height 8-bit RGBA pixels into a PNG image on num_threads
+// threads, one per CPU if 0. The image does not depend on the number of
+// threads.
+// Returns non-zero if failed.
+int EncodePngImage(const unsigned char *rgba, int width, int height,
+                   PngProfile profile, std::string *content,
+                   int num_threads = 0);
+
+// Detects the format from the first bytes of the image.
+ImageFormat DetectImageFormat(const void *data, size_t size);
+
+// Channels of decoded and encoded images are in 8-bit units, 0 to 255, for
+// every format, so that images of any format compose together. The 0 to 1
+// channels of EXR images are scaled on decode and encode.
+const float kExrScale = 255.0f;
+
+// Rounds a channel to 8 bits, clamping values out of [0, 255] and NaN,
+// which HDR images may have.
+inline unsigned char QuantizeChannel(float value) {
+  if (!(value > 0.0f)) {
+    return 0;
+  }
+  if (value >= 255.0f) {
+    return 255;
+  }
+  return static_cast<unsigned char>(value + 0.5f);
+}
+
+struct DecodedImage {
+  PixelType type;
+  // width * height * 4 channels of RGBA of type.
+  std::vector<unsigned char> pixels;
+  int width;
+  int height;
+  // Metadata of partial images; 0 for the other formats.
+  uint64_t samples;
+  uint64_t weight;
+};
+
+// Decodes an image of any format into RGBA.
+// Returns non-zero if failed.
+int DecodeImage(const void *data, size_t size, DecodedImage *image);
+
+// Encodes width * height * 4 channels of RGBA. samples and weight are kept
+// by partial images only, and PNG images are encoded with the profile on
+// num_threads threads.
+// Returns non-zero if failed.
+int EncodeImage(ImageFormat format, const float *rgba, int width, int height,
+                uint64_t samples, uint64_t weight, std::string *content,
+                PngProfile png_profile = kPngBest, int num_threads = 0);
+
+// Returns non-zero if failed.
+int ReadFileContent(const std::string& file_name, std::string *content);
+int WriteFileContent(const std::string& file_name, const std::string& content);
+
+#endif
@@ -0,0 +1,233 @@
+// PartialImage: lossless float format for partially composed images
+// Copyright 2015 Light Transport Entertainment.
+
+#include "partial_image.h"
+
+#include <cstring>
+#include <zlib.h>
+
+namespace {
+
+const char kMagic[4] = {'F', 'P', 'I', 2};
+const size_t kHeaderSize = 40;
+
+// Largest width or height accepted from a header.
+const uint32_t kMaxDimension = 1 << 16;
+
+// Deflate never compresses by more than this, so a payload claiming more
+// pixels than this many times its size is corrupt.
+const size_t kMaxDeflateRatio = 1032;
+
+void PutUint32(uint32_t value, unsigned char *p) {
+  for (int i = 0; i < 4; ++i) {
+    p[i] = value >> (8 * i);
+  }
+}
+
+void PutUint64(uint64_t value, unsigned char *p) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = value >> (8 * i);
+  }
+}
+
+uint32_t GetUint32(const unsigned char *p) {
+  uint32_t value = 0;
+  for (int i = 3; i >= 0; --i) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+uint64_t GetUint64(const unsigned char *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+// Rounds to the nearest even half, saturating to infinity.
+uint16_t FloatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  const uint16_t sign = (bits >> 16) & 0x8000;
+  const int exponent = ((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  if (((bits >> 23) & 0xff) == 0xff) {
+    // Inf or NaN.
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  if (exponent >= 0x1f) {
+    return sign | 0x7c00;
+  }
+  if (exponent <= 0) {
+    if (exponent < -10) {
+      return sign;
+    }
+    // Denormal.
+    mantissa |= 0x800000;
+    const int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+      ++half;
+    }
+    return sign | half;
+  }
+
+  uint32_t half = (exponent << 10) | (mantissa >> 13);
+  const uint32_t rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+    // May carry into the exponent, up to infinity.
+    ++half;
+  }
+  return sign | half;
+}
+
+// Gathers byte b of every element of the size into plane b.
+void Shuffle(const unsigned char *in, size_t count, size_t size,
+             unsigned char *out) {
+  for (size_t b = 0; b < size; ++b) {
+    unsigned char *plane = out + b * count;
+    for (size_t i = 0; i < count; ++i) {
+      plane[i] = in[i * size + b];
+    }
+  }
+}
+
+void Unshuffle(const unsigned char *in, size_t count, size_t size,
+               unsigned char *out) {
+  for (size_t b = 0; b < size; ++b) {
+    const unsigned char *plane = in + b * count;
+    for (size_t i = 0; i < count; ++i) {
+      out[i * size + b] = plane[i];
+    }
+  }
+}
+
+}  // namespace
+
+bool IsPartialImage(const void *data, size_t size) {
+  return size >= sizeof(kMagic) && !memcmp(data, kMagic, sizeof(kMagic));
+}
+
+int EncodePartialImage(const float *rgba, int width, int height,
+                       uint64_t samples, uint64_t weight,
+                       PixelType type, PartialCodec codec,
+                       std::string *content) {
+  if (type != kPixelHalf && type != kPixelFloat) {
+    return 1;
+  }
+
+  const size_t count = static_cast<size_t>(width) * height * 4;
+  const size_t channel_size = PixelTypeSize(type);
+  const size_t pixels_size = count * channel_size;
+
+  std::vector<unsigned char> pixels(pixels_size);
+  if (type == kPixelFloat) {
+    memcpy(pixels.data(), rgba, pixels_size);
+  } else {
+    for (size_t i = 0; i < count; ++i) {
+      const uint16_t half = FloatToHalf(rgba[i]);
+      memcpy(&pixels[i * 2], &half, sizeof(half));
+    }
+  }
+
+  std::vector<unsigned char> payload;
+  if (codec == kPartialRaw) {
+    payload.swap(pixels);
+  } else if (codec == kPartialShuffleDeflate) {
+    std::vector<unsigned char> shuffled(pixels_size);
+    Shuffle(pixels.data(), count, channel_size, shuffled.data());
+
+    uLongf payload_size = compressBound(pixels_size);
+    payload.resize(payload_size);
+    if (compress2(payload.data(), &payload_size,
+                  shuffled.data(), pixels_size, Z_BEST_SPEED) != Z_OK) {
+      return 1;
+    }
+    payload.resize(payload_size);
+  } else {
+    return 1;
+  }
+
+  unsigned char header[kHeaderSize] = {};
+  memcpy(header, kMagic, sizeof(kMagic));
+  PutUint32(width, header + 4);
+  PutUint32(height, header + 8);
+  header[12] = type;
+  header[13] = codec;
+  PutUint64(samples, header + 16);
+  PutUint64(weight, header + 24);
+  PutUint64(payload.size(), header + 32);
+
+  content->assign(reinterpret_cast<char*>(header), kHeaderSize);
+  content->append(reinterpret_cast<char*>(payload.data()), payload.size());
+  return 0;
+}
+
+int DecodePartialImage(const void *data, size_t size, PartialImage *image) {
+  const unsigned char *bytes = static_cast<const unsigned char*>(data);
+  if (size < kHeaderSize || !IsPartialImage(data, size)) {
+    return 1;
+  }
+
+  // The header is untrusted; check it against the payload before
+  // allocating anything.
+  const uint32_t width = GetUint32(bytes + 4);
+  const uint32_t height = GetUint32(bytes + 8);
+  const int type = bytes[12];
+  const int codec = bytes[13];
+  const uint64_t payload_size = GetUint64(bytes + 32);
+
+  if (width == 0 || height == 0 ||
+      width > kMaxDimension || height > kMaxDimension ||
+      (type != kPixelHalf && type != kPixelFloat) ||
+      payload_size != size - kHeaderSize) {
+    return 1;
+  }
+
+  const size_t channel_size = PixelTypeSize(static_cast<PixelType>(type));
+  const size_t max_count = SIZE_MAX / channel_size / 4 / width;
+  if (height > max_count) {
+    return 1;
+  }
+  const size_t count = static_cast<size_t>(width) * height * 4;
+  const size_t pixels_size = count * channel_size;
+  const unsigned char *payload = bytes + kHeaderSize;
+
+  if (codec == kPartialRaw) {
+    if (payload_size != pixels_size) {
+      return 1;
+    }
+  } else if (codec == kPartialShuffleDeflate) {
+    if (pixels_size / kMaxDeflateRatio > payload_size) {
+      return 1;
+    }
+  } else {
+    return 1;
+  }
+
+  image->width = width;
+  image->height = height;
+  image->type = static_cast<PixelType>(type);
+  image->samples = GetUint64(bytes + 16);
+  image->weight = GetUint64(bytes + 24);
+  image->pixels.resize(pixels_size);
+  if (codec == kPartialRaw) {
+    memcpy(image->pixels.data(), payload, pixels_size);
+  } else {
+    std::vector<unsigned char> shuffled(pixels_size);
+    uLongf shuffled_size = pixels_size;
+    if (uncompress(shuffled.data(), &shuffled_size,
+                   payload, payload_size) != Z_OK ||
+        shuffled_size != pixels_size) {
+      return 1;
+    }
+    Unshuffle(shuffled.data(), count, channel_size, image->pixels.data());
+  }
+  return 0;
+}
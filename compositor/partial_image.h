@@ -0,0 +1,65 @@
+// PartialImage: lossless float format for partially composed images
+// Copyright 2015 Light Transport Entertainment.
+
+#ifndef COMPOSITOR_PARTIAL_IMAGE_H_
+#define COMPOSITOR_PARTIAL_IMAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "accumulate.h"
+
+// Partial images pass between reductions without the quantization and
+// clamping of 8-bit formats. They are RGBA in float32 or half, the weighted
+// mean of their inputs. They carry the total weight of the inputs, so that
+// composing partial images by their weights gives the exact mean of all the
+// leaves, and the total number of samples per pixel rendered for them.
+//
+// The layout is a 40 byte little endian header followed by the payload:
+//
+//   char     magic[4]      "FPI\2"
+//   uint32   width
+//   uint32   height
+//   uint8    pixel type    PixelType; kPixelHalf or kPixelFloat
+//   uint8    codec         PartialCodec
+//   uint16   reserved
+//   uint64   samples
+//   uint64   weight
+//   uint64   payload size
+//
+// Only the final image of a reduction is encoded to PNG, JPEG or EXR.
+enum PartialCodec {
+  // Channels as is.
+  kPartialRaw = 0,
+  // Bytes of the channels split into planes, then deflated at the fastest
+  // level. The high bytes of neighboring channels are mostly equal, so this
+  // compresses well at a fraction of the cost of PNG.
+  kPartialShuffleDeflate = 1
+};
+
+struct PartialImage {
+  int width;
+  int height;
+  PixelType type;
+  uint64_t samples;
+  uint64_t weight;
+  // width * height * 4 channels of type.
+  std::vector<unsigned char> pixels;
+};
+
+// Returns true if the data starts with the partial image magic.
+bool IsPartialImage(const void *data, size_t size);
+
+// Encodes width * height * 4 channels of RGBA as a partial image of the type.
+// Returns non-zero if failed.
+int EncodePartialImage(const float *rgba, int width, int height,
+                       uint64_t samples, uint64_t weight,
+                       PixelType type, PartialCodec codec,
+                       std::string *content);
+
+// Returns non-zero if the data is not a valid partial image.
+int DecodePartialImage(const void *data, size_t size, PartialImage *image);
+
+#endif
@@ -0,0 +1,596 @@
+// PngStream: scanline streaming PNG decoder and encoder on zlib
+// Copyright 2015 Light Transport Entertainment.
+
+#include "png_stream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+namespace {
+
+const unsigned char kSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+// Size of the buffers for compressed data.
+const size_t kBufferSize = 64 * 1024;
+
+unsigned ReadUint32(const unsigned char *p) {
+  return (static_cast<unsigned>(p[0]) << 24) |
+         (static_cast<unsigned>(p[1]) << 16) |
+         (static_cast<unsigned>(p[2]) << 8) |
+         static_cast<unsigned>(p[3]);
+}
+
+void WriteUint32(unsigned value, unsigned char *p) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+unsigned char PaethPredictor(int a, int b, int c) {
+  const int p = a + b - c;
+  const int pa = abs(p - a);
+  const int pb = abs(p - b);
+  const int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  } else if (pb <= pc) {
+    return b;
+  }
+  return c;
+}
+
+// Applies the PNG filter of the type to the scanline.
+// bpp is the number of bytes per pixel.
+void FilterRow(int type, const unsigned char *row, const unsigned char *prev,
+               size_t stride, size_t bpp, unsigned char *out) {
+  for (size_t i = 0; i < stride; ++i) {
+    const int a = i >= bpp ? row[i - bpp] : 0;
+    const int b = prev[i];
+    const int c = i >= bpp ? prev[i - bpp] : 0;
+    switch (type) {
+      case 0: out[i] = row[i]; break;
+      case 1: out[i] = row[i] - a; break;
+      case 2: out[i] = row[i] - b; break;
+      case 3: out[i] = row[i] - ((a + b) >> 1); break;
+      case 4: out[i] = row[i] - PaethPredictor(a, b, c); break;
+    }
+  }
+}
+
+// Filters the row with the filter of the minimum sum of absolute differences,
+// as lodepng does by default, into the filter type byte and stride bytes at
+// out. candidate is scratch of stride bytes.
+void FilterRowMinSum(const unsigned char *row, const unsigned char *prev,
+                     size_t stride, size_t bpp, unsigned char *candidate,
+                     unsigned char *out) {
+  size_t best_sum = 0;
+  for (int type = 0; type < 5; ++type) {
+    FilterRow(type, row, prev, stride, bpp, candidate);
+
+    size_t sum = 0;
+    for (size_t i = 0; i < stride; ++i) {
+      sum += type == 0 ?
+        candidate[i] : abs(static_cast<signed char>(candidate[i]));
+    }
+    if (type == 0 || sum < best_sum) {
+      best_sum = sum;
+      out[0] = type;
+      memcpy(out + 1, candidate, stride);
+    }
+  }
+}
+
+// Reverts the PNG filter of the type in place.
+// Returns non-zero if the filter type is invalid.
+int UnfilterRow(int type, unsigned char *row, const unsigned char *prev,
+                size_t stride, size_t bpp) {
+  for (size_t i = 0; i < stride; ++i) {
+    const int a = i >= bpp ? row[i - bpp] : 0;
+    const int b = prev[i];
+    const int c = i >= bpp ? prev[i - bpp] : 0;
+    switch (type) {
+      case 0: break;
+      case 1: row[i] += a; break;
+      case 2: row[i] += b; break;
+      case 3: row[i] += (a + b) >> 1; break;
+      case 4: row[i] += PaethPredictor(a, b, c); break;
+      default: return 1;
+    }
+  }
+  return 0;
+}
+
+// Window of deflate, and so the most data a band refers back to.
+const size_t kWindowSize = 32 * 1024;
+
+// Deflates the size bytes at data as a band of a zlib stream, without the
+// header and the checksum of the stream, and primed with the dictionary_size
+// bytes before data. The last band finishes the stream.
+PngBand DeflateRows(const unsigned char *data, size_t size,
+                    size_t dictionary_size, int level, int strategy,
+                    bool last) {
+  PngBand band;
+  band.adler = adler32(adler32(0L, Z_NULL, 0), data, size);
+  band.size = size;
+  band.error = 1;
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+    return band;
+  }
+  if (dictionary_size > 0 &&
+      deflateSetDictionary(&stream, data - dictionary_size,
+                           dictionary_size) != Z_OK) {
+    deflateEnd(&stream);
+    return band;
+  }
+
+  // The bound covers Z_FINISH; a sync flush may take a few bytes more.
+  band.data.resize(deflateBound(&stream, size) + 16);
+  stream.next_in = const_cast<unsigned char*>(data);
+  stream.avail_in = size;
+  const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+  for (;;) {
+    stream.next_out = band.data.data() + stream.total_out;
+    stream.avail_out = band.data.size() - stream.total_out;
+    const int error = deflate(&stream, flush);
+    if (error == Z_STREAM_ERROR) {
+      break;
+    }
+    if (last ? error == Z_STREAM_END : stream.avail_out > 0) {
+      band.error = 0;
+      break;
+    }
+    band.data.resize(band.data.size() * 2);
+  }
+  band.data.resize(stream.total_out);
+  deflateEnd(&stream);
+  return band;
+}
+
+// The zlib header of a stream deflated at the level.
+void WriteZlibHeader(int level, unsigned char *p) {
+  int flevel = 2;
+  if (level >= 0 && level < 2) {
+    flevel = 0;
+  } else if (level >= 2 && level < 6) {
+    flevel = 1;
+  } else if (level > 6) {
+    flevel = 3;
+  }
+  unsigned header = (0x78 << 8) | (flevel << 6);
+  header += 31 - header % 31;
+  p[0] = header >> 8;
+  p[1] = header;
+}
+
+void AppendChunk(const char *type, const unsigned char *data, size_t size,
+                 std::string *content) {
+  unsigned char header[8];
+  WriteUint32(size, header);
+  memcpy(header + 4, type, 4);
+
+  unsigned long crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, header + 4, 4);
+  if (size > 0) {
+    crc = crc32(crc, data, size);
+  }
+  unsigned char footer[4];
+  WriteUint32(crc, footer);
+
+  content->append(reinterpret_cast<char*>(header), sizeof(header));
+  content->append(reinterpret_cast<const char*>(data), size);
+  content->append(reinterpret_cast<char*>(footer), sizeof(footer));
+}
+
+size_t ResolveNumThreads(int num_threads) {
+  if (num_threads > 0) {
+    return num_threads;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Runs work(thread) on num_threads threads, including the calling one.
+void RunOnThreads(size_t num_threads,
+                  const std::function<void(size_t)>& work) {
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i) {
+    threads.emplace_back(work, i);
+  }
+  work(0);
+  for (auto&& thread : threads) {
+    thread.join();
+  }
+}
+
+}  // namespace
+
+PngRowReader::PngRowReader()
+    : fp_(NULL)
+    , stream_initialized_(false)
+    , width_(0)
+    , height_(0)
+    , channels_(0)
+    , idat_remaining_(0)
+    , input_(kBufferSize) {
+  memset(&stream_, 0, sizeof(stream_));
+}
+
+PngRowReader::~PngRowReader() {
+  if (stream_initialized_) {
+    inflateEnd(&stream_);
+  }
+  if (fp_ != NULL) {
+    fclose(fp_);
+  }
+}
+
+int PngRowReader::ReadChunkHeader(unsigned *length, std::string *type) {
+  unsigned char header[8];
+  if (fread(header, sizeof(header), 1, fp_) != 1) {
+    return 1;
+  }
+  *length = ReadUint32(header);
+  *type = std::string(reinterpret_cast<char*>(header + 4), 4);
+  return 0;
+}
+
+int PngRowReader::Open(const std::string& file_name) {
+  fp_ = fopen(file_name.c_str(), "rb");
+  if (fp_ == NULL) {
+    return 1;
+  }
+
+  unsigned char signature[8];
+  if (fread(signature, sizeof(signature), 1, fp_) != 1 ||
+      memcmp(signature, kSignature, sizeof(kSignature))) {
+    return 1;
+  }
+
+  unsigned length;
+  std::string type;
+  unsigned char ihdr[13];
+  if (ReadChunkHeader(&length, &type) || type != "IHDR" || length != 13 ||
+      fread(ihdr, sizeof(ihdr), 1, fp_) != 1 ||
+      fseek(fp_, 4, SEEK_CUR)) {
+    return 1;
+  }
+
+  width_ = ReadUint32(ihdr);
+  height_ = ReadUint32(ihdr + 4);
+  const int bit_depth = ihdr[8];
+  const int color_type = ihdr[9];
+  const int interlace = ihdr[12];
+
+  if (bit_depth != 8 || interlace != 0) {
+    return 1;
+  }
+  switch (color_type) {
+    case 0: channels_ = 1; break;  // Grayscale
+    case 2: channels_ = 3; break;  // RGB
+    case 4: channels_ = 2; break;  // Grayscale and alpha
+    case 6: channels_ = 4; break;  // RGBA
+    default: return 1;             // Palette
+  }
+
+  if (inflateInit(&stream_) != Z_OK) {
+    return 1;
+  }
+  stream_initialized_ = true;
+
+  const size_t stride = static_cast<size_t>(width_) * channels_;
+  row_.resize(stride + 1);
+  previous_row_.assign(stride, 0);
+  return 0;
+}
+
+int PngRowReader::Inflate(unsigned char *out, size_t size) {
+  stream_.next_out = out;
+  stream_.avail_out = size;
+
+  while (stream_.avail_out > 0) {
+    if (stream_.avail_in == 0) {
+      // Skip to the next IDAT chunk.
+      while (idat_remaining_ == 0) {
+        std::string type;
+        if (ReadChunkHeader(&idat_remaining_, &type) || type == "IEND") {
+          return 1;
+        }
+        if (type != "IDAT") {
+          if (fseek(fp_, idat_remaining_ + 4, SEEK_CUR)) {
+            return 1;
+          }
+          idat_remaining_ = 0;
+        }
+      }
+
+      const size_t count =
+        idat_remaining_ < input_.size() ? idat_remaining_ : input_.size();
+      if (fread(input_.data(), count, 1, fp_) != 1) {
+        return 1;
+      }
+      idat_remaining_ -= count;
+      // Skip CRC at the end of the chunk.
+      if (idat_remaining_ == 0 && fseek(fp_, 4, SEEK_CUR)) {
+        return 1;
+      }
+
+      stream_.next_in = input_.data();
+      stream_.avail_in = count;
+    }
+
+    const int error = inflate(&stream_, Z_NO_FLUSH);
+    if (error == Z_STREAM_END && stream_.avail_out > 0) {
+      return 1;
+    }
+    if (error != Z_OK && error != Z_STREAM_END) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int PngRowReader::ReadRow(unsigned char *rgba) {
+  if (Inflate(row_.data(), row_.size())) {
+    return 1;
+  }
+
+  unsigned char *row = row_.data() + 1;
+  const size_t stride = previous_row_.size();
+  if (UnfilterRow(row_[0], row, previous_row_.data(), stride, channels_)) {
+    return 1;
+  }
+  memcpy(previous_row_.data(), row, stride);
+
+  for (int x = 0; x < width_; ++x) {
+    const unsigned char *pixel = row + x * channels_;
+    unsigned char *out = rgba + x * 4;
+    switch (channels_) {
+      case 1:
+        out[0] = out[1] = out[2] = pixel[0];
+        out[3] = 255;
+        break;
+      case 2:
+        out[0] = out[1] = out[2] = pixel[0];
+        out[3] = pixel[1];
+        break;
+      case 3:
+        out[0] = pixel[0];
+        out[1] = pixel[1];
+        out[2] = pixel[2];
+        out[3] = 255;
+        break;
+      case 4:
+        memcpy(out, pixel, 4);
+        break;
+    }
+  }
+  return 0;
+}
+
+PngRowWriter::PngRowWriter()
+    : fp_(NULL)
+    , width_(0)
+    , num_threads_(1)
+    , dictionary_size_(0)
+    , header_written_(false)
+    , adler_(adler32(0L, Z_NULL, 0)) {
+}
+
+PngRowWriter::~PngRowWriter() {
+  for (auto&& band : bands_) {
+    band.wait();
+  }
+  if (fp_ != NULL) {
+    fclose(fp_);
+  }
+}
+
+int PngRowWriter::WriteChunk(
+    const char *type, const unsigned char *data, size_t size) {
+  unsigned char header[8];
+  WriteUint32(size, header);
+  memcpy(header + 4, type, 4);
+
+  unsigned long crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, header + 4, 4);
+  if (size > 0) {
+    crc = crc32(crc, data, size);
+  }
+  unsigned char footer[4];
+  WriteUint32(crc, footer);
+
+  if (fwrite(header, sizeof(header), 1, fp_) != 1 ||
+      (size > 0 && fwrite(data, size, 1, fp_) != 1) ||
+      fwrite(footer, sizeof(footer), 1, fp_) != 1) {
+    return 1;
+  }
+  return 0;
+}
+
+int PngRowWriter::Open(const std::string& file_name, int width, int height,
+                       int num_threads) {
+  fp_ = fopen(file_name.c_str(), "wb");
+  if (fp_ == NULL) {
+    return 1;
+  }
+  width_ = width;
+  num_threads_ = ResolveNumThreads(num_threads);
+
+  unsigned char ihdr[13];
+  WriteUint32(width, ihdr);
+  WriteUint32(height, ihdr + 4);
+  ihdr[8] = 8;   // Bit depth
+  ihdr[9] = 6;   // RGBA
+  ihdr[10] = 0;  // Deflate
+  ihdr[11] = 0;  // Adaptive filtering
+  ihdr[12] = 0;  // No interlace
+
+  if (fwrite(kSignature, sizeof(kSignature), 1, fp_) != 1 ||
+      WriteChunk("IHDR", ihdr, sizeof(ihdr))) {
+    return 1;
+  }
+
+  const size_t stride = static_cast<size_t>(width) * 4;
+  previous_row_.assign(stride, 0);
+  candidate_.resize(stride);
+  return 0;
+}
+
+void PngRowWriter::DeflateBand(bool last) {
+  std::vector<unsigned char> band;
+  band.swap(band_);
+  const size_t dictionary_size = dictionary_size_;
+
+  // The next band is primed with the end of this one.
+  dictionary_size_ = std::min(band.size(), kWindowSize);
+  band_.assign(band.end() - dictionary_size_, band.end());
+
+  bands_.push_back(std::async(std::launch::async,
+      [dictionary_size, last](std::vector<unsigned char> band) {
+    return DeflateRows(band.data() + dictionary_size,
+                         band.size() - dictionary_size, dictionary_size,
+                         Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, last);
+  }, std::move(band)));
+}
+
+int PngRowWriter::WriteBand(bool last) {
+  PngBand band = bands_.front().get();
+  bands_.pop_front();
+  if (band.error) {
+    return 1;
+  }
+  adler_ = adler32_combine(adler_, band.adler, band.size);
+
+  if (!header_written_) {
+    band.data.insert(band.data.begin(), 2, 0);
+    WriteZlibHeader(Z_DEFAULT_COMPRESSION, band.data.data());
+    header_written_ = true;
+  }
+  if (last) {
+    unsigned char adler[4];
+    WriteUint32(adler_, adler);
+    band.data.insert(band.data.end(), adler, adler + 4);
+  }
+  return WriteChunk("IDAT", band.data.data(), band.data.size());
+}
+
+int PngRowWriter::WriteRow(const unsigned char *rgba) {
+  const size_t stride = previous_row_.size();
+  const size_t offset = band_.size();
+  band_.resize(offset + stride + 1);
+  FilterRowMinSum(rgba, previous_row_.data(), stride, 4, candidate_.data(),
+                  band_.data() + offset);
+  memcpy(previous_row_.data(), rgba, stride);
+
+  if (band_.size() - dictionary_size_ >= kPngBandSize) {
+    DeflateBand(false);
+    // Keep a band in flight per thread.
+    if (bands_.size() >= num_threads_ && WriteBand(false)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int PngRowWriter::Close() {
+  DeflateBand(true);
+  while (!bands_.empty()) {
+    if (WriteBand(bands_.size() == 1)) {
+      return 1;
+    }
+  }
+  if (WriteChunk("IEND", NULL, 0)) {
+    return 1;
+  }
+
+  const int error = fclose(fp_);
+  fp_ = NULL;
+  return error != 0;
+}
+
+int EncodePngParallel(const unsigned char *pixels, int width, int height,
+                      int channels, int level, int strategy, bool adaptive,
+                      int num_threads, std::string *content) {
+  static const unsigned char kColorTypes[] = {0, 4, 2, 6};
+  if (width <= 0 || height <= 0 || channels < 1 || channels > 4) {
+    return 1;
+  }
+  const size_t stride = static_cast<size_t>(width) * channels;
+  const size_t row_size = stride + 1;
+  const size_t threads = ResolveNumThreads(num_threads);
+
+  // Rows are filtered first, split evenly over the threads.
+  std::vector<unsigned char> filtered(row_size * height);
+  const std::vector<unsigned char> zero_row(stride, 0);
+  const size_t filter_threads = std::min<size_t>(threads, height);
+  RunOnThreads(filter_threads, [&](size_t thread) {
+    const size_t begin = height * thread / filter_threads;
+    const size_t end = height * (thread + 1) / filter_threads;
+    std::vector<unsigned char> candidate(stride);
+    for (size_t y = begin; y < end; ++y) {
+      const unsigned char *row = pixels + y * stride;
+      const unsigned char *prev = y > 0 ? row - stride : zero_row.data();
+      unsigned char *out = filtered.data() + y * row_size;
+      if (adaptive) {
+        FilterRowMinSum(row, prev, stride, channels, candidate.data(), out);
+      } else {
+        out[0] = 0;
+        memcpy(out + 1, row, stride);
+      }
+    }
+  });
+
+  // Then deflated in bands of whole rows, which the threads take in turn.
+  const size_t band_rows = std::max<size_t>(kPngBandSize / row_size, 1);
+  const size_t num_bands = (height + band_rows - 1) / band_rows;
+  std::vector<PngBand> bands(num_bands);
+  std::atomic<size_t> next_band(0);
+  RunOnThreads(std::min(threads, num_bands), [&](size_t) {
+    for (size_t b = next_band++; b < num_bands; b = next_band++) {
+      const size_t begin = b * band_rows * row_size;
+      const size_t end =
+        std::min<size_t>((b + 1) * band_rows, height) * row_size;
+      bands[b] = DeflateRows(filtered.data() + begin, end - begin,
+                             std::min(begin, kWindowSize), level, strategy,
+                             b + 1 == num_bands);
+    }
+  });
+
+  std::string idat(2, 0);
+  WriteZlibHeader(level, reinterpret_cast<unsigned char*>(&idat[0]));
+  unsigned long adler = adler32(0L, Z_NULL, 0);
+  for (auto&& band : bands) {
+    if (band.error) {
+      return 1;
+    }
+    idat.append(band.data.begin(), band.data.end());
+    adler = adler32_combine(adler, band.adler, band.size);
+  }
+  unsigned char trailer[4];
+  WriteUint32(adler, trailer);
+  idat.append(reinterpret_cast<char*>(trailer), sizeof(trailer));
+
+  unsigned char ihdr[13];
+  WriteUint32(width, ihdr);
+  WriteUint32(height, ihdr + 4);
+  ihdr[8] = 8;                           // Bit depth
+  ihdr[9] = kColorTypes[channels - 1];
+  ihdr[10] = 0;                          // Deflate
+  ihdr[11] = 0;                          // Adaptive filtering
+  ihdr[12] = 0;                          // No interlace
+
+  content->assign(reinterpret_cast<const char*>(kSignature),
+                  sizeof(kSignature));
+  AppendChunk("IHDR", ihdr, sizeof(ihdr), content);
+  AppendChunk("IDAT", reinterpret_cast<const unsigned char*>(idat.data()),
+              idat.size(), content);
+  AppendChunk("IEND", NULL, 0, content);
+  return 0;
+}
@@ -0,0 +1,123 @@
+// PngStream: scanline streaming PNG decoder and encoder on zlib
+// Copyright 2015 Light Transport Entertainment.
+
+#ifndef COMPOSITOR_PNG_STREAM_H_
+#define COMPOSITOR_PNG_STREAM_H_
+
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Decodes a PNG file one scanline at a time, so that only a few rows of it
+// are ever in memory. Only 8-bit non-interlaced grayscale, RGB and RGBA
+// images are supported; decode others with lodepng instead.
+class PngRowReader {
+ public:
+  PngRowReader();
+  ~PngRowReader();
+
+  // Returns non-zero if the file is not a PNG or its format is unsupported.
+  int Open(const std::string& file_name);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Decodes the next scanline into width() * 4 bytes of RGBA.
+  // Returns non-zero if failed.
+  int ReadRow(unsigned char *rgba);
+
+ private:
+  PngRowReader(const PngRowReader&);
+  PngRowReader& operator=(const PngRowReader&);
+
+  // Reads the next chunk header. Returns non-zero if failed.
+  int ReadChunkHeader(unsigned *length, std::string *type);
+  // Inflates exactly size bytes from the IDAT chunks.
+  int Inflate(unsigned char *out, size_t size);
+
+  FILE *fp_;
+  z_stream stream_;
+  bool stream_initialized_;
+  int width_;
+  int height_;
+  int channels_;
+  unsigned idat_remaining_;
+  std::vector<unsigned char> input_;
+  std::vector<unsigned char> row_;
+  std::vector<unsigned char> previous_row_;
+};
+
+// Rows of PNG images are deflated in bands of this many bytes, each on its
+// own, into a single zlib stream as pigz does: each band is primed with the
+// 32 KiB of data before it, and ends at a byte boundary with a sync flush, and
+// the Adler-32 checksums of the bands are combined at the end.
+const size_t kPngBandSize = 128 * 1024;
+
+// A deflated band of rows.
+struct PngBand {
+  std::vector<unsigned char> data;
+  // Adler-32 and size of the uncompressed band.
+  unsigned long adler;
+  size_t size;
+  int error;
+};
+
+// Encodes an 8-bit RGBA PNG file one scanline at a time. Bands of the rows
+// are deflated on num_threads threads, one per CPU if 0, while the next rows
+// are filtered, keeping a band per thread in memory.
+class PngRowWriter {
+ public:
+  PngRowWriter();
+  ~PngRowWriter();
+
+  // Returns non-zero if failed.
+  int Open(const std::string& file_name, int width, int height,
+           int num_threads = 0);
+
+  // Encodes the next scanline of width * 4 bytes of RGBA.
+  // Returns non-zero if failed.
+  int WriteRow(const unsigned char *rgba);
+
+  // Writes the end of the image after the last row.
+  // Returns non-zero if failed.
+  int Close();
+
+ private:
+  PngRowWriter(const PngRowWriter&);
+  PngRowWriter& operator=(const PngRowWriter&);
+
+  // Starts deflating the band of the filtered rows so far.
+  void DeflateBand(bool last);
+  // Writes the oldest band in flight as an IDAT chunk, with the checksum of
+  // the stream after the last one.
+  int WriteBand(bool last);
+  int WriteChunk(const char *type, const unsigned char *data, size_t size);
+
+  FILE *fp_;
+  int width_;
+  size_t num_threads_;
+  std::vector<unsigned char> previous_row_;
+  std::vector<unsigned char> candidate_;
+  // The 32 KiB of filtered data before the band, then the band.
+  std::vector<unsigned char> band_;
+  size_t dictionary_size_;
+  std::deque<std::future<PngBand>> bands_;
+  bool header_written_;
+  unsigned long adler_;
+};
+
+// Encodes width * height pixels of 1 to 4 8-bit channels, i.e. grayscale,
+// grayscale and alpha, RGB or RGBA, into a PNG image in memory. Rows are
+// filtered and deflated in bands on num_threads threads, one per CPU if 0,
+// and the image does not depend on the number of threads. level and strategy
+// are those of zlib. adaptive picks the filter of each row as lodepng does
+// by default; rows are not filtered otherwise.
+// Returns non-zero if failed.
+int EncodePngParallel(const unsigned char *pixels, int width, int height,
+                      int channels, int level, int strategy, bool adaptive,
+                      int num_threads, std::string *content);
+
+#endif
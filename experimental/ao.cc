@@ -1,21 +1,34 @@
 #include "ao.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
 #include <cmath>
+#include <fstream>
+#include <memory>
+#include <sched.h>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 #include "lodepng.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AO_X86 1
+#include <immintrin.h>
+#endif
+
 namespace {
 
 /*
 #define WIDTH        256
 #define HEIGHT       256
 #define NSUBSAMPLES  2
-*/
 #define NAO_SAMPLES  8
+*/
 
 typedef struct _vec
 {
@@ -53,8 +66,99 @@ typedef struct _Ray
     vec    dir;
 } Ray;
 
-Sphere spheres[3];
-Plane  plane;
+typedef struct _Triangle
+{
+    vec    p0;
+    vec    e1;    /* p1 - p0 */
+    vec    e2;    /* p2 - p0 */
+    vec    n;     /* Unit geometric normal. */
+
+} Triangle;
+
+/*
+ * A node of the BVH over the spheres and triangles, 32 bytes so that two of
+ * them share a cache line. Nodes are in depth-first order: the children of
+ * an inner node are the next node and the node at offset. A leaf holds the
+ * count primitives of the scene from offset on.
+ */
+typedef struct _BvhNode
+{
+    float    lower[3];
+    float    upper[3];
+    uint32_t offset;
+    uint16_t count;   /* 0 for inner nodes. */
+    uint16_t axis;    /* The split axis of inner nodes. */
+
+} BvhNode;
+
+/* The traversal stacks are sized by the depth of the BVH, which the build
+ * keeps under this. */
+#define BVH_MAX_DEPTH 64
+
+/* Planes are unbounded and tested apart from the BVH. */
+typedef struct _Scene
+{
+    std::vector<Sphere>   spheres;
+    std::vector<Triangle> triangles;
+    std::vector<Plane>    planes;
+    std::vector<BvhNode>  nodes;
+    /* Primitives in leaf order. Spheres are numbered first, then triangles. */
+    std::vector<uint32_t> primitives;
+
+} Scene;
+
+/* A pinhole camera; the film spans [-1, 1] in u times [-aspect, aspect]
+ * in v, scaled by tan(fov / 2). */
+typedef struct _Camera
+{
+    vec    eye;
+    vec    u;
+    vec    v;
+    vec    w;    /* Points forward. */
+
+} Camera;
+
+/*
+ * Occlusion samples are points of the 2D Sobol (0,2)-sequence, so that any
+ * 2^m consecutive samples from a multiple of 2^m are stratified. Each hit
+ * point draws the sequence from the sample offset on, shifted by a random
+ * vector keyed by the seed, the pixel and the subsample (Cranley-Patterson
+ * rotation). Renders with the same seed and disjoint ranges of samples draw
+ * disjoint parts of the same sequences, so their average is the render with
+ * all of their samples, whichever thread or node rendered them.
+ */
+static uint64_t mix(uint64_t z)
+{
+    /* The SplitMix64 finalizer. */
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* The first dimension of the sequence: the base 2 radical inverse. */
+static uint32_t van_der_corput(uint32_t i)
+{
+    i = (i << 16) | (i >> 16);
+    i = ((i & 0x00ff00ff) << 8) | ((i & 0xff00ff00) >> 8);
+    i = ((i & 0x0f0f0f0f) << 4) | ((i & 0xf0f0f0f0) >> 4);
+    i = ((i & 0x33333333) << 2) | ((i & 0xcccccccc) >> 2);
+    i = ((i & 0x55555555) << 1) | ((i & 0xaaaaaaaa) >> 1);
+    return i;
+}
+
+/* The second dimension of the Sobol sequence. */
+static uint32_t sobol2(uint32_t i)
+{
+    uint32_t r = 0;
+    uint32_t v;
+
+    for (v = 1U << 31; i; i >>= 1, v ^= v >> 1) {
+        if (i & 1) {
+            r ^= v;
+        }
+    }
+    return r;
+}
 
 static double vdot(vec v0, vec v1)
 {
@@ -135,6 +239,125 @@ ray_plane_intersect(Isect *isect, const Ray *ray, const Plane *plane)
     }
 }
 
+/* Moller-Trumbore. The normal faces the ray, as either side may be seen. */
+void
+ray_triangle_intersect(Isect *isect, const Ray *ray, const Triangle *tri)
+{
+    vec pvec, qvec, s;
+
+    vcross(&pvec, ray->dir, tri->e2);
+    double det = vdot(tri->e1, pvec);
+
+    if (fabs(det) < 1.0e-17) return;
+
+    double inv_det = 1.0 / det;
+
+    s.x = ray->org.x - tri->p0.x;
+    s.y = ray->org.y - tri->p0.y;
+    s.z = ray->org.z - tri->p0.z;
+
+    double u = vdot(s, pvec) * inv_det;
+    if ((u < 0.0) || (u > 1.0)) return;
+
+    vcross(&qvec, s, tri->e1);
+    double v = vdot(ray->dir, qvec) * inv_det;
+    if ((v < 0.0) || (u + v > 1.0)) return;
+
+    double t = vdot(tri->e2, qvec) * inv_det;
+
+    if ((t > 0.0) && (t < isect->t)) {
+        isect->t = t;
+        isect->hit = 1;
+
+        isect->p.x = ray->org.x + ray->dir.x * t;
+        isect->p.y = ray->org.y + ray->dir.y * t;
+        isect->p.z = ray->org.z + ray->dir.z * t;
+
+        isect->n = tri->n;
+        if (vdot(isect->n, ray->dir) > 0.0) {
+            isect->n.x = -isect->n.x;
+            isect->n.y = -isect->n.y;
+            isect->n.z = -isect->n.z;
+        }
+    }
+}
+
+/* Distance to the box along the ray if it enters before tmax, or -1. Zero
+ * directions give infinite or NaN slabs, which the comparisons skip. */
+static double
+ray_box_intersect(const BvhNode *node, const double *org,
+                  const double *inv_dir, double tmax)
+{
+    double tnear = 0.0;
+    double tfar = tmax;
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        const double t0 = (node->lower[k] - org[k]) * inv_dir[k];
+        const double t1 = (node->upper[k] - org[k]) * inv_dir[k];
+        const double enter = t0 < t1 ? t0 : t1;
+        const double exit = t0 < t1 ? t1 : t0;
+        if (enter > tnear) tnear = enter;
+        if (exit < tfar) tfar = exit;
+    }
+    return tnear <= tfar ? tnear : -1.0;
+}
+
+/* Finds the nearest hit, visiting the near child of each node first so that
+ * the far one can be culled by the hits in the near one. */
+void
+intersect_scene(Isect *isect, const Ray *ray, const Scene *scene)
+{
+    size_t i;
+
+    for (i = 0; i < scene->planes.size(); i++) {
+        ray_plane_intersect(isect, ray, &scene->planes[i]);
+    }
+    if (scene->nodes.empty()) {
+        return;
+    }
+
+    const double org[3] = {ray->org.x, ray->org.y, ray->org.z};
+    const double dir[3] = {ray->dir.x, ray->dir.y, ray->dir.z};
+    const double inv_dir[3] = {1.0 / dir[0], 1.0 / dir[1], 1.0 / dir[2]};
+    const size_t nspheres = scene->spheres.size();
+
+    uint32_t stack[BVH_MAX_DEPTH];
+    int sp = 0;
+    uint32_t index = 0;
+
+    for (;;) {
+        const BvhNode *node = &scene->nodes[index];
+        if (ray_box_intersect(node, org, inv_dir, isect->t) >= 0.0) {
+            if (node->count == 0) {
+                /* The second child is on the positive side of the split. */
+                if (dir[node->axis] < 0.0) {
+                    stack[sp++] = index + 1;
+                    index = node->offset;
+                } else {
+                    stack[sp++] = node->offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+            for (i = node->offset; i < node->offset + node->count; i++) {
+                const uint32_t primitive = scene->primitives[i];
+                if (primitive < nspheres) {
+                    ray_sphere_intersect(isect, ray,
+                                         &scene->spheres[primitive]);
+                } else {
+                    ray_triangle_intersect(isect, ray,
+                        &scene->triangles[primitive - nspheres]);
+                }
+            }
+        }
+        if (sp == 0) {
+            break;
+        }
+        index = stack[--sp];
+    }
+}
+
 void
 orthoBasis(vec *basis, vec n)
 {
@@ -159,11 +382,583 @@ orthoBasis(vec *basis, vec n)
 }
 
 
-void ambient_occlusion(vec *col, const Isect *isect)
+/*
+ * Occlusion rays are traced in packets of rays sharing the origin, in float
+ * and in SoA layout, with a kernel picked at runtime from AVX-512, AVX2, SSE
+ * and scalar. A ray only has to be known to hit something, so the nearest
+ * hit is never computed, and the BVH is left as soon as every ray of the
+ * packet has hit something.
+ */
+
+/* The AO rays of a hit point are padded to a multiple of the widest packet
+ * with zero directions, which hit nothing. */
+#define PACKET_ALIGNMENT 16
+
+/* A sphere or a triangle in float, in the leaf order of the BVH. */
+typedef struct _PacketPrimitive
+{
+    float  p[3];      /* The center of a sphere, or p0 of a triangle. */
+    float  e1[3];     /* The squared radius of a sphere in e1[0]. */
+    float  e2[3];
+    int    sphere;
+
+} PacketPrimitive;
+
+typedef struct _PacketScene
+{
+    const BvhNode *nodes;
+    std::vector<PacketPrimitive> primitives;
+    std::vector<float> plane_p;    /* Three floats per plane. */
+    std::vector<float> plane_n;
+
+} PacketScene;
+
+static void init_packet_scene(PacketScene *packet_scene, const Scene *scene)
+{
+    size_t i;
+
+    packet_scene->nodes =
+        scene->nodes.empty() ? NULL : scene->nodes.data();
+
+    const size_t nspheres = scene->spheres.size();
+    packet_scene->primitives.resize(scene->primitives.size());
+    for (i = 0; i < scene->primitives.size(); i++) {
+        PacketPrimitive *primitive = &packet_scene->primitives[i];
+        memset(primitive, 0, sizeof(*primitive));
+        const uint32_t index = scene->primitives[i];
+        if (index < nspheres) {
+            const Sphere *sphere = &scene->spheres[index];
+            primitive->p[0] = sphere->center.x;
+            primitive->p[1] = sphere->center.y;
+            primitive->p[2] = sphere->center.z;
+            primitive->e1[0] = sphere->radius * sphere->radius;
+            primitive->sphere = 1;
+        } else {
+            const Triangle *tri = &scene->triangles[index - nspheres];
+            primitive->p[0] = tri->p0.x;
+            primitive->p[1] = tri->p0.y;
+            primitive->p[2] = tri->p0.z;
+            primitive->e1[0] = tri->e1.x;
+            primitive->e1[1] = tri->e1.y;
+            primitive->e1[2] = tri->e1.z;
+            primitive->e2[0] = tri->e2.x;
+            primitive->e2[1] = tri->e2.y;
+            primitive->e2[2] = tri->e2.z;
+        }
+    }
+
+    packet_scene->plane_p.clear();
+    packet_scene->plane_n.clear();
+    for (i = 0; i < scene->planes.size(); i++) {
+        const Plane *plane = &scene->planes[i];
+        packet_scene->plane_p.push_back(plane->p.x);
+        packet_scene->plane_p.push_back(plane->p.y);
+        packet_scene->plane_p.push_back(plane->p.z);
+        packet_scene->plane_n.push_back(plane->n.x);
+        packet_scene->plane_n.push_back(plane->n.y);
+        packet_scene->plane_n.push_back(plane->n.z);
+    }
+}
+
+/* Counts the rays from org with the n directions (dx, dy, dz) that hit the
+ * scene. n is a multiple of PACKET_ALIGNMENT. */
+typedef int (*OcclusionKernel)(const PacketScene *scene, const float *org,
+                               const float *dx, const float *dy,
+                               const float *dz, int n);
+
+struct OcclusionKernelSet {
+    const char *name;
+    OcclusionKernel kernel;
+};
+
+typedef float v1f __attribute__((vector_size(4)));
+typedef int v1i __attribute__((vector_size(4)));
+
+/* Whether any lane of the mask is set, for leaving the traversal early. */
+__attribute__((always_inline)) inline bool any_lane(v1i mask)
+{
+    return mask[0] != 0;
+}
+
+#ifdef AO_X86
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef int v4i __attribute__((vector_size(16)));
+typedef float v8f __attribute__((vector_size(32)));
+typedef int v8i __attribute__((vector_size(32)));
+
+__attribute__((target("sse4.1"))) inline bool
+any_lane(v4i mask)
+{
+    return !_mm_testz_si128((__m128i)mask, (__m128i)mask);
+}
+
+__attribute__((target("avx2"))) inline bool
+any_lane(v8i mask)
+{
+    return !_mm256_testz_si256((__m256i)mask, (__m256i)mask);
+}
+
+#endif  /* AO_X86 */
+
+/* Clears the lanes of active whose rays hit the leaf primitive from org. */
+template <typename V, typename M>
+__attribute__((always_inline)) inline void
+occlude_primitive(const PacketPrimitive *primitive, const float *org,
+                  const V& x, const V& y, const V& z, M *active)
+{
+    const V zero = {};
+    const float s[3] = {org[0] - primitive->p[0], org[1] - primitive->p[1],
+                        org[2] - primitive->p[2]};
+
+    if (primitive->sphere) {
+        /* The near root of a sphere is ahead of the ray if b < 0 and
+         * b * b > c > 0, where c does not depend on the direction. */
+        const float c = s[0] * s[0] + s[1] * s[1] + s[2] * s[2] -
+            primitive->e1[0];
+        if (c <= 0.0f) {
+            return;
+        }
+        const V b = x * s[0] + y * s[1] + z * s[2];
+        *active &= ~((b < zero) & (b * b > zero + c));
+        return;
+    }
+
+    /* Moller-Trumbore, where the terms of s = org - p0 are shared by the
+     * packet. */
+    const float *e1 = primitive->e1;
+    const float *e2 = primitive->e2;
+    const float q[3] = {s[1] * e1[2] - s[2] * e1[1],
+                        s[2] * e1[0] - s[0] * e1[2],
+                        s[0] * e1[1] - s[1] * e1[0]};
+    const float t_num = e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2];
+
+    const V px = y * e2[2] - z * e2[1];
+    const V py = z * e2[0] - x * e2[2];
+    const V pz = x * e2[1] - y * e2[0];
+    const V det = px * e1[0] + py * e1[1] + pz * e1[2];
+    const V inv_det = (zero + 1.0f) / det;
+    const V u = (px * s[0] + py * s[1] + pz * s[2]) * inv_det;
+    const V v = (x * q[0] + y * q[1] + z * q[2]) * inv_det;
+    const V t = t_num * inv_det;
+    *active &= ~((det != zero) & (u >= zero) & (v >= zero) &
+                 (u + v <= zero + 1.0f) & (t > zero));
+}
+
+/*
+ * The kernel for packets of W rays in vectors of type V, with masks of type
+ * M. It is inlined into a function per instruction set, which decides the
+ * instructions the vector operations are lowered to.
+ */
+template <typename V, typename M, int W>
+__attribute__((always_inline)) inline int
+count_hits(const PacketScene *scene, const float *org,
+           const float *dx, const float *dy, const float *dz, int n)
+{
+    M hits = {};
+    int count = 0;
+    int i, j, k;
+    size_t l;
+
+    const size_t nplanes = scene->plane_n.size() / 3;
+    const float *plane_p = scene->plane_p.data();
+    const float *plane_n = scene->plane_n.data();
+    const PacketPrimitive *primitives = scene->primitives.data();
+
+    for (i = 0; i < n; i += W) {
+        V x, y, z;
+        memcpy(&x, dx + i, sizeof(x));
+        memcpy(&y, dy + i, sizeof(y));
+        memcpy(&z, dz + i, sizeof(z));
+
+        /* Scalars are broadcast explicitly, as comparisons with them are
+         * not vectorized. */
+        const V zero = {};
+        const M valid = (x != zero) | (y != zero) | (z != zero);
+        M active = valid;
+
+        for (l = 0; l < nplanes; l++) {
+            const float *p = plane_p + 3 * l;
+            const float *pn = plane_n + 3 * l;
+            const float plane_d = -(org[0] * pn[0] + org[1] * pn[1] +
+                org[2] * pn[2] - (p[0] * pn[0] + p[1] * pn[1] + p[2] * pn[2]));
+            const V v = x * pn[0] + y * pn[1] + z * pn[2];
+            const V t = plane_d / v;
+            active &= ~(((v > zero + 1.0e-17f) | (v < zero - 1.0e-17f)) &
+                        (t > zero) & (t < zero + 1.0e+17f));
+        }
+
+        if (scene->nodes != NULL && any_lane(active)) {
+            const V inv_dir[3] = {(zero + 1.0f) / x, (zero + 1.0f) / y,
+                                  (zero + 1.0f) / z};
+            uint32_t stack[BVH_MAX_DEPTH];
+            int sp = 0;
+            uint32_t index = 0;
+
+            for (;;) {
+                const BvhNode *node = &scene->nodes[index];
+                V tnear = zero;
+                V tfar = zero + 1.0e+17f;
+                for (k = 0; k < 3; k++) {
+                    const V t0 = (node->lower[k] - org[k]) * inv_dir[k];
+                    const V t1 = (node->upper[k] - org[k]) * inv_dir[k];
+                    tnear = t0 < t1 ? (t0 > tnear ? t0 : tnear) :
+                        (t1 > tnear ? t1 : tnear);
+                    tfar = t0 < t1 ? (t1 < tfar ? t1 : tfar) :
+                        (t0 < tfar ? t0 : tfar);
+                }
+
+                if (any_lane(active & (tnear <= tfar))) {
+                    if (node->count == 0) {
+                        stack[sp++] = node->offset;
+                        index++;
+                        continue;
+                    }
+                    for (j = 0; j < node->count; j++) {
+                        occlude_primitive(&primitives[node->offset + j],
+                                          org, x, y, z, &active);
+                    }
+                    if (!any_lane(active)) {
+                        break;
+                    }
+                }
+                if (sp == 0) {
+                    break;
+                }
+                index = stack[--sp];
+            }
+        }
+
+        /* Masks are -1 for the lanes that hit. */
+        hits -= valid & ~active;
+    }
+
+    for (j = 0; j < W; j++) {
+        count += hits[j];
+    }
+    return count;
+}
+
+int count_hits_scalar(const PacketScene *scene, const float *org,
+                      const float *dx, const float *dy, const float *dz, int n)
+{
+    return count_hits<v1f, v1i, 1>(scene, org, dx, dy, dz, n);
+}
+
+const OcclusionKernelSet kScalarOcclusion = {"scalar", count_hits_scalar};
+
+#ifdef AO_X86
+
+__attribute__((target("sse4.1")))
+int count_hits_sse(const PacketScene *scene, const float *org,
+                   const float *dx, const float *dy, const float *dz, int n)
+{
+    return count_hits<v4f, v4i, 4>(scene, org, dx, dy, dz, n);
+}
+
+__attribute__((target("avx2")))
+int count_hits_avx2(const PacketScene *scene, const float *org,
+                    const float *dx, const float *dy, const float *dz, int n)
+{
+    const int count = count_hits<v8f, v8i, 8>(scene, org, dx, dy, dz, n);
+    /* Unoptimized builds leave the upper halves dirty, which slows down the
+     * SSE code of the caller and of libm. */
+    _mm256_zeroupper();
+    return count;
+}
+
+/* GCC scalarizes the comparisons of 512-bit vectors into vector masks, so
+ * this one is written with intrinsics and mask registers. */
+__attribute__((target("avx512f")))
+inline __mmask16 occlude_primitive_avx512(const PacketPrimitive *primitive,
+                                          const float *org, __m512 x,
+                                          __m512 y, __m512 z)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const float s[3] = {org[0] - primitive->p[0], org[1] - primitive->p[1],
+                        org[2] - primitive->p[2]};
+
+    if (primitive->sphere) {
+        const float c = s[0] * s[0] + s[1] * s[1] + s[2] * s[2] -
+            primitive->e1[0];
+        if (c <= 0.0f) {
+            return 0;
+        }
+        const __m512 b = _mm512_add_ps(_mm512_add_ps(
+            _mm512_mul_ps(x, _mm512_set1_ps(s[0])),
+            _mm512_mul_ps(y, _mm512_set1_ps(s[1]))),
+            _mm512_mul_ps(z, _mm512_set1_ps(s[2])));
+        return _mm512_cmp_ps_mask(b, zero, _CMP_LT_OQ) &
+            _mm512_cmp_ps_mask(_mm512_mul_ps(b, b), _mm512_set1_ps(c),
+                               _CMP_GT_OQ);
+    }
+
+    const float *e1 = primitive->e1;
+    const float *e2 = primitive->e2;
+    const float q[3] = {s[1] * e1[2] - s[2] * e1[1],
+                        s[2] * e1[0] - s[0] * e1[2],
+                        s[0] * e1[1] - s[1] * e1[0]};
+    const float t_num = e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2];
+
+    const __m512 px = _mm512_sub_ps(_mm512_mul_ps(y, _mm512_set1_ps(e2[2])),
+                                    _mm512_mul_ps(z, _mm512_set1_ps(e2[1])));
+    const __m512 py = _mm512_sub_ps(_mm512_mul_ps(z, _mm512_set1_ps(e2[0])),
+                                    _mm512_mul_ps(x, _mm512_set1_ps(e2[2])));
+    const __m512 pz = _mm512_sub_ps(_mm512_mul_ps(x, _mm512_set1_ps(e2[1])),
+                                    _mm512_mul_ps(y, _mm512_set1_ps(e2[0])));
+    const __m512 det = _mm512_add_ps(_mm512_add_ps(
+        _mm512_mul_ps(px, _mm512_set1_ps(e1[0])),
+        _mm512_mul_ps(py, _mm512_set1_ps(e1[1]))),
+        _mm512_mul_ps(pz, _mm512_set1_ps(e1[2])));
+    const __m512 inv_det = _mm512_div_ps(_mm512_set1_ps(1.0f), det);
+    const __m512 u = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(
+        _mm512_mul_ps(px, _mm512_set1_ps(s[0])),
+        _mm512_mul_ps(py, _mm512_set1_ps(s[1]))),
+        _mm512_mul_ps(pz, _mm512_set1_ps(s[2]))), inv_det);
+    const __m512 v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(
+        _mm512_mul_ps(x, _mm512_set1_ps(q[0])),
+        _mm512_mul_ps(y, _mm512_set1_ps(q[1]))),
+        _mm512_mul_ps(z, _mm512_set1_ps(q[2]))), inv_det);
+    const __m512 t = _mm512_mul_ps(_mm512_set1_ps(t_num), inv_det);
+    return _mm512_cmp_ps_mask(det, zero, _CMP_NEQ_OQ) &
+        _mm512_cmp_ps_mask(u, zero, _CMP_GE_OQ) &
+        _mm512_cmp_ps_mask(v, zero, _CMP_GE_OQ) &
+        _mm512_cmp_ps_mask(_mm512_add_ps(u, v), _mm512_set1_ps(1.0f),
+                           _CMP_LE_OQ) &
+        _mm512_cmp_ps_mask(t, zero, _CMP_GT_OQ);
+}
+
+__attribute__((target("avx512f")))
+int count_hits_avx512(const PacketScene *scene, const float *org,
+                      const float *dx, const float *dy, const float *dz, int n)
+{
+    int count = 0;
+    int i, j, k;
+    size_t l;
+
+    const size_t nplanes = scene->plane_n.size() / 3;
+    const float *plane_p = scene->plane_p.data();
+    const float *plane_n = scene->plane_n.data();
+    const PacketPrimitive *primitives = scene->primitives.data();
+
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.0f);
+    for (i = 0; i < n; i += 16) {
+        const __m512 x = _mm512_loadu_ps(dx + i);
+        const __m512 y = _mm512_loadu_ps(dy + i);
+        const __m512 z = _mm512_loadu_ps(dz + i);
+
+        const __mmask16 valid = _mm512_cmp_ps_mask(x, zero, _CMP_NEQ_OQ) |
+            _mm512_cmp_ps_mask(y, zero, _CMP_NEQ_OQ) |
+            _mm512_cmp_ps_mask(z, zero, _CMP_NEQ_OQ);
+        __mmask16 active = valid;
+
+        for (l = 0; l < nplanes; l++) {
+            const float *p = plane_p + 3 * l;
+            const float *pn = plane_n + 3 * l;
+            const float plane_d = -(org[0] * pn[0] + org[1] * pn[1] +
+                org[2] * pn[2] - (p[0] * pn[0] + p[1] * pn[1] + p[2] * pn[2]));
+            const __m512 v = _mm512_add_ps(_mm512_add_ps(
+                _mm512_mul_ps(x, _mm512_set1_ps(pn[0])),
+                _mm512_mul_ps(y, _mm512_set1_ps(pn[1]))),
+                _mm512_mul_ps(z, _mm512_set1_ps(pn[2])));
+            const __m512 t = _mm512_div_ps(_mm512_set1_ps(plane_d), v);
+            active &= ~((_mm512_cmp_ps_mask(v, _mm512_set1_ps(1.0e-17f),
+                                            _CMP_GT_OQ) |
+                         _mm512_cmp_ps_mask(v, _mm512_set1_ps(-1.0e-17f),
+                                            _CMP_LT_OQ)) &
+                        _mm512_cmp_ps_mask(t, zero, _CMP_GT_OQ) &
+                        _mm512_cmp_ps_mask(t, _mm512_set1_ps(1.0e+17f),
+                                           _CMP_LT_OQ));
+        }
+
+        if (scene->nodes != NULL && active) {
+            const __m512 inv_dir[3] = {_mm512_div_ps(one, x),
+                                       _mm512_div_ps(one, y),
+                                       _mm512_div_ps(one, z)};
+            uint32_t stack[BVH_MAX_DEPTH];
+            int sp = 0;
+            uint32_t index = 0;
+
+            for (;;) {
+                const BvhNode *node = &scene->nodes[index];
+                __m512 tnear = zero;
+                __m512 tfar = _mm512_set1_ps(1.0e+17f);
+                for (k = 0; k < 3; k++) {
+                    const __m512 t0 = _mm512_mul_ps(
+                        _mm512_set1_ps(node->lower[k] - org[k]), inv_dir[k]);
+                    const __m512 t1 = _mm512_mul_ps(
+                        _mm512_set1_ps(node->upper[k] - org[k]), inv_dir[k]);
+                    const __mmask16 lt = _mm512_cmp_ps_mask(t0, t1,
+                                                            _CMP_LT_OQ);
+                    const __m512 enter = _mm512_mask_blend_ps(lt, t1, t0);
+                    const __m512 exit = _mm512_mask_blend_ps(lt, t0, t1);
+                    tnear = _mm512_mask_blend_ps(
+                        _mm512_cmp_ps_mask(enter, tnear, _CMP_GT_OQ),
+                        tnear, enter);
+                    tfar = _mm512_mask_blend_ps(
+                        _mm512_cmp_ps_mask(exit, tfar, _CMP_LT_OQ),
+                        tfar, exit);
+                }
+
+                if (active & _mm512_cmp_ps_mask(tnear, tfar, _CMP_LE_OQ)) {
+                    if (node->count == 0) {
+                        stack[sp++] = node->offset;
+                        index++;
+                        continue;
+                    }
+                    for (j = 0; j < node->count; j++) {
+                        active &= ~occlude_primitive_avx512(
+                            &primitives[node->offset + j], org, x, y, z);
+                    }
+                    if (!active) {
+                        break;
+                    }
+                }
+                if (sp == 0) {
+                    break;
+                }
+                index = stack[--sp];
+            }
+        }
+
+        count += __builtin_popcount(valid & ~active);
+    }
+    _mm256_zeroupper();
+    return count;
+}
+
+const OcclusionKernelSet kSseOcclusion = {"sse4.1", count_hits_sse};
+const OcclusionKernelSet kAvx2Occlusion = {"avx2", count_hits_avx2};
+const OcclusionKernelSet kAvx512Occlusion = {"avx512", count_hits_avx512};
+
+#endif  /* AO_X86 */
+
+const OcclusionKernelSet *detect_occlusion_kernel()
+{
+#ifdef AO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return &kAvx512Occlusion;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return &kAvx2Occlusion;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return &kSseOcclusion;
+    }
+#endif
+    return &kScalarOcclusion;
+}
+
+const OcclusionKernelSet *g_occlusion = detect_occlusion_kernel();
+
+/* Draws the cosine-weighted directions of the hemisphere around basis[2] for
+ * the samples (u, v) in 0.32 fixed point, i.e. the points at radius sqrt(u)
+ * and angle 2 pi v of the unit disk projected up onto the hemisphere. basis
+ * holds the axes of orthoBasis. n is a multiple of PACKET_ALIGNMENT. */
+typedef void (*HemisphereSampler)(const uint32_t *u, const uint32_t *v, int n,
+                                  const vec *basis,
+                                  float *dx, float *dy, float *dz);
+
+struct HemisphereSamplerSet {
+    const char *name;
+    HemisphereSampler sampler;
+};
+
+/* The reference on libm in double. */
+void sample_hemisphere_libm(const uint32_t *u, const uint32_t *v, int n,
+                            const vec *basis,
+                            float *dx, float *dy, float *dz)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        double theta = sqrt(u[i] * (1.0 / 4294967296.0));
+        double phi   = 2.0 * M_PI * (v[i] * (1.0 / 4294967296.0));
+
+        double x = cos(phi) * theta;
+        double y = sin(phi) * theta;
+        double z = sqrt(1.0 - theta * theta);
+
+        // local -> global
+        dx[i] = x * basis[0].x + y * basis[1].x + z * basis[2].x;
+        dy[i] = x * basis[0].y + y * basis[1].y + z * basis[2].y;
+        dz[i] = x * basis[0].z + y * basis[1].z + z * basis[2].z;
+    }
+}
+
+/* The same directions in float, with sin and cos of the angle reduced to
+ * [-pi/4, pi/4] by its nearest quarter turn, which the fixed point angle
+ * gives exactly, and approximated by the polynomials of Cephes sinf and
+ * cosf there. The loop has no calls nor branches, so the compiler
+ * vectorizes it; blocks of a fixed size spare it a remainder loop. */
+void sample_hemisphere_polynomial(const uint32_t *__restrict u,
+                                  const uint32_t *__restrict v, int n,
+                                  const vec *basis,
+                                  float *__restrict dx,
+                                  float *__restrict dy,
+                                  float *__restrict dz)
+{
+    const float b0x = basis[0].x, b0y = basis[0].y, b0z = basis[0].z;
+    const float b1x = basis[1].x, b1y = basis[1].y, b1z = basis[1].z;
+    const float b2x = basis[2].x, b2y = basis[2].y, b2z = basis[2].z;
+    int i, k;
+
+    for (i = 0; i < n; i += PACKET_ALIGNMENT) {
+        for (k = i; k < i + PACKET_ALIGNMENT; k++) {
+            /* The squared radius and 1 - it, the latter from the
+             * complement so that it keeps its precision near the horizon.
+             * The lowest bits fit the signed conversions. */
+            const float r2 = (float)(int32_t)(u[k] >> 1) *
+                (1.0f / 2147483648.0f);
+            const float z2 = (float)(int32_t)(~u[k] >> 1) *
+                (1.0f / 2147483648.0f) + (1.5f / 4294967296.0f);
+            const float r = sqrtf(r2);
+            const float z = sqrtf(z2);
+
+            const uint32_t q = (v[k] + (1U << 29)) >> 30;
+            const float a = (float)(int32_t)(v[k] - (q << 30)) *
+                (float)(2.0 * M_PI / 4294967296.0);
+            const float a2 = a * a;
+            const float s = a + a * a2 * (-1.6666654611e-1f +
+                a2 * (8.3321608736e-3f + a2 * -1.9515295891e-4f));
+            const float c = 1.0f - 0.5f * a2 + a2 * a2 *
+                (4.166664568298827e-2f + a2 * (-1.388731625493765e-3f +
+                 a2 * 2.443315711809948e-5f));
+
+            /* Turns (c, s) by q quarter turns. */
+            const float cq = (q & 1) ? s : c;
+            const float sq = (q & 1) ? c : s;
+            const float x = r * (((q + 1) & 2) ? -cq : cq);
+            const float y = r * ((q & 2) ? -sq : sq);
+
+            dx[k] = x * b0x + y * b1x + z * b2x;
+            dy[k] = x * b0y + y * b1y + z * b2y;
+            dz[k] = x * b0z + y * b1z + z * b2z;
+        }
+    }
+}
+
+const HemisphereSamplerSet kLibmSampler = {"libm", sample_hemisphere_libm};
+const HemisphereSamplerSet kPolynomialSampler = {
+    "polynomial", sample_hemisphere_polynomial};
+
+const HemisphereSamplerSet *g_sampler = &kPolynomialSampler;
+
+/* Traces the occlusion samples [sample_offset, sample_offset + nrays) of the
+ * sequence, rotated by shift in 0.32 fixed point. kAoSamples fixes the
+ * number of samples per axis at compile time, so that the sampling loops
+ * and the packet are sized statically; 0 reads nao_samples instead, which
+ * must be at most kMaxAoBenchAoSamples. */
+template <int kAoSamples>
+void ambient_occlusion(vec *col, const Isect *isect,
+                       const PacketScene *scene, int nao_samples,
+                       uint64_t sample_offset, const uint32_t *shift)
 {
     int    i, j;
-    int    ntheta = NAO_SAMPLES;
-    int    nphi   = NAO_SAMPLES;
+    const int ntheta = kAoSamples > 0 ? kAoSamples : nao_samples;
+    const int nphi   = kAoSamples > 0 ? kAoSamples : nao_samples;
     double eps = 0.0001;
 
     vec p;
@@ -175,50 +970,67 @@ void ambient_occlusion(vec *col, const Isect *isect)
     vec basis[3];
     orthoBasis(basis, isect->n);
 
-    double occlusion = 0.0;
+    const int nrays = ntheta * nphi;
+    const int npacket = (nrays + PACKET_ALIGNMENT - 1) /
+        PACKET_ALIGNMENT * PACKET_ALIGNMENT;
+
+    /* Sized for the most samples this specialization traces. */
+    enum {
+        kMaxRays = kAoSamples > 0 ? kAoSamples * kAoSamples :
+            kMaxAoBenchAoSamples * kMaxAoBenchAoSamples,
+        kMaxPacket = (kMaxRays + PACKET_ALIGNMENT - 1) /
+            PACKET_ALIGNMENT * PACKET_ALIGNMENT
+    };
+    assert(npacket <= kMaxPacket);
+    uint32_t u[kMaxPacket];
+    uint32_t v[kMaxPacket];
+    float dx[kMaxPacket];
+    float dy[kMaxPacket];
+    float dz[kMaxPacket];
 
     for (j = 0; j < ntheta; j++) {
         for (i = 0; i < nphi; i++) {
-            double theta = sqrt(drand48());
-            double phi   = 2.0 * M_PI * drand48();
-
-            double x = cos(phi) * theta;
-            double y = sin(phi) * theta;
-            double z = sqrt(1.0 - theta * theta);
-
-            // local -> global
-            double rx = x * basis[0].x + y * basis[1].x + z * basis[2].x;
-            double ry = x * basis[0].y + y * basis[1].y + z * basis[2].y;
-            double rz = x * basis[0].z + y * basis[1].z + z * basis[2].z;
-
-            Ray ray;
-
-            ray.org = p;
-            ray.dir.x = rx;
-            ray.dir.y = ry;
-            ray.dir.z = rz;
-
-            Isect occIsect;
-            occIsect.t   = 1.0e+17;
-            occIsect.hit = 0;
-
-            ray_sphere_intersect(&occIsect, &ray, &spheres[0]); 
-            ray_sphere_intersect(&occIsect, &ray, &spheres[1]); 
-            ray_sphere_intersect(&occIsect, &ray, &spheres[2]); 
-            ray_plane_intersect (&occIsect, &ray, &plane); 
-
-            if (occIsect.hit) occlusion += 1.0;
-            
+            /* The rotation wraps around in fixed point. */
+            const uint32_t index = (uint32_t)(sample_offset + j * nphi + i);
+            u[j * nphi + i] = van_der_corput(index) + shift[0];
+            v[j * nphi + i] = sobol2(index) + shift[1];
         }
     }
+    for (i = nrays; i < npacket; i++) {
+        u[i] = v[i] = 0;
+    }
+    g_sampler->sampler(u, v, npacket, basis, dx, dy, dz);
+    for (i = nrays; i < npacket; i++) {
+        dx[i] = dy[i] = dz[i] = 0.0f;
+    }
 
-    occlusion = (ntheta * nphi - occlusion) / (double)(ntheta * nphi);
+    const float org[3] = {(float)p.x, (float)p.y, (float)p.z};
+    const int hits = g_occlusion->kernel(scene, org, dx, dy, dz, npacket);
+
+    double occlusion = (nrays - hits) / (double)nrays;
 
     col->x = occlusion;
     col->y = occlusion;
     col->z = occlusion;
 }
 
+typedef void (*AmbientOcclusionFunction)(vec *col, const Isect *isect,
+                                         const PacketScene *scene,
+                                         int nao_samples,
+                                         uint64_t sample_offset,
+                                         const uint32_t *shift);
+
+/* Picks the specialization for the common numbers of samples. */
+AmbientOcclusionFunction select_ambient_occlusion(int nao_samples)
+{
+    switch (nao_samples) {
+        case 4:  return ambient_occlusion<4>;
+        case 8:  return ambient_occlusion<8>;
+        case 16: return ambient_occlusion<16>;
+        default: return ambient_occlusion<0>;
+    }
+}
+
 unsigned char
 clamp(double f)
 {
@@ -231,70 +1043,335 @@ clamp(double f)
 }
 
 
+/*
+ * Renders row y of the tw x th tile at (x0, y0) of the w x h frame into the
+ * RGBA of img, scaled to 0-255 but not quantized. The samples of each pixel
+ * are keyed by its position in the frame.
+ */
 void
-render(unsigned char *img, int w, int h, int nsubsamples)
+render_row(float *img, const Scene *scene,
+           const PacketScene *packet_scene, const Camera *camera,
+           AmbientOcclusionFunction occlusion, int nao_samples,
+           uint64_t key, uint64_t sample_offset,
+           int x0, int y0, int tw, int y, int w, int h, int nsubsamples)
 {
-    int x, y;
+    int x;
     int u, v;
 
-    double *fimg = (double *)malloc(sizeof(double) * w * h * 3);
-    memset((void *)fimg, 0, sizeof(double) * w * h * 3);
+    for (x = 0; x < tw; x++) {
+        const uint64_t pixel_key = mix(key + (uint64_t)(y0 + y) * w + (x0 + x));
 
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            
-            for (v = 0; v < nsubsamples; v++) {
-                for (u = 0; u < nsubsamples; u++) {
-                    double px = (x + (u / (double)nsubsamples) - (w / 2.0)) / (w / 2.0);
-                    double py = -(y + (v / (double)nsubsamples) - (h / 2.0)) / (h / 2.0);
-
-                    Ray ray;
-
-                    ray.org.x = 0.0;
-                    ray.org.y = 0.0;
-                    ray.org.z = 0.0;
-
-                    ray.dir.x = px;
-                    ray.dir.y = py;
-                    ray.dir.z = -1.0;
-                    vnormalize(&(ray.dir));
-
-                    Isect isect;
-                    isect.t   = 1.0e+17;
-                    isect.hit = 0;
-
-                    ray_sphere_intersect(&isect, &ray, &spheres[0]);
-                    ray_sphere_intersect(&isect, &ray, &spheres[1]);
-                    ray_sphere_intersect(&isect, &ray, &spheres[2]);
-                    ray_plane_intersect (&isect, &ray, &plane);
-
-                    if (isect.hit) {
-                        vec col;
-                        ambient_occlusion(&col, &isect);
-
-                        fimg[3 * (y * w + x) + 0] += col.x;
-                        fimg[3 * (y * w + x) + 1] += col.y;
-                        fimg[3 * (y * w + x) + 2] += col.z;
-                    }
+        vec col_sum;
+        col_sum.x = 0.0;
+        col_sum.y = 0.0;
+        col_sum.z = 0.0;
+
+        for (v = 0; v < nsubsamples; v++) {
+            for (u = 0; u < nsubsamples; u++) {
+                double px = (x0 + x + (u / (double)nsubsamples) - (w / 2.0)) / (w / 2.0);
+                double py = -(y0 + y + (v / (double)nsubsamples) - (h / 2.0)) / (h / 2.0);
+
+                Ray ray;
+
+                ray.org = camera->eye;
 
+                ray.dir.x = px * camera->u.x + py * camera->v.x + camera->w.x;
+                ray.dir.y = px * camera->u.y + py * camera->v.y + camera->w.y;
+                ray.dir.z = px * camera->u.z + py * camera->v.z + camera->w.z;
+                vnormalize(&(ray.dir));
+
+                Isect isect;
+                isect.t   = 1.0e+17;
+                isect.hit = 0;
+
+                intersect_scene(&isect, &ray, scene);
+
+                if (isect.hit) {
+                    vec col;
+                    const uint64_t bits = mix(pixel_key +
+                        0x9e3779b97f4a7c15ULL * (v * nsubsamples + u + 1));
+                    const uint32_t shift[2] = {(uint32_t)(bits >> 32),
+                                               (uint32_t)bits};
+                    occlusion(&col, &isect, packet_scene, nao_samples,
+                              sample_offset, shift);
+
+                    col_sum.x += col.x;
+                    col_sum.y += col.y;
+                    col_sum.z += col.z;
                 }
+
             }
+        }
 
-            fimg[3 * (y * w + x) + 0] /= (double)(nsubsamples * nsubsamples);
-            fimg[3 * (y * w + x) + 1] /= (double)(nsubsamples * nsubsamples);
-            fimg[3 * (y * w + x) + 2] /= (double)(nsubsamples * nsubsamples);
-        
-            img[3 * (y * w + x) + 0] = clamp(fimg[3 *(y * w + x) + 0]);
-            img[3 * (y * w + x) + 1] = clamp(fimg[3 *(y * w + x) + 1]);
-            img[3 * (y * w + x) + 2] = clamp(fimg[3 *(y * w + x) + 2]);
+        img[4 * (y * tw + x) + 0] = (float)(col_sum.x * 255.0 / (double)(nsubsamples * nsubsamples));
+        img[4 * (y * tw + x) + 1] = (float)(col_sum.y * 255.0 / (double)(nsubsamples * nsubsamples));
+        img[4 * (y * tw + x) + 2] = (float)(col_sum.z * 255.0 / (double)(nsubsamples * nsubsamples));
+        img[4 * (y * tw + x) + 3] = 255.0f;
+    }
+}
+
+/* A primitive being sorted into the BVH. */
+typedef struct _BuildPrimitive
+{
+    double   lower[3];
+    double   upper[3];
+    double   centroid[3];
+    uint32_t index;
+
+} BuildPrimitive;
+
+#define BVH_NUM_BINS       16
+#define BVH_MAX_LEAF_SIZE  8
+
+/* Cost of visiting a node relative to testing a primitive. */
+#define BVH_TRAVERSAL_COST 1.0
+
+static void
+bounds_extend(double *lower, double *upper, const double *p_lower,
+              const double *p_upper)
+{
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        if (p_lower[k] < lower[k]) lower[k] = p_lower[k];
+        if (p_upper[k] > upper[k]) upper[k] = p_upper[k];
+    }
+}
+
+static double
+half_area(const double *lower, const double *upper)
+{
+    const double x = upper[0] - lower[0];
+    const double y = upper[1] - lower[1];
+    const double z = upper[2] - lower[2];
+    return x * y + y * z + z * x;
+}
+
+/* Bounds in float that contain the double ones with a margin for the float
+ * tests of the occlusion rays. */
+static void
+set_node_bounds(BvhNode *node, const double *lower, const double *upper)
+{
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        const double margin = 1.0e-5 * (fabs(lower[k]) + fabs(upper[k]) + 1.0);
+        node->lower[k] = nextafterf((float)(lower[k] - margin), -INFINITY);
+        node->upper[k] = nextafterf((float)(upper[k] + margin), INFINITY);
+    }
+}
+
+/*
+ * Partitions prims[begin, end) by the binned surface area heuristic over
+ * all three axes. Returns the first primitive of the second half, or begin
+ * if testing all of the primitives is cheaper than any split.
+ */
+static size_t
+sah_split(BuildPrimitive *prims, size_t begin, size_t end, int *split_axis)
+{
+    const double inf = INFINITY;
+    double c_lower[3] = {inf, inf, inf};
+    double c_upper[3] = {-inf, -inf, -inf};
+    double lower[3] = {inf, inf, inf};
+    double upper[3] = {-inf, -inf, -inf};
+    size_t i;
+    int axis, b;
+
+    for (i = begin; i < end; i++) {
+        bounds_extend(c_lower, c_upper, prims[i].centroid, prims[i].centroid);
+        bounds_extend(lower, upper, prims[i].lower, prims[i].upper);
+    }
+
+    double best_cost = (end - begin) * half_area(lower, upper);
+    int best_axis = -1;
+    int best_bin = 0;
+
+    for (axis = 0; axis < 3; axis++) {
+        const double extent = c_upper[axis] - c_lower[axis];
+        if (!(extent > 0.0)) {
+            continue;
+        }
+
+        size_t counts[BVH_NUM_BINS] = {0};
+        double b_lower[BVH_NUM_BINS][3];
+        double b_upper[BVH_NUM_BINS][3];
+        for (b = 0; b < BVH_NUM_BINS; b++) {
+            b_lower[b][0] = b_lower[b][1] = b_lower[b][2] = inf;
+            b_upper[b][0] = b_upper[b][1] = b_upper[b][2] = -inf;
+        }
+        for (i = begin; i < end; i++) {
+            b = (int)((prims[i].centroid[axis] - c_lower[axis]) *
+                      (BVH_NUM_BINS / extent));
+            b = std::min(b, BVH_NUM_BINS - 1);
+            counts[b]++;
+            bounds_extend(b_lower[b], b_upper[b],
+                          prims[i].lower, prims[i].upper);
+        }
+
+        /* Costs of the right halves from each bin on. */
+        double right_cost[BVH_NUM_BINS];
+        double r_lower[3] = {inf, inf, inf};
+        double r_upper[3] = {-inf, -inf, -inf};
+        size_t r_count = 0;
+        for (b = BVH_NUM_BINS - 1; b > 0; b--) {
+            bounds_extend(r_lower, r_upper, b_lower[b], b_upper[b]);
+            r_count += counts[b];
+            right_cost[b] = r_count ? r_count * half_area(r_lower, r_upper) : 0.0;
+        }
+
+        double l_lower[3] = {inf, inf, inf};
+        double l_upper[3] = {-inf, -inf, -inf};
+        size_t l_count = 0;
+        for (b = 1; b < BVH_NUM_BINS; b++) {
+            bounds_extend(l_lower, l_upper, b_lower[b - 1], b_upper[b - 1]);
+            l_count += counts[b - 1];
+            if (l_count == 0 || l_count == end - begin) {
+                continue;
+            }
+            const double cost = BVH_TRAVERSAL_COST * half_area(lower, upper) +
+                l_count * half_area(l_lower, l_upper) + right_cost[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    if (best_axis < 0) {
+        return begin;
+    }
+
+    const double extent = c_upper[best_axis] - c_lower[best_axis];
+    BuildPrimitive *middle = std::partition(prims + begin, prims + end,
+        [&](const BuildPrimitive& prim) {
+            const int bin = (int)((prim.centroid[best_axis] -
+                                   c_lower[best_axis]) *
+                                  (BVH_NUM_BINS / extent));
+            return std::min(bin, BVH_NUM_BINS - 1) < best_bin;
+        });
+    *split_axis = best_axis;
+    return middle - prims;
+}
+
+/* Splits prims[begin, end) in halves at the median centroid of the widest
+ * axis, so that the depth grows with log n. */
+static size_t
+median_split(BuildPrimitive *prims, size_t begin, size_t end, int *split_axis)
+{
+    const double inf = INFINITY;
+    double c_lower[3] = {inf, inf, inf};
+    double c_upper[3] = {-inf, -inf, -inf};
+    size_t i;
+
+    for (i = begin; i < end; i++) {
+        bounds_extend(c_lower, c_upper, prims[i].centroid, prims[i].centroid);
+    }
+    int axis = 0;
+    if (c_upper[1] - c_lower[1] > c_upper[axis] - c_lower[axis]) axis = 1;
+    if (c_upper[2] - c_lower[2] > c_upper[axis] - c_lower[axis]) axis = 2;
+
+    const size_t middle = begin + (end - begin) / 2;
+    std::nth_element(prims + begin, prims + middle, prims + end,
+        [axis](const BuildPrimitive& a, const BuildPrimitive& b) {
+            return a.centroid[axis] < b.centroid[axis];
+        });
+    *split_axis = axis;
+    return middle;
+}
+
+static void
+build_node(Scene *scene, BuildPrimitive *prims, size_t begin, size_t end,
+           int depth)
+{
+    const double inf = INFINITY;
+    double lower[3] = {inf, inf, inf};
+    double upper[3] = {-inf, -inf, -inf};
+    size_t i;
+
+    for (i = begin; i < end; i++) {
+        bounds_extend(lower, upper, prims[i].lower, prims[i].upper);
+    }
+
+    const size_t index = scene->nodes.size();
+    scene->nodes.push_back(BvhNode());
+    set_node_bounds(&scene->nodes[index], lower, upper);
+
+    /* Past half of the maximum depth, median splits keep the rest of the
+     * tree within it for up to 2^32 primitives. */
+    int axis = 0;
+    size_t middle = begin;
+    if (end - begin > 1) {
+        middle = depth < BVH_MAX_DEPTH / 2 ?
+            sah_split(prims, begin, end, &axis) :
+            median_split(prims, begin, end, &axis);
+    }
+    if (middle == begin && end - begin > BVH_MAX_LEAF_SIZE) {
+        middle = median_split(prims, begin, end, &axis);
+    }
+
+    if (middle == begin) {
+        scene->nodes[index].offset = scene->primitives.size();
+        scene->nodes[index].count = end - begin;
+        for (i = begin; i < end; i++) {
+            scene->primitives.push_back(prims[i].index);
+        }
+        return;
+    }
+
+    build_node(scene, prims, begin, middle, depth + 1);
+    scene->nodes[index].offset = scene->nodes.size();
+    scene->nodes[index].axis = axis;
+    build_node(scene, prims, middle, end, depth + 1);
+}
+
+void
+build_bvh(Scene *scene)
+{
+    const size_t nspheres = scene->spheres.size();
+    std::vector<BuildPrimitive> prims(nspheres + scene->triangles.size());
+    size_t i;
+    int k;
+
+    for (i = 0; i < prims.size(); i++) {
+        BuildPrimitive *prim = &prims[i];
+        prim->index = i;
+        if (i < nspheres) {
+            const Sphere *sphere = &scene->spheres[i];
+            const double center[3] = {sphere->center.x, sphere->center.y,
+                                      sphere->center.z};
+            for (k = 0; k < 3; k++) {
+                prim->lower[k] = center[k] - sphere->radius;
+                prim->upper[k] = center[k] + sphere->radius;
+            }
+        } else {
+            const Triangle *tri = &scene->triangles[i - nspheres];
+            const double p0[3] = {tri->p0.x, tri->p0.y, tri->p0.z};
+            const double e1[3] = {tri->e1.x, tri->e1.y, tri->e1.z};
+            const double e2[3] = {tri->e2.x, tri->e2.y, tri->e2.z};
+            for (k = 0; k < 3; k++) {
+                prim->lower[k] = p0[k] + std::min({0.0, e1[k], e2[k]});
+                prim->upper[k] = p0[k] + std::max({0.0, e1[k], e2[k]});
+            }
+        }
+        for (k = 0; k < 3; k++) {
+            prim->centroid[k] = 0.5 * (prim->lower[k] + prim->upper[k]);
         }
     }
 
+    scene->nodes.clear();
+    scene->primitives.clear();
+    if (!prims.empty()) {
+        build_node(scene, prims.data(), 0, prims.size(), 0);
+    }
 }
 
 void
-init_scene()
+init_scene(Scene *scene)
 {
+    Sphere spheres[3];
+    Plane plane;
+
     spheres[0].center.x = -2.0;
     spheres[0].center.y =  0.0;
     spheres[0].center.z = -3.5;
@@ -318,6 +1395,161 @@ init_scene()
     plane.n.y = 1.0;
     plane.n.z = 0.0;
 
+    scene->spheres.assign(spheres, spheres + 3);
+    scene->planes.assign(1, plane);
+}
+
+/* Adds the triangle unless it is degenerate. */
+static void
+add_triangle(Scene *scene, const vec &p0, const vec &p1, const vec &p2)
+{
+    Triangle tri;
+
+    tri.p0 = p0;
+    tri.e1.x = p1.x - p0.x;
+    tri.e1.y = p1.y - p0.y;
+    tri.e1.z = p1.z - p0.z;
+    tri.e2.x = p2.x - p0.x;
+    tri.e2.y = p2.y - p0.y;
+    tri.e2.z = p2.z - p0.z;
+    vcross(&tri.n, tri.e1, tri.e2);
+    if (vdot(tri.n, tri.n) < 1.0e-30) {
+        return;
+    }
+    vnormalize(&tri.n);
+    scene->triangles.push_back(tri);
+}
+
+/*
+ * Reads the primitives of a scene file into the scene, see LoadAoScene.
+ * Lines of OBJ files other than v and f are skipped, such as normals and
+ * groups. Returns true if failed.
+ */
+static bool
+read_scene_file(Scene *scene, const std::string &file_name, bool obj)
+{
+    std::ifstream file(file_name.c_str());
+    if (!file) {
+        fprintf(stderr, "ao: cannot open %s\n", file_name.c_str());
+        return true;
+    }
+
+    /* Vertices are local to each file. */
+    std::vector<vec> vertices;
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line)) {
+        line_number++;
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream stream(line);
+        std::string keyword;
+        if (!(stream >> keyword)) {
+            continue;
+        }
+
+        bool failed = false;
+        if (keyword == "v") {
+            vec v;
+            failed = !(stream >> v.x >> v.y >> v.z);
+            vertices.push_back(v);
+        } else if (keyword == "f") {
+            std::vector<vec> polygon;
+            std::string token;
+            while (!failed && stream >> token) {
+                /* Texture and normal indices after slashes are ignored. */
+                char *end;
+                const long i = strtol(token.c_str(), &end, 10);
+                const long n = vertices.size();
+                const long index = i < 0 ? n + i : i - 1;
+                failed = end == token.c_str() || (*end != '\0' && *end != '/') ||
+                    i == 0 || index < 0 || index >= n;
+                if (!failed) {
+                    polygon.push_back(vertices[index]);
+                }
+            }
+            failed = failed || polygon.size() < 3;
+            for (size_t i = 2; !failed && i < polygon.size(); i++) {
+                add_triangle(scene, polygon[0], polygon[i - 1], polygon[i]);
+            }
+        } else if (obj) {
+            continue;
+        } else if (keyword == "sphere") {
+            Sphere sphere;
+            failed = !(stream >> sphere.center.x >> sphere.center.y >>
+                       sphere.center.z >> sphere.radius) ||
+                !(sphere.radius > 0.0);
+            scene->spheres.push_back(sphere);
+        } else if (keyword == "plane") {
+            Plane plane;
+            failed = !(stream >> plane.p.x >> plane.p.y >> plane.p.z >>
+                       plane.n.x >> plane.n.y >> plane.n.z) ||
+                vdot(plane.n, plane.n) < 1.0e-30;
+            vnormalize(&plane.n);
+            scene->planes.push_back(plane);
+        } else if (keyword == "mesh") {
+            std::string mesh_name;
+            failed = !(stream >> mesh_name) || mesh_name[0] == '/' ||
+                mesh_name.find("..") != std::string::npos;
+            if (!failed) {
+                const size_t slash = file_name.rfind('/');
+                const std::string dirname = slash == std::string::npos ?
+                    "" : file_name.substr(0, slash + 1);
+                if (read_scene_file(scene, dirname + mesh_name, true)) {
+                    return true;
+                }
+            }
+        } else {
+            failed = true;
+        }
+
+        if (failed) {
+            fprintf(stderr, "ao: %s:%d: invalid line\n", file_name.c_str(),
+                    line_number);
+            return true;
+        }
+    }
+    return file.bad();
+}
+
+/* Looks from eye at look_at with the y axis up, or the z axis if looking
+ * straight up or down. */
+void
+init_camera(Camera *camera, const double *eye, const double *look_at,
+            double fov, int w, int h)
+{
+    vec up;
+
+    camera->eye.x = eye[0];
+    camera->eye.y = eye[1];
+    camera->eye.z = eye[2];
+
+    camera->w.x = look_at[0] - eye[0];
+    camera->w.y = look_at[1] - eye[1];
+    camera->w.z = look_at[2] - eye[2];
+    vnormalize(&camera->w);
+
+    up.x = 0.0;
+    up.y = 1.0;
+    up.z = 0.0;
+    vcross(&camera->u, camera->w, up);
+    if (vdot(camera->u, camera->u) < 1.0e-12) {
+        up.y = 0.0;
+        up.z = camera->w.y > 0.0 ? -1.0 : 1.0;
+        vcross(&camera->u, camera->w, up);
+    }
+    vnormalize(&camera->u);
+    vcross(&camera->v, camera->u, camera->w);
+
+    /* The default 90 degrees keeps the film at exactly [-1, 1]. */
+    const double scale = fov == 90.0 ? 1.0 : tan(fov * M_PI / 360.0);
+    const double aspect = (double)h / w;
+    camera->u.x *= scale;
+    camera->u.y *= scale;
+    camera->u.z *= scale;
+    camera->v.x *= scale * aspect;
+    camera->v.y *= scale * aspect;
+    camera->v.z *= scale * aspect;
 }
 
 /*
@@ -351,24 +1583,252 @@ main(int argc, char **argv)
 }
 */
 
+// Number of CPUs the calling thread may run on, which the render threads
+// inherit, e.g. those of its slot on the worker.
+int NumAllowedCpus() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set)) {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+  return std::max(1, CPU_COUNT(&set));
+}
+
+// Rows of the tile are split evenly between the threads up front, so that
+// each thread renders adjacent rows. A thread that runs out of its own rows
+// steals rows of the others from the front of their ranges. Rows cost very
+// differently, e.g. the sky is cheap, so the split alone does not balance.
+class RowQueue {
+ public:
+  RowQueue(int num_rows, int num_threads)
+      : ranges_(num_threads) {
+    for (int i = 0; i < num_threads; ++i) {
+      ranges_[i].next = num_rows * i / num_threads;
+      ranges_[i].end = num_rows * (i + 1) / num_threads;
+    }
+  }
+
+  // Returns the next row for the thread, or -1 if all rows are taken.
+  int Next(int thread) {
+    const int num_ranges = ranges_.size();
+    for (int i = 0; i < num_ranges; ++i) {
+      Range& range = ranges_[(thread + i) % num_ranges];
+      if (range.next.load(std::memory_order_relaxed) >= range.end) {
+        continue;
+      }
+      const int row = range.next.fetch_add(1, std::memory_order_relaxed);
+      if (row < range.end) {
+        return row;
+      }
+    }
+    return -1;
+  }
+
+ private:
+  struct Range {
+    std::atomic<int> next;
+    int end;
+    // Keeps the counters of the threads on their own cache lines.
+    char padding[56];
+  };
+  std::vector<Range> ranges_;
+};
+
 }  // namespace
 
-std::string AoBench(const int width, const int height, const int nsubsamples) {
-  ::init_scene();
+struct AoScene {
+  Scene scene;
+  PacketScene packet_scene;
+};
+
+namespace {
 
-  std::vector<unsigned char> img(width * height * 3);
-  ::render(img.data(), width, height, nsubsamples);
+// Builds the BVH and the packet layout of the primitives.
+std::shared_ptr<const AoScene> FinishAoScene(std::unique_ptr<AoScene> scene) {
+  ::build_bvh(&scene->scene);
+  ::init_packet_scene(&scene->packet_scene, &scene->scene);
+  return std::shared_ptr<const AoScene>(std::move(scene));
+}
+
+// The three spheres on a plane of the original AOBench.
+const AoScene *DefaultAoScene() {
+  static const std::shared_ptr<const AoScene> scene = [] {
+    std::unique_ptr<AoScene> scene(new AoScene);
+    ::init_scene(&scene->scene);
+    return FinishAoScene(std::move(scene));
+  }();
+  return scene.get();
+}
+
+// Occlusion rays per hit point along each axis, within what the packets of
+// ambient_occlusion hold.
+int AoSamplesPerAxis(const AoBenchOptions& options) {
+  return std::min(std::max(options.nao_samples, 1), kMaxAoBenchAoSamples);
+}
 
-  std::vector<unsigned char> img4(width * height * 4);
-  for (int i = 0; i < width * height; ++i) {
-    img4[4 * i + 0] = img[3 * i + 0];
-    img4[4 * i + 1] = img[3 * i + 1];
-    img4[4 * i + 2] = img[3 * i + 2];
-    img4[4 * i + 3] = 255;
+}  // namespace
+
+std::shared_ptr<const AoScene> LoadAoScene(const std::string& file_name) {
+  std::unique_ptr<AoScene> scene(new AoScene);
+  if (::read_scene_file(&scene->scene, file_name, false)) {
+    return nullptr;
+  }
+  return FinishAoScene(std::move(scene));
+}
+
+int AoBenchOcclusionSamples(const AoBenchOptions& options) {
+  return AoSamplesPerAxis(options) * AoSamplesPerAxis(options);
+}
+
+const char *AoKernelName() {
+  return g_occlusion->name;
+}
+
+bool SetAoKernel(const std::string& name) {
+  if (name == kScalarOcclusion.name) {
+    g_occlusion = &kScalarOcclusion;
+    return false;
+  }
+#ifdef AO_X86
+  __builtin_cpu_init();
+  if (name == kSseOcclusion.name && __builtin_cpu_supports("sse4.1")) {
+    g_occlusion = &kSseOcclusion;
+    return false;
+  }
+  if (name == kAvx2Occlusion.name && __builtin_cpu_supports("avx2")) {
+    g_occlusion = &kAvx2Occlusion;
+    return false;
+  }
+  if (name == kAvx512Occlusion.name && __builtin_cpu_supports("avx512f")) {
+    g_occlusion = &kAvx512Occlusion;
+    return false;
+  }
+#endif
+  return true;
+}
+
+namespace {
+
+// Renders the samples of a pass from sample_offset into the image of the size
+// of the tile. Returns true if cancelled, leaving the rows not rendered yet
+// as they were.
+bool RenderPass(const AoBenchOptions& options, uint64_t sample_offset,
+                AoBenchImage *image) {
+  const AoScene *scene = options.scene ? options.scene : DefaultAoScene();
+  Camera camera;
+  ::init_camera(&camera, options.eye, options.look_at, options.fov,
+                options.width, options.height);
+  const int nao_samples = AoSamplesPerAxis(options);
+  const AmbientOcclusionFunction occlusion =
+    ::select_ambient_occlusion(nao_samples);
+
+  const bool tiled = options.tile_width > 0 && options.tile_height > 0;
+  const int x0 = tiled ? options.tile_x : 0;
+  const int y0 = tiled ? options.tile_y : 0;
+  const uint64_t key = mix(options.seed);
+
+  const int num_threads = std::min(
+      options.num_threads > 0 ? options.num_threads : NumAllowedCpus(),
+      image->height);
+
+  // Threads stop taking rows once any of them sees the render cancelled.
+  std::atomic<bool> cancelled(false);
+  RowQueue rows(image->height, num_threads);
+  auto render_rows = [&](int thread) {
+    for (int y = rows.Next(thread); y >= 0; y = rows.Next(thread)) {
+      if (cancelled.load(std::memory_order_relaxed) ||
+          (options.cancelled && options.cancelled())) {
+        cancelled.store(true, std::memory_order_relaxed);
+        return;
+      }
+      ::render_row(image->rgba.data(), &scene->scene, &scene->packet_scene,
+                   &camera, occlusion, nao_samples, key,
+                   sample_offset, x0, y0, image->width, y, options.width,
+                   options.height, options.nsubsamples);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i) {
+    threads.emplace_back(render_rows, i);
+  }
+  render_rows(0);
+  for (auto&& thread : threads) {
+    thread.join();
+  }
+  return cancelled.load();
+}
+
+// Sizes the image for the tile of the options, or the frame if not tiled.
+void InitImage(const AoBenchOptions& options, AoBenchImage *image) {
+  const bool tiled = options.tile_width > 0 && options.tile_height > 0;
+  image->width = tiled ? options.tile_width : options.width;
+  image->height = tiled ? options.tile_height : options.height;
+  image->samples = options.nsubsamples * options.nsubsamples;
+  image->rgba.assign(static_cast<size_t>(image->width) * image->height * 4,
+                     0.0f);
+}
+
+}  // namespace
+
+const char *AoSamplerName() {
+  return g_sampler->name;
+}
+
+bool SetAoSampler(const std::string& name) {
+  if (name == kLibmSampler.name) {
+    g_sampler = &kLibmSampler;
+    return false;
+  }
+  if (name == kPolynomialSampler.name) {
+    g_sampler = &kPolynomialSampler;
+    return false;
+  }
+  return true;
+}
+
+void AoSampleHemisphere(const uint32_t *u, const uint32_t *v, int n,
+                        float *x, float *y, float *z) {
+  vec basis[3] = {{1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}, {0.0, 0.0, 1.0}};
+  g_sampler->sampler(u, v, n, basis, x, y, z);
+}
+
+AoBenchImage AoBenchFloat(const AoBenchOptions& options) {
+  AoBenchImage image;
+  InitImage(options, &image);
+  RenderPass(options, options.sample_offset, &image);
+  return image;
+}
+
+bool AoBenchPasses(const AoBenchOptions& options, int passes,
+                   const AoBenchPassCallback& on_pass) {
+  AoBenchImage image;
+  InitImage(options, &image);
+  for (int pass = 0; pass < passes; ++pass) {
+    const uint64_t sample_offset = options.sample_offset +
+      static_cast<uint64_t>(pass) * AoBenchOcclusionSamples(options);
+    if (RenderPass(options, sample_offset, &image) || on_pass(pass, image)) {
+      return true;
+    }
   }
+  return false;
+}
 
+std::vector<unsigned char> QuantizeAoBenchImage(const AoBenchImage& image) {
+  std::vector<unsigned char> img4(image.rgba.size());
+  for (size_t i = 0; i < image.rgba.size(); ++i) {
+    img4[i] = ::clamp(image.rgba[i] / 255.0);
+  }
+  return img4;
+}
+
+std::string EncodeAoBenchPng(const AoBenchImage& image) {
   std::vector<unsigned char> png;
-  lodepng::encode(png, img4, width, height);
+  lodepng::encode(png, QuantizeAoBenchImage(image), image.width, image.height);
 
   return std::string(png.begin(), png.end());
 }
+
+std::string AoBench(const AoBenchOptions& options) {
+  return EncodeAoBenchPng(AoBenchFloat(options));
+}
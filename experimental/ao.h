@@ -1,11 +1,134 @@
 #ifndef FRANCINE_AO_H_
 #define FRANCINE_AO_H_
 
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
-std::string AoBench(const int width=256,
-                    const int height=256,
-                    const int nsubsamples=2);
+// Spheres, planes and triangle meshes with a BVH over them, see LoadAoScene.
+struct AoScene;
 
-#endif
+// Loads a scene file, which lists one primitive per line:
+//
+//   sphere <x> <y> <z> <radius>
+//   plane <x> <y> <z> <normal x> <normal y> <normal z>
+//   v <x> <y> <z>
+//   f <vertex> <vertex> <vertex> ...
+//   mesh <file.obj>
+//
+// v and f are the vertices and the faces of Wavefront OBJ; faces number the
+// vertices of the file from 1, or from the last one back if negative, and
+// polygons are split into triangles. mesh reads the vertices and faces of
+// an OBJ file in the directory of the scene file. # starts a comment.
+// Returns nullptr if the file cannot be read or is malformed.
+std::shared_ptr<const AoScene> LoadAoScene(const std::string& file_name);
+
+// Limits of the options from requests, which keep a frame in the memory of
+// a worker and the occlusion rays of a hit point on the stack.
+const int kMaxAoBenchSize = 8192;
+const int kMaxAoBenchSubsamples = 16;
+const int kMaxAoBenchAoSamples = 64;
+
+struct AoBenchOptions {
+  int width = 256;
+  int height = 256;
+  int nsubsamples = 2;
+  // Occlusion rays per hit point are nao_samples squared, with nao_samples
+  // clamped to [1, kMaxAoBenchAoSamples]. 4, 8 and 16 run specialized code.
+  int nao_samples = 8;
+
+  // The camera looks from eye at look_at with the y axis up. fov is the
+  // horizontal field of view in degrees.
+  double eye[3] = {0.0, 0.0, 0.0};
+  double look_at[3] = {0.0, 0.0, -1.0};
+  double fov = 90.0;
+
+  // The spheres on a plane of the original AOBench if null.
+  const AoScene *scene = nullptr;
+
+  // Renders only the tile_width x tile_height rectangle at (tile_x, tile_y)
+  // of the frame if set.
+  int tile_x = 0;
+  int tile_y = 0;
+  int tile_width = 0;
+  int tile_height = 0;
+
+  // Index of the first occlusion sample of each hit point in its sequence,
+  // which is picked by the seed. Renders with the same seed and disjoint
+  // ranges of samples average to the render with all of their samples. The
+  // same seed and offset render the same image on any number of threads.
+  uint64_t seed = 0;
+  uint64_t sample_offset = 0;
+
+  // 0 uses one thread per CPU that the calling thread may run on.
+  int num_threads = 0;
+
+  // Checked by the threads before each row if set; the render stops once it
+  // returns true, leaving the rows not rendered yet 0.
+  std::function<bool()> cancelled;
+};
+
+struct AoBenchImage {
+  int width;
+  int height;
+  // Samples per pixel.
+  uint64_t samples;
+  // width * height * 4 channels of RGBA in the 0-255 units of 8-bit images,
+  // neither quantized nor clamped.
+  std::vector<float> rgba;
+};
+
+// Renders the AOBench scene, or the tile of it, as the mean of the samples
+// of each pixel.
+AoBenchImage AoBenchFloat(const AoBenchOptions& options = AoBenchOptions());
+
+// Called with the image of each pass and its index from 0. Returns true to
+// stop the render.
+typedef std::function<bool(int pass, const AoBenchImage& image)>
+    AoBenchPassCallback;
 
+// Renders passes of the AOBench scene, or the tile of it, one after another
+// over the whole frame, each with the next AoBenchOcclusionSamples of the
+// sequences from the sample offset, and hands each of them to on_pass as
+// soon as it is done. Returns true if cancelled or stopped by on_pass.
+bool AoBenchPasses(const AoBenchOptions& options, int passes,
+                   const AoBenchPassCallback& on_pass);
+
+// Quantizes the image to 8-bit RGBA.
+std::vector<unsigned char> QuantizeAoBenchImage(const AoBenchImage& image);
+
+// Quantizes the image into a PNG image.
+std::string EncodeAoBenchPng(const AoBenchImage& image);
+
+// Renders the AOBench scene into a PNG image.
+std::string AoBench(const AoBenchOptions& options = AoBenchOptions());
+
+// Number of occlusion samples per hit point that a render draws, i.e. the
+// sample offset of the next pass.
+int AoBenchOcclusionSamples(const AoBenchOptions& options);
+
+// Name of the kernel tracing occlusion rays: "avx512", "avx2", "sse4.1" or
+// "scalar".
+const char *AoKernelName();
+
+// Forces a kernel, e.g. for benchmarks.
+// Returns true if the kernel is not supported on this CPU.
+bool SetAoKernel(const std::string& name);
+
+// Name of the sampler of the occlusion ray directions: "polynomial", the
+// default, or "libm", the reference in double.
+const char *AoSamplerName();
+
+// Forces a sampler, e.g. for benchmarks.
+// Returns true if the name is unknown.
+bool SetAoSampler(const std::string& name);
+
+// Draws the cosine-weighted directions of the hemisphere around the z axis
+// for the samples (u, v) in 0.32 fixed point with the sampler in use, as the
+// occlusion rays are drawn. n is a multiple of 16.
+void AoSampleHemisphere(const uint32_t *u, const uint32_t *v, int n,
+                        float *x, float *y, float *z);
+
+#endif
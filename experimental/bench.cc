@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "accumulate.h"
+#include "ao.h"
+#include "image_io.h"
+
+DEFINE_string(benchmark, "accumulate",
+    "Benchmark to run: accumulate, aobench, aosampler or png");
+DEFINE_int32(width, 3840, "Width of the benchmark images");
+DEFINE_int32(height, 2160, "Height of the benchmark images");
+DEFINE_int32(iterations, 20, "Number of iterations");
+DEFINE_string(scene, "", "Scene file of aobench; the default scene if empty");
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Reports input bandwidth of the weighted accumulation kernels, and of the
+// former scalar double loop for reference.
+void BenchmarkAccumulate() {
+  const size_t size = static_cast<size_t>(FLAGS_width) * FLAGS_height * 4;
+
+  // Inputs of each type with values of 8-bit images, all finite and normal
+  // so that no kernel takes a slow path.
+  std::vector<unsigned char> bytes(size);
+  std::vector<uint16_t> halves(size);
+  std::vector<float> floats(size);
+  for (size_t i = 0; i < size; ++i) {
+    bytes[i] = rand() & 0xff;
+    // Exponents 15 to 22 are halves in [1, 256).
+    halves[i] = static_cast<uint16_t>((15 + rand() % 8) << 10 |
+                                      (rand() & 0x3ff));
+    floats[i] = rand() & 0xff;
+  }
+  const void *inputs[] = {bytes.data(), halves.data(), floats.data()};
+
+  {
+    std::vector<double> accumulated(size);
+    auto start = Clock::now();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      for (size_t j = 0; j < size; ++j) {
+        accumulated[j] += static_cast<double>(bytes[j]) * 2.0;
+      }
+    }
+    const double seconds = SecondsSince(start);
+    LOG(INFO) << "double (former)  u8: " <<
+      size * FLAGS_iterations / seconds / 1e9 << " GB/s";
+  }
+
+  const char *kernels[] = {"scalar", "sse4.1", "avx2"};
+  const PixelType types[] = {kPixelU8, kPixelHalf, kPixelFloat};
+  const char *type_names[] = {"u8", "half", "float"};
+
+  for (auto&& kernel : kernels) {
+    if (SetAccumulateKernel(kernel)) {
+      LOG(INFO) << kernel << " is not supported on this CPU";
+      continue;
+    }
+
+    for (int t = 0; t < 3; ++t) {
+      Accumulator accumulator(size);
+      auto start = Clock::now();
+      for (int i = 0; i < FLAGS_iterations; ++i) {
+        accumulator.Add(types[t], inputs[t], 2.0f);
+      }
+      const double seconds = SecondsSince(start);
+      const double bytes =
+        static_cast<double>(size) * PixelTypeSize(types[t]) * FLAGS_iterations;
+      LOG(INFO) << kernel << " " << type_names[t] << ": " <<
+        bytes / seconds / 1e9 << " GB/s";
+    }
+  }
+}
+
+// Reports frames per second of AOBench with each occlusion kernel, on a
+// single thread so that the kernels compare without scheduling noise.
+void BenchmarkAoBench() {
+  AoBenchOptions options;
+  options.num_threads = 1;
+
+  std::shared_ptr<const AoScene> scene;
+  if (!FLAGS_scene.empty()) {
+    scene = LoadAoScene(FLAGS_scene);
+    if (!scene) {
+      LOG(ERROR) << "failed to load " << FLAGS_scene;
+      return;
+    }
+    options.scene = scene.get();
+  }
+
+  const char *kernels[] = {"scalar", "sse4.1", "avx2", "avx512"};
+  for (auto&& kernel : kernels) {
+    if (SetAoKernel(kernel)) {
+      LOG(INFO) << kernel << " is not supported on this CPU";
+      continue;
+    }
+
+    auto start = Clock::now();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      options.sample_offset = i * AoBenchOcclusionSamples(options);
+      AoBench(options);
+    }
+    const double seconds = SecondsSince(start);
+    LOG(INFO) << kernel << ": " << FLAGS_iterations / seconds <<
+      " frames/s at " << options.width << "x" << options.height;
+  }
+}
+
+// Reports the throughput of the samplers of occlusion ray directions, and
+// the error of the polynomial one against the libm reference, per direction
+// and in the rendered image.
+void BenchmarkAoSampler() {
+  const int n = 1 << 20;
+  std::vector<uint32_t> u(n), v(n);
+  for (int i = 0; i < n; ++i) {
+    u[i] = static_cast<uint32_t>(rand()) << 16 ^ rand();
+    v[i] = static_cast<uint32_t>(rand()) << 16 ^ rand();
+  }
+
+  const char *samplers[] = {"libm", "polynomial"};
+  std::vector<float> directions[2];
+  for (int s = 0; s < 2; ++s) {
+    SetAoSampler(samplers[s]);
+    std::vector<float>& d = directions[s];
+    d.resize(3 * n);
+    auto start = Clock::now();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      AoSampleHemisphere(u.data(), v.data(), n,
+                         d.data(), d.data() + n, d.data() + 2 * n);
+    }
+    const double seconds = SecondsSince(start);
+    LOG(INFO) << samplers[s] << ": " <<
+      static_cast<double>(n) * FLAGS_iterations / seconds / 1e6 <<
+      " Mdirections/s";
+  }
+
+  double max_error = 0.0;
+  for (int i = 0; i < 3 * n; ++i) {
+    max_error = std::max<double>(
+        max_error, std::abs(directions[1][i] - directions[0][i]));
+  }
+  LOG(INFO) << "max error of direction components: " << max_error;
+
+  AoBenchImage images[2];
+  for (int s = 0; s < 2; ++s) {
+    SetAoSampler(samplers[s]);
+    images[s] = AoBenchFloat();
+  }
+  double image_max_error = 0.0;
+  double image_error = 0.0;
+  for (size_t i = 0; i < images[0].rgba.size(); ++i) {
+    const double error = std::abs(images[1].rgba[i] - images[0].rgba[i]);
+    image_max_error = std::max(image_max_error, error);
+    image_error += error;
+  }
+  LOG(INFO) << "error of the image in 0-255: max " << image_max_error <<
+    ", mean " << image_error / images[0].rgba.size();
+
+  SetAoSampler(samplers[1]);
+}
+
+// Reports the time and the size of the PNG encoding of an AOBench frame with
+// each profile, e.g. to pick one for intermediate images, on a single thread
+// and on every CPU.
+void BenchmarkPng() {
+  AoBenchOptions options;
+  options.width = FLAGS_width;
+  options.height = FLAGS_height;
+  const AoBenchImage image = AoBenchFloat(options);
+  const std::vector<unsigned char> rgba = QuantizeAoBenchImage(image);
+
+  const char *profiles[] = {"best", "fast", "rle", "store"};
+  const int thread_counts[] = {1, 0};
+  for (auto&& profile : profiles) {
+    for (auto&& num_threads : thread_counts) {
+      std::string png;
+      auto start = Clock::now();
+      for (int i = 0; i < FLAGS_iterations; ++i) {
+        if (EncodePngImage(rgba.data(), image.width, image.height,
+                           ParsePngProfile(profile), &png, num_threads)) {
+          LOG(ERROR) << "failed to encode with " << profile;
+          return;
+        }
+      }
+      const double seconds = SecondsSince(start) / FLAGS_iterations;
+      LOG(INFO) << profile << (num_threads == 1 ? " (1 thread)" :
+                               " (all CPUs)") << ": " <<
+        seconds * 1e3 << " ms, " << png.size() << " bytes, " <<
+        100.0 * png.size() / rgba.size() << "% of RGBA";
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  FLAGS_logtostderr = 1;
+
+  if (FLAGS_benchmark == "accumulate") {
+    BenchmarkAccumulate();
+  } else if (FLAGS_benchmark == "aobench") {
+    BenchmarkAoBench();
+  } else if (FLAGS_benchmark == "aosampler") {
+    BenchmarkAoSampler();
+  } else if (FLAGS_benchmark == "png") {
+    BenchmarkPng();
+  } else {
+    LOG(ERROR) << "Unknown benchmark " << FLAGS_benchmark;
+    return 1;
+  }
+
+  return 0;
+}
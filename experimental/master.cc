@@ -1,8 +1,22 @@
 #include "master.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <glog/logging.h>
+#include <random>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 
+#include "ao.h"
+
+using francine::AdaptiveSampling;
+using francine::AoBenchParameters;
+using francine::ComposeRequest;
+using francine::ComposeResponse;
+using francine::File;
 using francine::Francine;
 using francine::FrancineWorker;
 using francine::Renderer;
@@ -12,12 +26,19 @@ using francine::UploadDirectRequest;
 using francine::UploadResponse;
 using francine::RunRequest;
 using francine::RunResponse;
+using francine::Tile;
 using francine::TransferRequest;
 using francine::TransferResponse;
 using francine::PutRequest;
 using francine::PutResponse;
 using francine::GetRequest;
+using francine::ImageType;
 using francine::GetResponse;
+using francine::BatchDeleteRequest;
+using francine::BatchDeleteResponse;
+using francine::ListInventoryRequest;
+using francine::ListInventoryResponse;
+using francine::PngCompression;
 using grpc::CreateChannel;
 using grpc::ClientContext;
 using grpc::ClientReader;
@@ -36,50 +57,303 @@ DEFINE_string(master_address, "0.0.0.0:50051", "master address to bind");
 DEFINE_string(workers_list, "127.0.0.1:50052",
     "list of worker addresses (comma separated)");
 
+namespace {
+
+// Size of the tiles of adaptive sampling if not given.
+const uint32_t kDefaultAdaptiveTileSize = 32;
+
+// Limits of adaptive sampling, which keep a render from running passes of
+// many tiny tiles or for ever on a worker.
+const uint32_t kMinAdaptiveTileSize = 8;
+const uint32_t kMaxAdaptivePasses = 64;
+const uint32_t kMaxAdaptiveRounds = 64;
+
+// Parses an unsigned integer in [1, max]. Returns true if failed.
+bool ParseCount(const std::string& value, uint32_t max, uint32_t *count) {
+  char *end;
+  const unsigned long parsed = strtoul(value.c_str(), &end, 10);
+  if (value.empty() || *end != '\0' || value[0] == '-' ||
+      parsed < 1 || parsed > max) {
+    return true;
+  }
+  *count = parsed;
+  return false;
+}
+
+// Parses three comma-separated finite numbers. Returns true if failed.
+bool ParseVector(const std::string& value,
+    google::protobuf::RepeatedField<double> *vector) {
+  vector->Clear();
+  std::istringstream stream(value);
+  std::string coordinate;
+  while (std::getline(stream, coordinate, ',')) {
+    char *end;
+    const double parsed = strtod(coordinate.c_str(), &end);
+    if (coordinate.empty() || *end != '\0' || !std::isfinite(parsed)) {
+      return true;
+    }
+    vector->Add(parsed);
+  }
+  return vector->size() != 3;
+}
+
+// Parses the update of an AOBench render, see RenderRequest. Keys left out
+// of the update keep their values in the parameters.
+// Returns true if the update is malformed or out of range.
+bool ParseAoBenchUpdate(const std::string& update,
+                        AoBenchParameters *parameters) {
+  std::istringstream stream(update);
+  std::string field;
+  while (stream >> field) {
+    const size_t equal = field.find('=');
+    const std::string key = field.substr(0, equal);
+    const std::string value =
+      equal == std::string::npos ? "" : field.substr(equal + 1);
+
+    uint32_t count = 0;
+    bool failed;
+    if (key == "width" || key == "height") {
+      failed = ParseCount(value, kMaxAoBenchSize, &count);
+      if (key == "width") {
+        parameters->set_width(count);
+      } else {
+        parameters->set_height(count);
+      }
+    } else if (key == "subsamples") {
+      failed = ParseCount(value, kMaxAoBenchSubsamples, &count);
+      parameters->set_subsamples(count);
+    } else if (key == "ao_samples") {
+      failed = ParseCount(value, kMaxAoBenchAoSamples, &count);
+      parameters->set_ao_samples(count);
+    } else if (key == "eye") {
+      failed = ParseVector(value, parameters->mutable_eye());
+    } else if (key == "look_at") {
+      failed = ParseVector(value, parameters->mutable_look_at());
+    } else if (key == "fov") {
+      char *end;
+      const double fov = strtod(value.c_str(), &end);
+      failed = value.empty() || *end != '\0' || !(fov > 0.0 && fov < 180.0);
+      parameters->set_fov(fov);
+    } else {
+      LOG(ERROR) << "unknown AOBench parameter " << key;
+      return true;
+    }
+    if (failed) {
+      LOG(ERROR) << "invalid AOBench parameter " << field;
+      return true;
+    }
+  }
+
+  // The renderer looks from the origin down the negative z axis by default.
+  const double eye[3] = {
+    parameters->eye_size() == 3 ? parameters->eye(0) : 0.0,
+    parameters->eye_size() == 3 ? parameters->eye(1) : 0.0,
+    parameters->eye_size() == 3 ? parameters->eye(2) : 0.0,
+  };
+  const double look_at[3] = {
+    parameters->look_at_size() == 3 ? parameters->look_at(0) : 0.0,
+    parameters->look_at_size() == 3 ? parameters->look_at(1) : 0.0,
+    parameters->look_at_size() == 3 ? parameters->look_at(2) : -1.0,
+  };
+  if (eye[0] == look_at[0] && eye[1] == look_at[1] && eye[2] == look_at[2]) {
+    LOG(ERROR) << "the AOBench camera looks at its own position";
+    return true;
+  }
+  return false;
+}
+
+// Returns true if the adaptive sampling is out of range.
+bool CheckAdaptiveSampling(const AdaptiveSampling& adaptive) {
+  if (adaptive.passes() > kMaxAdaptivePasses) {
+    LOG(ERROR) << "too many adaptive passes " << adaptive.passes();
+    return true;
+  }
+  if (adaptive.max_rounds() > kMaxAdaptiveRounds) {
+    LOG(ERROR) << "too many adaptive rounds " << adaptive.max_rounds();
+    return true;
+  }
+  // 0 takes the default size.
+  if (adaptive.tile_size() != 0 &&
+      (adaptive.tile_size() < kMinAdaptiveTileSize ||
+       adaptive.tile_size() > static_cast<uint32_t>(kMaxAoBenchSize))) {
+    LOG(ERROR) << "invalid adaptive tile size " << adaptive.tile_size();
+    return true;
+  }
+  if (!(adaptive.variance_threshold() >= 0.0f)) {
+    LOG(ERROR) << "invalid variance threshold " <<
+      adaptive.variance_threshold();
+    return true;
+  }
+  return false;
+}
+
+// Starts a run request for the render request, with the AOBench parameters
+// parsed from its update on top of the parameters.
+// Returns true if the update is invalid.
+bool ToRunRequest(const RenderRequest& request, Renderer renderer,
+                  AoBenchParameters *parameters, RunRequest *run_request) {
+  run_request->set_update(request.update());
+  if (renderer == Renderer::AOBENCH) {
+    if (ParseAoBenchUpdate(request.update(), parameters)) {
+      return true;
+    }
+    *run_request->mutable_aobench() = *parameters;
+  }
+  return false;
+}
+
+// Returns a random id for an accumulator, so that a restarted master never
+// reuses the id of an accumulator left on a worker.
+std::string NewAccumulatorId() {
+  std::random_device random;
+  std::ostringstream id;
+  id << "adaptive-" << std::hex;
+  for (int i = 0; i < 4; ++i) {
+    id << random();
+  }
+  return id.str();
+}
+
+// Tiles of the composed frame whose variance is above the threshold.
+std::vector<Tile> NoisyTiles(const ComposeResponse& composed,
+                             float threshold) {
+  const auto& variance = composed.variance();
+  const uint32_t tile_size = variance.tile_size();
+
+  std::vector<Tile> tiles;
+  for (uint32_t row = 0; row < variance.rows(); ++row) {
+    for (uint32_t column = 0; column < variance.columns(); ++column) {
+      if (variance.variance(row * variance.columns() + column) <= threshold) {
+        continue;
+      }
+      Tile tile;
+      tile.set_x(column * tile_size);
+      tile.set_y(row * tile_size);
+      tile.set_width(std::min(tile_size, composed.width() - tile.x()));
+      tile.set_height(std::min(tile_size, composed.height() - tile.y()));
+      tiles.push_back(tile);
+    }
+  }
+  return tiles;
+}
+
+}  // namespace
+
 FrancineServiceImpl::FrancineServiceImpl()
     : Francine::Service()
     , node_manager_()
     , master_file_manager_(node_manager_) {
   node_manager_.AddWorkersFromString(FLAGS_workers_list);
+  node_manager_.StartRefreshingStatus();
+  SyncInventories();
 }
 
-Status FrancineServiceImpl::Render(
+void FrancineServiceImpl::SyncInventories() {
+  for (int worker_id : node_manager_.worker_ids()) {
+    auto stub = node_manager_.GetWorkerStub(worker_id);
+
+    std::vector<std::pair<std::string, uint64_t>> files;
+    ListInventoryRequest request;
+    Status status;
+    do {
+      ClientContext context;
+      context.set_deadline(
+          std::chrono::system_clock::now() + std::chrono::seconds(10));
+      ListInventoryResponse response;
+      status = stub->ListInventory(&context, request, &response);
+      if (!status.ok()) {
+        break;
+      }
+      for (auto&& file : response.files()) {
+        files.emplace_back(file.id(), file.file_size());
+      }
+      request.set_page_token(response.next_page_token());
+    } while (!request.page_token().empty());
+
+    if (!status.ok()) {
+      LOG(ERROR) << "failed to list files on worker " <<
+        node_manager_.GetWorkerAddress(worker_id);
+      continue;
+    }
+
+    master_file_manager_.SyncInventory(worker_id, files);
+  }
+}
+
+void FrancineServiceImpl::EvictUnusedFiles(ServerContext* context) {
+  std::vector<std::pair<std::string, int>> unused_files;
+  master_file_manager_.GetUnusedFiles(&unused_files);
+
+  std::unordered_map<int, BatchDeleteRequest> requests;
+  for (auto&& file : unused_files) {
+    requests[file.second].add_ids(file.first);
+  }
+
+  for (auto&& request : requests) {
+    const int worker_id = request.first;
+    auto stub = node_manager_.GetWorkerStub(worker_id);
+
+    auto client_context = ClientContext::FromServerContext(*context);
+    BatchDeleteResponse response;
+    auto status = stub->BatchDelete(
+        client_context.get(), request.second, &response);
+    if (!status.ok()) {
+      LOG(ERROR) << "failed to delete files on worker " <<
+        node_manager_.GetWorkerAddress(worker_id);
+      continue;
+    }
+
+    // Files that were already missing are gone as well.
+    for (auto&& file_id : request.second.ids()) {
+      master_file_manager_.NotifyFileDeleted(file_id, worker_id);
+    }
+
+    LOG(INFO) << request.second.ids_size() << " files evicted from worker " <<
+      node_manager_.GetWorkerAddress(worker_id);
+  }
+}
+
+Status FrancineServiceImpl::PrepareWorker(
     ServerContext* context,
-    const RenderRequest* request, RenderResponse* response) {
+    const google::protobuf::RepeatedPtrField<File>& files,
+    int *worker_id, std::vector<std::string> *file_ids) {
   // TODO(peryaudo): Pick worker in a way that optimizes cache efficiency.
   // Also, it should be done in policy.
-  const int worker_id = master_file_manager_.GetEmptyWorker();
+  *worker_id = master_file_manager_.GetEmptyWorker();
 
-  if (worker_id < 0) {
+  if (*worker_id < 0) {
     LOG(ERROR) << "no worker available!";
     return Status(grpc::RESOURCE_EXHAUSTED, "");
   }
 
-  const std::string& worker_address = node_manager_.GetWorkerAddress(worker_id);
-  auto stub = node_manager_.GetWorkerStub(worker_id);
+  const std::string& worker_address =
+    node_manager_.GetWorkerAddress(*worker_id);
+  auto stub = node_manager_.GetWorkerStub(*worker_id);
   LOG(INFO) <<
     "work assigned to worker " << worker_address;
 
-  for (auto&& file : request->files()) {
+  for (auto&& file : files) {
     if (!master_file_manager_.IsFileAlive(file.id())) {
       LOG(ERROR) << "file " << file.id() << " is not available!";
       return Status(grpc::NOT_FOUND, "");
     }
   }
 
-  std::vector<std::string> file_ids;
-  for (auto&& file : request->files()) {
-    file_ids.emplace_back(file.id());
+  file_ids->clear();
+  for (auto&& file : files) {
+    file_ids->emplace_back(file.id());
   }
 
   // TODO(peryaudo): Extra locks are needed
 
   // Transfer required files that are not on the selected worker.
   std::vector<std::string> missing_file_ids;
-  master_file_manager_.ListMissingFiles(worker_id, file_ids, &missing_file_ids);
+  master_file_manager_.ListMissingFiles(
+      *worker_id, *file_ids, &missing_file_ids);
   LOG(INFO) << missing_file_ids.size() << " of "<<
-    request->files().size() << " files have to be transferred";
+    files.size() << " files have to be transferred";
 
+  std::vector<std::string> transferred_file_ids;
   for (auto&& file_id : missing_file_ids) {
     TransferRequest transfer_request;
     transfer_request.set_id(file_id);
@@ -100,51 +374,57 @@ Status FrancineServiceImpl::Render(
     auto status = stub->Transfer(
         client_context.get(), transfer_request, &transfer_response);
     if (!status.ok()) {
-      master_file_manager_.UnlockFiles(file_ids, worker_id);
+      master_file_manager_.UnlockFiles(transferred_file_ids, *worker_id);
       return status;
     }
 
     master_file_manager_.NotifyFilePut(file_id, transfer_response.file_size(),
-                                       worker_id, /* lock = */ true);
+                                       *worker_id, /* lock = */ true);
+    transferred_file_ids.push_back(file_id);
   }
 
-  master_file_manager_.LockFiles(file_ids, worker_id);
+  // The transferred files are locked already.
+  std::vector<std::string> present_file_ids;
+  for (auto&& file_id : *file_ids) {
+    if (std::find(missing_file_ids.begin(), missing_file_ids.end(),
+                  file_id) == missing_file_ids.end()) {
+      present_file_ids.push_back(file_id);
+    }
+  }
+  master_file_manager_.LockFiles(present_file_ids, *worker_id);
 
-  auto client_context = ClientContext::FromServerContext(*context);
-  std::shared_ptr<ClientReaderWriter<RunRequest, RunResponse>> stream(
-      stub->Run(client_context.get()));
+  return Status::OK;
+}
 
-  RunRequest run_request;
-  run_request.set_renderer(request->renderer());
-  stream->Write(run_request);
-  stream->WritesDone();
+void FrancineServiceImpl::NotifyResult(
+    int worker_id, const std::string& id, uint64_t file_size) {
+  master_file_manager_.NotifyFilePut(id, file_size, worker_id,
+                                     /* lock = */ true);
+}
 
-  RunResponse run_response;
-  // TODO(peryaudo): Accept streaming requests if the renderer supports
-  stream->Read(&run_response);
-  auto status = stream->Finish();
-  if (!status.ok()) {
-    LOG(ERROR) << "render failed";
-    master_file_manager_.UnlockFiles(file_ids, worker_id);
-    return status;
-  }
+void FrancineServiceImpl::ReleaseResult(int worker_id, const std::string& id) {
+  std::vector<std::string> file_ids(1, id);
+  master_file_manager_.ExpireFile(id);
+  master_file_manager_.UnlockFiles(file_ids, worker_id);
+}
 
-  // Register the result image file to file manager
-  master_file_manager_.NotifyFilePut(
-      run_response.id(), run_response.file_size(),
-      worker_id, /* lock = */ false);
+Status FrancineServiceImpl::GetResult(
+    ServerContext* context, int worker_id,
+    const RunResponse& run_response, RenderResponse *response) {
+  auto stub = node_manager_.GetWorkerStub(worker_id);
 
   GetRequest get_request;
   get_request.set_id(run_response.id());
-  client_context = ClientContext::FromServerContext(*context);
+  auto client_context = ClientContext::FromServerContext(*context);
   std::shared_ptr<ClientReader<GetResponse>> reader(
       stub->Get(client_context.get(), get_request));
   GetResponse get_response;
   reader->Read(&get_response);
-  status = reader->Finish();
+  auto status = reader->Finish();
+  // The result has been handed to the client, or is lost.
+  ReleaseResult(worker_id, run_response.id());
   if (!status.ok()) {
     LOG(ERROR) << "get failed";
-    master_file_manager_.UnlockFiles(file_ids, worker_id);
     return status;
   }
 
@@ -154,13 +434,298 @@ Status FrancineServiceImpl::Render(
   return Status::OK;
 }
 
+Status FrancineServiceImpl::Render(
+    ServerContext* context,
+    const RenderRequest* request, RenderResponse* response) {
+  RunRequest run_request;
+  run_request.set_renderer(request->renderer());
+  *run_request.mutable_files() = request->files();
+  AoBenchParameters parameters;
+  if (ToRunRequest(*request, request->renderer(), &parameters, &run_request) ||
+      (request->has_adaptive() && CheckAdaptiveSampling(request->adaptive()))) {
+    return Status(grpc::INVALID_ARGUMENT, "");
+  }
+
+  int worker_id;
+  std::vector<std::string> file_ids;
+  auto status = PrepareWorker(context, request->files(), &worker_id, &file_ids);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (request->has_adaptive()) {
+    status = RenderAdaptive(context, worker_id, request->adaptive(),
+                            run_request, response);
+    master_file_manager_.UnlockFiles(file_ids, worker_id);
+    EvictUnusedFiles(context);
+    return status;
+  }
+
+  auto stub = node_manager_.GetWorkerStub(worker_id);
+  node_manager_.NotifyRunStarted(worker_id);
+
+  auto client_context = ClientContext::FromServerContext(*context);
+  std::shared_ptr<ClientReaderWriter<RunRequest, RunResponse>> stream(
+      stub->Run(client_context.get()));
+
+  stream->Write(run_request);
+  stream->WritesDone();
+
+  // Keep the last pass.
+  RunResponse run_response;
+  RunResponse pass_response;
+  while (stream->Read(&pass_response)) {
+    run_response = pass_response;
+  }
+  status = stream->Finish();
+  node_manager_.NotifyRunFinished(worker_id);
+  if (!status.ok()) {
+    LOG(ERROR) << "render failed";
+    master_file_manager_.UnlockFiles(file_ids, worker_id);
+    return status;
+  }
+  NotifyResult(worker_id, run_response.id(), run_response.file_size());
+
+  status = GetResult(context, worker_id, run_response, response);
+  master_file_manager_.UnlockFiles(file_ids, worker_id);
+  EvictUnusedFiles(context);
+
+  return status;
+}
+
+Status FrancineServiceImpl::RunPasses(
+    ServerContext* context, int worker_id,
+    const std::vector<RunRequest>& run_requests,
+    std::vector<RunResponse> *passes) {
+  auto stub = node_manager_.GetWorkerStub(worker_id);
+  node_manager_.NotifyRunStarted(worker_id);
+
+  Status status;
+  for (auto&& run_request : run_requests) {
+    auto client_context = ClientContext::FromServerContext(*context);
+    std::shared_ptr<ClientReaderWriter<RunRequest, RunResponse>> stream(
+        stub->Run(client_context.get()));
+    stream->Write(run_request);
+    stream->WritesDone();
+
+    RunResponse pass;
+    while (stream->Read(&pass)) {
+      NotifyResult(worker_id, pass.id(), pass.file_size());
+      passes->push_back(pass);
+    }
+    status = stream->Finish();
+    if (!status.ok()) {
+      break;
+    }
+  }
+
+  node_manager_.NotifyRunFinished(worker_id);
+  return status;
+}
+
+Status FrancineServiceImpl::RenderAdaptive(
+    ServerContext* context, int worker_id,
+    const AdaptiveSampling& adaptive, RunRequest run_request,
+    RenderResponse *response) {
+  if (run_request.renderer() != Renderer::AOBENCH) {
+    LOG(ERROR) << "adaptive sampling needs a renderer that renders tiles";
+    return Status(grpc::UNIMPLEMENTED, "");
+  }
+
+  auto stub = node_manager_.GetWorkerStub(worker_id);
+  const std::string accumulator_id = NewAccumulatorId();
+
+  // The variance of a tile needs at least two passes of it.
+  run_request.set_passes(std::max<uint32_t>(adaptive.passes(), 2));
+  // Passes are only composed, so they skip the PNG quantization and keep
+  // their weight.
+  run_request.set_image_type(ImageType::PARTIAL);
+  std::vector<RunRequest> run_requests(1, run_request);
+
+  ComposeRequest compose_request;
+  compose_request.set_image_type(ImageType::PNG);
+  compose_request.set_accumulator_id(accumulator_id);
+  compose_request.set_create_accumulator(true);
+  compose_request.set_variance_tile_size(
+      adaptive.tile_size() > 0 ? adaptive.tile_size() :
+      kDefaultAdaptiveTileSize);
+
+  ComposeResponse compose_response;
+  // The frame composed in the last round, which is locked on the worker.
+  std::string composed_id;
+  // Samples of the passes composed so far times the pixels they cover, or
+  // per pixel in the first round, before the frame size is known.
+  uint64_t sample_area = 0;
+  Status status;
+  for (uint32_t round = 0; ; ++round) {
+    std::vector<RunResponse> passes;
+    status = RunPasses(context, worker_id, run_requests, &passes);
+
+    compose_request.clear_images();
+    for (auto&& pass : passes) {
+      auto image = compose_request.add_images();
+      image->set_id(pass.id());
+      image->set_image_type(pass.image_type());
+      image->set_samples(pass.samples());
+      if (pass.has_tile()) {
+        *image->mutable_tile() = pass.tile();
+      }
+      sample_area += pass.samples() * (pass.has_tile() ?
+          static_cast<uint64_t>(pass.tile().width()) * pass.tile().height() :
+          1);
+    }
+    if (status.ok()) {
+      auto client_context = ClientContext::FromServerContext(*context);
+      status = stub->Compose(
+          client_context.get(), compose_request, &compose_response);
+      compose_request.set_create_accumulator(false);
+    }
+    const std::string superseded_id = composed_id;
+    composed_id.clear();
+    if (status.ok()) {
+      NotifyResult(worker_id, compose_response.id(),
+                   compose_response.file_size());
+      composed_id = compose_response.id();
+
+      const uint64_t num_pixels =
+        static_cast<uint64_t>(compose_response.width()) *
+        compose_response.height();
+      if (round == 0) {
+        sample_area *= num_pixels;
+      }
+      // The accumulator holds every pass of the render, unless it was lost
+      // and the frame misses the earlier rounds.
+      if (passes.empty() || num_pixels == 0 ||
+          compose_response.samples() != sample_area / num_pixels) {
+        LOG(ERROR) << "adaptive round " << round << " composed " <<
+          compose_response.samples() << " samples per pixel instead of " <<
+          (num_pixels > 0 ? sample_area / num_pixels : 0);
+        status = Status(grpc::DATA_LOSS, "");
+      }
+    }
+
+    // The passes are in the accumulator now, and the frame of the last round
+    // is superseded.
+    for (auto&& pass : passes) {
+      ReleaseResult(worker_id, pass.id());
+    }
+    if (!superseded_id.empty()) {
+      ReleaseResult(worker_id, superseded_id);
+    }
+    if (!status.ok()) {
+      if (!composed_id.empty()) {
+        ReleaseResult(worker_id, composed_id);
+      }
+      LOG(ERROR) << "adaptive render failed";
+      break;
+    }
+
+    // Tiles are stitched into the frame from the second round on.
+    compose_request.set_width(compose_response.width());
+    compose_request.set_height(compose_response.height());
+
+    const auto tiles = NoisyTiles(compose_response,
+                                  adaptive.variance_threshold());
+    LOG(INFO) << "adaptive round " << round << ": " << tiles.size() <<
+      " noisy tiles";
+    if (tiles.empty() || round >= adaptive.max_rounds()) {
+      break;
+    }
+
+    // Passes of each round draw the next samples of the sequences.
+    run_request.set_pass_offset((round + 1) * run_request.passes());
+    run_requests.clear();
+    for (auto&& tile : tiles) {
+      *run_request.mutable_tile() = tile;
+      run_requests.push_back(run_request);
+    }
+  }
+
+  ComposeRequest release_request;
+  release_request.set_accumulator_id(accumulator_id);
+  release_request.set_release_accumulator(true);
+  ComposeResponse release_response;
+  auto client_context = ClientContext::FromServerContext(*context);
+  stub->Compose(client_context.get(), release_request, &release_response);
+  if (!status.ok()) {
+    return status;
+  }
+
+  RunResponse result;
+  result.set_id(compose_response.id());
+  result.set_file_size(compose_response.file_size());
+  result.set_image_type(ImageType::PNG);
+  return GetResult(context, worker_id, result, response);
+}
+
 Status FrancineServiceImpl::RenderStream(
     ServerContext* context,
     ServerReaderWriter<RenderResponse, RenderRequest>* stream) {
-  // TODO(peryaudo): Implement.
-  return Status(grpc::UNIMPLEMENTED, "");
-}
+  // The first request decides the renderer and the files, and following
+  // requests are forwarded as updates to the same warm renderer.
+  RenderRequest request;
+  if (!stream->Read(&request)) {
+    return Status(grpc::INVALID_ARGUMENT, "");
+  }
+  const Renderer renderer = request.renderer();
 
+  RunRequest run_request;
+  run_request.set_renderer(renderer);
+  *run_request.mutable_files() = request.files();
+  AoBenchParameters parameters;
+  if (ToRunRequest(request, renderer, &parameters, &run_request)) {
+    return Status(grpc::INVALID_ARGUMENT, "");
+  }
+  // Frames of a stream are interactive; encoding them fast matters more
+  // than their size.
+  run_request.set_png_compression(PngCompression::PNG_FAST);
+
+  int worker_id;
+  std::vector<std::string> file_ids;
+  auto status = PrepareWorker(context, request.files(), &worker_id, &file_ids);
+  if (!status.ok()) {
+    return status;
+  }
+
+  auto stub = node_manager_.GetWorkerStub(worker_id);
+  node_manager_.NotifyRunStarted(worker_id);
+
+  auto client_context = ClientContext::FromServerContext(*context);
+  std::shared_ptr<ClientReaderWriter<RunRequest, RunResponse>> run_stream(
+      stub->Run(client_context.get()));
+
+  do {
+    // The update of the first request is parsed again to no effect.
+    if (ToRunRequest(request, renderer, &parameters, &run_request)) {
+      status = Status(grpc::INVALID_ARGUMENT, "");
+      break;
+    }
+    RunResponse run_response;
+    if (!run_stream->Write(run_request) || !run_stream->Read(&run_response)) {
+      break;
+    }
+    NotifyResult(worker_id, run_response.id(), run_response.file_size());
+
+    RenderResponse response;
+    status = GetResult(context, worker_id, run_response, &response);
+    if (!status.ok() || !stream->Write(response)) {
+      break;
+    }
+    run_request.Clear();
+  } while (stream->Read(&request));
+
+  run_stream->WritesDone();
+  auto run_status = run_stream->Finish();
+  node_manager_.NotifyRunFinished(worker_id);
+  master_file_manager_.UnlockFiles(file_ids, worker_id);
+  EvictUnusedFiles(context);
+
+  if (!run_status.ok()) {
+    LOG(ERROR) << "render failed";
+    return run_status;
+  }
+  return status;
+}
 
 Status FrancineServiceImpl::UploadDirect(
     ServerContext* context,
@@ -1,6 +1,7 @@
 #ifndef FRANCINE_MASTER_H_
 #define FRANCINE_MASTER_H_
 
+#include <cstdint>
 #include <grpc++/grpc++.h>
 #include <memory>
 #include <set>
@@ -35,6 +36,51 @@ class FrancineServiceImpl final : public francine::Francine::Service {
       francine::UploadResponse* response) override;
 
  private:
+  // Pick a worker and transfer the files to it.
+  // The files are locked on the worker if succeeded.
+  grpc::Status PrepareWorker(
+      grpc::ServerContext* context,
+      const google::protobuf::RepeatedPtrField<francine::File>& files,
+      int *worker_id, std::vector<std::string> *file_ids);
+
+  // Register an output of a run or a compose on the worker, locked there
+  // until it is released. Identical outputs share an id, so concurrent
+  // renders may register the same file.
+  void NotifyResult(int worker_id, const std::string& id, uint64_t file_size);
+
+  // Release an output that is no longer needed, which is then evicted once
+  // no other render holds it.
+  void ReleaseResult(int worker_id, const std::string& id);
+
+  // Fetch the image of a registered result from the worker, and release it.
+  grpc::Status GetResult(
+      grpc::ServerContext* context, int worker_id,
+      const francine::RunResponse& run_response,
+      francine::RenderResponse *response);
+
+  // Run the passes of each request on the worker, leaving their images
+  // there.
+  grpc::Status RunPasses(
+      grpc::ServerContext* context, int worker_id,
+      const std::vector<francine::RunRequest>& run_requests,
+      std::vector<francine::RunResponse> *passes);
+
+  // Render passes of the whole frame, and then more passes of the tiles
+  // that are still noisy, composing all of them on the worker.
+  // Every round runs its tiles one after another on that single worker,
+  // which also keeps the accumulator; they are not spread over workers.
+  grpc::Status RenderAdaptive(
+      grpc::ServerContext* context, int worker_id,
+      const francine::AdaptiveSampling& adaptive,
+      francine::RunRequest run_request,
+      francine::RenderResponse *response);
+
+  // Learn the files already on the workers.
+  void SyncInventories();
+
+  // Delete unused files on the workers in bulk.
+  void EvictUnusedFiles(grpc::ServerContext* context);
+
   NodeManager node_manager_;
   MasterFileManager master_file_manager_;
 };
@@ -3,47 +3,99 @@
 #include <ctime>
 #include <glog/logging.h>
 
-// TODO(peryaudo): Add lock
-
 void MasterFileManager::NotifyFilePut(
     const std::string& file_id, uint64_t size, int worker_id, bool lock) {
-  if (files_.count(file_id)) {
-    files_[file_id] = FileInfo();
-
-    // TODO(peryaudo): set expire field
-  }
+  std::lock_guard<std::mutex> mutex_lock(mutex_);
 
+  // Identical outputs share an id, so a file put again may have been expired
+  // by a render that is done with it; it is alive for the new one.
   auto&& file_info = files_[file_id];
+  file_info.expire = 0;
   file_info.file_size = size;
   file_info.workers.insert(worker_id);
   if (lock) {
-    file_info.locked_workers.insert(worker_id);
+    ++file_info.locked_workers[worker_id];
+  }
+}
+
+void MasterFileManager::NotifyFileDeleted(
+    const std::string& file_id, int worker_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  RemoveWorkerFromFile(file_id, worker_id);
+}
+
+void MasterFileManager::NotifyWorkerRemoved(int worker_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  std::vector<FileId> file_ids;
+  for (auto&& file : files_) {
+    file_ids.push_back(file.first);
+  }
+  for (auto&& file_id : file_ids) {
+    RemoveWorkerFromFile(file_id, worker_id);
+  }
+}
+
+void MasterFileManager::RemoveWorkerFromFile(
+    const FileId& file_id, int worker_id) {
+  auto file = files_.find(file_id);
+  if (file == files_.end()) {
+    return;
+  }
+  file->second.workers.erase(worker_id);
+  file->second.locked_workers.erase(worker_id);
+  if (file->second.workers.empty()) {
+    files_.erase(file);
+  }
+}
+
+void MasterFileManager::ExpireFile(const std::string& file_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto file = files_.find(file_id);
+  if (file != files_.end()) {
+    file->second.expire = time(NULL);
   }
 }
 
 bool MasterFileManager::IsFileAlive(const std::string& file_id) {
-  return files_.count(file_id);
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto file = files_.find(file_id);
+  return file != files_.end() &&
+    (file->second.expire == 0 || file->second.expire > time(NULL));
 }
 
 bool MasterFileManager::LockFiles(
     std::vector<std::string>& file_ids, int worker_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
   for (auto&& file_id : file_ids) {
     auto file = files_.find(file_id);
     CHECK(file != files_.end()) << " file does not exist!";
     if (!file->second.workers.count(worker_id)) {
       return false;
     }
-    file->second.locked_workers.insert(worker_id);
+  }
+  for (auto&& file_id : file_ids) {
+    ++files_[file_id].locked_workers[worker_id];
   }
   return true;
 }
 
 void MasterFileManager::UnlockFiles(
     std::vector<std::string>& file_ids, int worker_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
   for (auto&& file_id : file_ids) {
     auto file = files_.find(file_id);
-    CHECK(file != files_.end()) << " file does not exist!";
-    file->second.locked_workers.erase(worker_id);
+    if (file == files_.end()) {
+      continue;
+    }
+    auto locks = file->second.locked_workers.find(worker_id);
+    if (locks != file->second.locked_workers.end() && --locks->second == 0) {
+      file->second.locked_workers.erase(locks);
+    }
   }
 }
 
@@ -51,6 +103,8 @@ void MasterFileManager::ListMissingFiles(
     int worker_id,
     const std::vector<std::string>& file_ids,
     std::vector<std::string> *missing_file_ids) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
   missing_file_ids->clear();
   for (auto&& file_id : file_ids) {
     auto file = files_.find(file_id);
@@ -62,20 +116,66 @@ void MasterFileManager::ListMissingFiles(
 }
 
 int MasterFileManager::GetEmptyWorker() {
-  // TODO(peryaudo): Implement. (This is placeholder)
-
-  auto worker_ids = node_manager_.worker_ids();
-  if (worker_ids.empty()) {
-    return -1;
-  } else {
-    return worker_ids.front();
-  }
+  // TODO(peryaudo): Take storage usage of the workers into account.
+  return node_manager_.GetLeastLoadedWorker();
 }
 
 int MasterFileManager::GetWorkerWithFile(const std::string& file_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
   auto file = files_.find(file_id);
   CHECK(file != files_.end()) << " file does not exist!";
 
   // TODO(peryaudo): Round robbin.
   return *(file->second.workers.begin());
 }
+
+void MasterFileManager::GetUnusedFiles(
+    std::vector<std::pair<FileId, WorkerId>> *files) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  const time_t now = time(NULL);
+
+  files->clear();
+  for (auto&& file : files_) {
+    auto&& file_info = file.second;
+    if (file_info.expire == 0 || file_info.expire > now) {
+      continue;
+    }
+    for (int worker_id : file_info.workers) {
+      if (!file_info.locked_workers.count(worker_id)) {
+        files->emplace_back(file.first, worker_id);
+      }
+    }
+  }
+}
+
+void MasterFileManager::SyncInventory(
+    int worker_id, const std::vector<std::pair<FileId, uint64_t>>& files) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  std::unordered_set<FileId> inventory;
+  for (auto&& file : files) {
+    inventory.insert(file.first);
+  }
+
+  // Forget files that are gone from the worker.
+  std::vector<FileId> gone_file_ids;
+  for (auto&& file : files_) {
+    if (file.second.workers.count(worker_id) && !inventory.count(file.first)) {
+      gone_file_ids.push_back(file.first);
+    }
+  }
+  for (auto&& file_id : gone_file_ids) {
+    RemoveWorkerFromFile(file_id, worker_id);
+  }
+
+  for (auto&& file : files) {
+    auto&& file_info = files_[file.first];
+    file_info.file_size = file.second;
+    file_info.workers.insert(worker_id);
+  }
+
+  LOG(INFO) << "worker " << worker_id << " has " << files.size() <<
+    " files; " << gone_file_ids.size() << " files were gone";
+}
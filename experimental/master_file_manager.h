@@ -2,6 +2,7 @@
 #define FRANCINE_MASTER_FILE_MANAGER_H_
 
 #include <ctime>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -16,7 +17,7 @@ class MasterFileManager {
   }
 
   // Notify the file is put on the node.
-  // If file didn't exist previously, it sets new expiration time.
+  // The file is alive again even if it was expired before.
   // Set lock = true to lock the file right after the file is uploaded.
   void NotifyFilePut(const std::string& file_id,
                      uint64_t size, int worker_id, bool lock);
@@ -32,8 +33,10 @@ class MasterFileManager {
 
   // Lock / Unlock certain files on the worker.
   // The files on the worker will not be listed on unused files until they are unlocked.
-  // Returns true if the lock acquisition is successful.
-  // Ignores if a file is already locked on the worker.
+  // Locks are counted, so a file stays locked until every lock of it is
+  // released.
+  // Returns true if the lock acquisition is successful; no file is locked
+  // otherwise.
   bool LockFiles(std::vector<std::string>& file_ids, int worker_id);
 
   // Ignores files that are not on the worker.
@@ -57,9 +60,14 @@ class MasterFileManager {
   using FileId = std::string;
   using WorkerId = int;
 
-  // List unused files.
+  // List unused files, i.e. expired files that are not locked on the worker.
   void GetUnusedFiles(std::vector<std::pair<FileId, WorkerId>> *files);
 
+  // Replace what is known about the files on the worker with its inventory,
+  // e.g. after the master restarted.
+  void SyncInventory(int worker_id,
+      const std::vector<std::pair<FileId, uint64_t>>& files);
+
  private:
   NodeManager& node_manager_;
 
@@ -67,9 +75,13 @@ class MasterFileManager {
     time_t expire;
     uint64_t file_size;
     std::unordered_set<int> workers;
-    std::unordered_set<int> locked_workers;
+    // Number of locks of the file on each worker.
+    std::unordered_map<int, int> locked_workers;
   };
   std::unordered_map<FileId, FileInfo> files_;
+  std::mutex mutex_;
+
+  void RemoveWorkerFromFile(const FileId& file_id, int worker_id);
 };
 
 #endif
@@ -1,10 +1,15 @@
 #include "node_manager.h"
 
+#include <algorithm>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
+DEFINE_int32(worker_status_interval, 10,
+    "seconds until slot information of a worker is refreshed");
+
 void NodeManager::AddWorkersFromString(const std::string& addresses) {
   std::string address;
-  for (int i = 0; i < addresses.size(); ++i) {
+  for (size_t i = 0; i < addresses.size(); ++i) {
     if (addresses[i] != ',') {
       address += addresses[i];
     }
@@ -17,7 +22,19 @@ void NodeManager::AddWorkersFromString(const std::string& addresses) {
   }
 }
 
+NodeManager::~NodeManager() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  stop_cv_.notify_all();
+  if (refresh_thread_.joinable()) {
+    refresh_thread_.join();
+  }
+}
+
 std::vector<int> NodeManager::worker_ids() {
+  std::lock_guard<std::mutex> lock(mutex_);
   std::vector<int> worker_ids;
   for (auto&& worker : workers_) {
     worker_ids.push_back(worker.first);
@@ -27,13 +44,14 @@ std::vector<int> NodeManager::worker_ids() {
 
 int NodeManager::AddWorker(const std::string& address) {
   LOG(INFO) << "worker added: " << address;
-  // TODO(peryaudo): lock worker_cnt_
+  std::lock_guard<std::mutex> lock(mutex_);
   const int worker_id = worker_cnt_++;
   workers_.emplace(worker_id, address);
   return worker_id;
 }
 
-const std::string& NodeManager::GetWorkerAddress(int worker_id) {
+std::string NodeManager::GetWorkerAddress(int worker_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
   auto worker = workers_.find(worker_id);
   CHECK(worker != workers_.end()) << " worker id does not exist!";
   return worker->second.address;
@@ -41,7 +59,89 @@ const std::string& NodeManager::GetWorkerAddress(int worker_id) {
 
 std::shared_ptr<francine::FrancineWorker::Stub>
 NodeManager::GetWorkerStub(int worker_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
   auto worker = workers_.find(worker_id);
   CHECK(worker != workers_.end()) << " worker id does not exist!";
   return worker->second.stub;
 }
+
+void NodeManager::StartRefreshingStatus() {
+  refresh_thread_ = std::thread([this]() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      lock.unlock();
+      RefreshWorkersStatus();
+      lock.lock();
+      stop_cv_.wait_for(lock,
+          std::chrono::seconds(FLAGS_worker_status_interval),
+          [this]() { return stopping_; });
+    }
+  });
+}
+
+void NodeManager::RefreshWorkersStatus() {
+  std::vector<std::pair<int, std::shared_ptr<francine::FrancineWorker::Stub>>>
+    workers;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto&& worker : workers_) {
+      workers.emplace_back(worker.first, worker.second.stub);
+    }
+  }
+
+  for (auto&& worker : workers) {
+    grpc::ClientContext context;
+    context.set_deadline(
+        std::chrono::system_clock::now() + std::chrono::seconds(1));
+    francine::StatusRequest request;
+    francine::StatusResponse response;
+    auto status = worker.second->GetStatus(&context, request, &response);
+    if (!status.ok()) {
+      LOG(ERROR) << "failed to get status of worker " << worker.first;
+      continue;
+    }
+
+    const int slots = response.slots_size() > 0 ?
+      response.slots_size() : std::max(response.num_cpus(), 1);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto info = workers_.find(worker.first);
+    if (info == workers_.end()) {
+      continue;
+    }
+    if (info->second.slots != slots) {
+      LOG(INFO) << "worker " << info->second.address << " has " << slots <<
+        " slots";
+    }
+    info->second.slots = slots;
+  }
+}
+
+int NodeManager::GetLeastLoadedWorker() {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  int best_worker_id = -1;
+  int best_free_slots = 0;
+  for (auto&& worker : workers_) {
+    const int free_slots = worker.second.slots - worker.second.running;
+    if (best_worker_id < 0 || free_slots > best_free_slots) {
+      best_worker_id = worker.first;
+      best_free_slots = free_slots;
+    }
+  }
+  return best_worker_id;
+}
+
+void NodeManager::NotifyRunStarted(int worker_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto worker = workers_.find(worker_id);
+  CHECK(worker != workers_.end()) << " worker id does not exist!";
+  ++worker->second.running;
+}
+
+void NodeManager::NotifyRunFinished(int worker_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto worker = workers_.find(worker_id);
+  CHECK(worker != workers_.end()) << " worker id does not exist!";
+  --worker->second.running;
+}
@@ -1,7 +1,11 @@
 #ifndef FRANCINE_NODE_MANAGER_H_
 #define FRANCINE_NODE_MANAGER_H_
 
+#include <chrono>
+#include <condition_variable>
 #include <grpc++/grpc++.h>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -9,10 +13,14 @@
 
 class NodeManager {
  public:
+  NodeManager() : worker_cnt_(0), stopping_(false) {
+  }
+  ~NodeManager();
+
   int AddWorker(const std::string& address);
   void RemoveWorker(int worker_id);
 
-  const std::string& GetWorkerAddress(int worker_id);
+  std::string GetWorkerAddress(int worker_id);
   std::shared_ptr<francine::FrancineWorker::Stub> GetWorkerStub(int worker_id);
 
   // Add workers from comma separated address strings.
@@ -20,21 +28,49 @@ class NodeManager {
 
   std::vector<int> worker_ids();
 
+  // Fetch the task slots of the workers every --worker_status_interval
+  // seconds on a background thread, so that picking a worker never waits
+  // for them.
+  void StartRefreshingStatus();
+
+  // Get the worker with the most free task slots as last fetched.
+  // Returns -1 if not available.
+  int GetLeastLoadedWorker();
+
+  // Track renders running on the worker so that work is packed into
+  // its free slots.
+  void NotifyRunStarted(int worker_id);
+  void NotifyRunFinished(int worker_id);
+
  private:
+  void RefreshWorkersStatus();
+
   struct WorkerInfo {
     std::string address;
     std::shared_ptr<grpc::Channel> channel;
     std::shared_ptr<francine::FrancineWorker::Stub> stub;
 
+    // Number of renders the worker runs concurrently.
+    int slots;
+    int running;
+
     WorkerInfo(const std::string& address)
         : address(address)
         , channel(CreateChannel(address, grpc::InsecureChannelCredentials()))
-        , stub(francine::FrancineWorker::NewStub(channel)) { }
+        , stub(francine::FrancineWorker::NewStub(channel))
+        , slots(1)
+        , running(0) { }
   };
 
   using WorkerId = int;
   std::unordered_map<WorkerId, WorkerInfo> workers_;
   int worker_cnt_;
+  // Guards workers_ and worker_cnt_.
+  std::mutex mutex_;
+
+  std::thread refresh_thread_;
+  bool stopping_;
+  std::condition_variable stop_cv_;
 };
 
 #endif
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Renderer daemon for a stock PBRT, e.g.
+#
+#   ./francine --pbrt_daemon="./pbrt_daemon.sh /path/to/pbrt"
+#
+# Speaks the protocol of renderer_pool.h, but PBRT cannot keep a scene
+# loaded, so every render still runs a fresh PBRT on the scene. Updates are
+# ignored.
+pbrt=$1
+scene=$2
+
+if [ ! -r "$scene" ]; then
+  echo "error cannot read $scene"
+  exit 1
+fi
+echo ready
+
+while read -r command output update; do
+  if [ "$command" != render ]; then
+    echo "error unknown command $command"
+    continue
+  fi
+  # Only the answer goes to stdout.
+  if "$pbrt" --outfile "$output" "$scene" >&2; then
+    echo done
+  else
+    echo "error pbrt failed"
+  fi
+done
@@ -0,0 +1,250 @@
+#include "renderer_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+DEFINE_int32(renderer_daemons, 4,
+    "maximum number of idle renderer daemons kept warm on the worker");
+DEFINE_int32(renderer_daemon_timeout, 3600,
+    "seconds a renderer daemon may take to load its scene or to render");
+
+std::unique_ptr<RendererDaemon> RendererDaemon::Start(
+    const std::string& command, const std::string& scene,
+    const std::string& dirname) {
+  // Close on exec, so that later daemons and PBRT processes do not hold
+  // the stdin of this one open.
+  int to_daemon[2], from_daemon[2];
+  if (pipe2(to_daemon, O_CLOEXEC)) {
+    LOG(ERROR) << "failed to create pipe";
+    return nullptr;
+  }
+  if (pipe2(from_daemon, O_CLOEXEC)) {
+    LOG(ERROR) << "failed to create pipe";
+    close(to_daemon[0]);
+    close(to_daemon[1]);
+    return nullptr;
+  }
+
+  const std::string shell_command = command + " " + scene;
+
+  // The daemon inherits the CPU affinity of the calling thread, i.e. the
+  // cpuset of its slot.
+  const pid_t pid = fork();
+  if (pid < 0) {
+    LOG(ERROR) << "failed to fork renderer daemon";
+    close(to_daemon[0]);
+    close(to_daemon[1]);
+    close(from_daemon[0]);
+    close(from_daemon[1]);
+    return nullptr;
+  }
+
+  if (pid == 0) {
+    // Lead a process group, so that the renderers the command starts are
+    // killed along with it.
+    setpgid(0, 0);
+    // dup2() clears close on exec of the new descriptors.
+    dup2(to_daemon[0], STDIN_FILENO);
+    dup2(from_daemon[1], STDOUT_FILENO);
+    if (chdir(dirname.c_str())) {
+      _exit(127);
+    }
+    execl("/bin/sh", "sh", "-c", shell_command.c_str(),
+          static_cast<char*>(nullptr));
+    _exit(127);
+  }
+
+  close(to_daemon[0]);
+  close(from_daemon[1]);
+
+  FILE *in = fdopen(to_daemon[1], "w");
+  if (in == nullptr) {
+    LOG(ERROR) << "failed to open pipe to renderer daemon";
+    close(to_daemon[1]);
+    close(from_daemon[0]);
+    kill(-pid, SIGKILL);
+    int status;
+    waitpid(pid, &status, 0);
+    return nullptr;
+  }
+
+  std::unique_ptr<RendererDaemon> daemon(
+      new RendererDaemon(pid, in, from_daemon[0], dirname));
+
+  if (daemon->Expect("ready", nullptr)) {
+    LOG(ERROR) << "renderer daemon failed to load " << scene;
+    return nullptr;
+  }
+
+  LOG(INFO) << "renderer daemon " << pid << " loaded " << scene;
+  return daemon;
+}
+
+RendererDaemon::~RendererDaemon() {
+  // Closing stdin asks the daemon to exit.
+  if (in_) {
+    fclose(in_);
+  }
+  if (out_ >= 0) {
+    close(out_);
+  }
+  int status;
+  waitpid(pid_, &status, 0);
+}
+
+void RendererDaemon::Kill() {
+  if (!failed_) {
+    kill(-pid_, SIGKILL);
+    failed_ = true;
+  }
+}
+
+bool RendererDaemon::ReadLine(std::chrono::steady_clock::time_point deadline,
+                              const std::function<bool()>& cancelled,
+                              std::string *line) {
+  // Wake up regularly to check for cancellation.
+  const int kPollMilliseconds = 100;
+
+  for (;;) {
+    const size_t newline = pending_.find('\n');
+    if (newline != std::string::npos) {
+      line->assign(pending_, 0, newline);
+      pending_.erase(0, newline + 1);
+      return false;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now >= deadline) {
+      LOG(ERROR) << "renderer daemon " << pid_ << " timed out";
+      return true;
+    }
+    if (cancelled && cancelled()) {
+      LOG(INFO) << "render of renderer daemon " << pid_ << " cancelled";
+      return true;
+    }
+
+    const auto remaining =
+      std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+    struct pollfd fd = {out_, POLLIN, 0};
+    const int ready = poll(&fd, 1, std::min<int64_t>(
+          remaining.count() + 1, cancelled ? kPollMilliseconds : INT_MAX));
+    if (ready < 0 && errno != EINTR) {
+      LOG(ERROR) << "failed to poll renderer daemon " << pid_;
+      return true;
+    }
+    if (ready <= 0) {
+      continue;
+    }
+
+    char buffer[1024];
+    const ssize_t size = read(out_, buffer, sizeof(buffer));
+    if (size < 0 && errno == EINTR) {
+      continue;
+    }
+    if (size <= 0) {
+      LOG(ERROR) << "renderer daemon " << pid_ << " exited";
+      return true;
+    }
+    pending_.append(buffer, size);
+  }
+}
+
+bool RendererDaemon::Expect(const std::string& expected,
+                            const std::function<bool()>& cancelled) {
+  // A daemon that answers late or wrongly is out of step with the protocol.
+  const auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::seconds(FLAGS_renderer_daemon_timeout);
+  std::string answer;
+  if (ReadLine(deadline, cancelled, &answer)) {
+    Kill();
+    return true;
+  }
+
+  while (!answer.empty() && answer.back() == '\r') {
+    answer.pop_back();
+  }
+  if (answer != expected) {
+    LOG(ERROR) << "renderer daemon " << pid_ << ": " << answer;
+    Kill();
+    return true;
+  }
+  return false;
+}
+
+bool RendererDaemon::Render(
+    const std::string& output, const std::string& update,
+    const std::function<bool()>& cancelled) {
+  if (failed_) {
+    return true;
+  }
+
+  // The protocol is line based.
+  std::string oneline_update = update;
+  for (auto&& c : oneline_update) {
+    if (c == '\n' || c == '\r') {
+      c = ' ';
+    }
+  }
+
+  if (fprintf(in_, "render %s %s\n",
+              output.c_str(), oneline_update.c_str()) < 0 ||
+      fflush(in_)) {
+    LOG(ERROR) << "failed to send request to renderer daemon " << pid_;
+    Kill();
+    return true;
+  }
+  return Expect("done", cancelled);
+}
+
+RendererPool::~RendererPool() {
+  for (auto&& idle : idle_) {
+    const std::string dirname = idle.second->dirname();
+    idle.second.reset();
+    file_manager_.RemoveTmpDir(dirname);
+  }
+}
+
+std::unique_ptr<RendererDaemon> RendererPool::Acquire(const std::string& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+    if (it->first == key) {
+      auto daemon = std::move(it->second);
+      idle_.erase(it);
+      return daemon;
+    }
+  }
+  return nullptr;
+}
+
+void RendererPool::Release(
+    const std::string& key, std::unique_ptr<RendererDaemon> daemon) {
+  std::unique_ptr<RendererDaemon> evicted;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.emplace_front(key, std::move(daemon));
+    if (idle_.size() > static_cast<size_t>(FLAGS_renderer_daemons)) {
+      evicted = std::move(idle_.back().second);
+      idle_.pop_back();
+    }
+  }
+
+  if (evicted) {
+    Discard(std::move(evicted));
+  }
+}
+
+void RendererPool::Discard(std::unique_ptr<RendererDaemon> daemon) {
+  const std::string dirname = daemon->dirname();
+  daemon.reset();
+  file_manager_.RemoveTmpDir(dirname);
+}
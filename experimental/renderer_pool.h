@@ -0,0 +1,109 @@
+#ifndef FRANCINE_RENDERER_POOL_H_
+#define FRANCINE_RENDERER_POOL_H_
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+
+#include "worker_file_manager.h"
+
+// A long-lived renderer process that keeps a loaded scene between renders.
+//
+// The daemon is started as "<command> <scene>" in the directory with the
+// staged files. It loads the scene and builds its acceleration structures,
+// then talks a line based protocol over its stdin and stdout:
+//
+//   daemon -> worker: ready
+//   worker -> daemon: render <output file> <update>
+//   daemon -> worker: done | error <message>
+//
+// The daemon exits when its stdin is closed. A daemon that does not answer
+// within --renderer_daemon_timeout seconds, or whose render is cancelled, is
+// killed.
+//
+// Stock PBRT does not speak this protocol. pbrt_daemon.sh wraps it, but
+// still loads the scene for every render; keeping the scene warm needs a
+// renderer that implements the protocol itself.
+class RendererDaemon {
+ public:
+  // Returns nullptr if failed.
+  static std::unique_ptr<RendererDaemon> Start(const std::string& command,
+                                               const std::string& scene,
+                                               const std::string& dirname);
+  ~RendererDaemon();
+
+  RendererDaemon(const RendererDaemon&) = delete;
+  RendererDaemon& operator=(const RendererDaemon&) = delete;
+
+  // Render the loaded scene into the output file in dirname(), polling
+  // cancelled while the daemon renders.
+  // Returns true if failed.
+  bool Render(const std::string& output, const std::string& update,
+              const std::function<bool()>& cancelled);
+
+  const std::string& dirname() const { return dirname_; }
+
+  // Whether the daemon has failed or been killed, and cannot render again.
+  bool failed() const { return failed_; }
+
+ private:
+  RendererDaemon(pid_t pid, FILE *in, int out, const std::string& dirname)
+      : pid_(pid), in_(in), out_(out), dirname_(dirname), failed_(false) {
+  }
+
+  // Returns true and kills the daemon if it did not answer with the
+  // expected line.
+  bool Expect(const std::string& expected,
+              const std::function<bool()>& cancelled);
+  // Reads a line from the daemon until the deadline.
+  // Returns true if failed.
+  bool ReadLine(std::chrono::steady_clock::time_point deadline,
+                const std::function<bool()>& cancelled, std::string *line);
+  void Kill();
+
+  pid_t pid_;
+  FILE *in_;
+  // Read with poll() for the deadline, so not buffered by stdio.
+  int out_;
+  // Read from out_ but not yet returned as a line.
+  std::string pending_;
+  std::string dirname_;
+  bool failed_;
+};
+
+// Keeps idle renderer daemons keyed by the scene they have loaded, so that
+// later Runs with the same files skip process startup and scene load.
+// All the function calls to this class are thread-safe.
+class RendererPool {
+ public:
+  explicit RendererPool(WorkerFileManager& file_manager)
+      : file_manager_(file_manager) {
+  }
+  ~RendererPool();
+
+  // Take an idle daemon for the scene out of the pool.
+  // Returns nullptr if no daemon is idle.
+  std::unique_ptr<RendererDaemon> Acquire(const std::string& key);
+
+  // Return a daemon to the pool. Least recently used daemons are stopped
+  // and their staged files removed when more than --renderer_daemons are
+  // idle.
+  void Release(const std::string& key, std::unique_ptr<RendererDaemon> daemon);
+
+  // Stop the daemon and remove its staged files.
+  void Discard(std::unique_ptr<RendererDaemon> daemon);
+
+ private:
+  WorkerFileManager& file_manager_;
+
+  // Most recently used first.
+  std::list<std::pair<std::string, std::unique_ptr<RendererDaemon>>> idle_;
+  std::mutex mutex_;
+};
+
+#endif
@@ -0,0 +1,231 @@
+#include "slot_manager.h"
+
+#include <algorithm>
+#include <fstream>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+
+DEFINE_int32(slots, 0,
+    "number of concurrent renders on the worker; 0 for unlimited and unpinned");
+DEFINE_bool(slot_numa, false,
+    "pin each slot to a NUMA node instead of an even split of the CPUs");
+
+namespace {
+
+// Parses a kernel cpulist such as "0-3,8-11".
+std::vector<int> ParseCpuList(const std::string& cpulist) {
+  std::vector<int> cpus;
+  std::stringstream ss(cpulist);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+    const auto dash = range.find('-');
+    const int first = std::stoi(range.substr(0, dash));
+    const int last =
+      dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<int> GetAllowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set)) {
+    LOG(ERROR) << "sched_getaffinity failed";
+    return cpus;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+// Returns CPUs of each NUMA node, restricted to the allowed ones.
+std::vector<std::vector<int>> GetNumaNodes(const std::vector<int>& allowed) {
+  std::vector<std::vector<int>> nodes;
+  for (int node = 0; ; ++node) {
+    std::ifstream ifs("/sys/devices/system/node/node" +
+                      std::to_string(node) + "/cpulist");
+    if (!ifs.good()) {
+      break;
+    }
+    std::string cpulist;
+    std::getline(ifs, cpulist);
+
+    std::vector<int> cpus;
+    for (int cpu : ParseCpuList(cpulist)) {
+      if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (!cpus.empty()) {
+      nodes.push_back(cpus);
+    }
+  }
+  return nodes;
+}
+
+}  // namespace
+
+SlotManager::SlotManager()
+    : num_cpus_(0)
+    , started_(std::chrono::steady_clock::now()) {
+  const std::vector<int> allowed = GetAllowedCpus();
+  num_cpus_ = allowed.size();
+
+  std::vector<std::vector<int>> cpusets;
+  if (FLAGS_slot_numa) {
+    cpusets = GetNumaNodes(allowed);
+    if (cpusets.empty()) {
+      LOG(ERROR) << "no NUMA topology found; splitting CPUs evenly";
+    } else if (FLAGS_slots > 0 &&
+               static_cast<size_t>(FLAGS_slots) < cpusets.size()) {
+      cpusets.resize(FLAGS_slots);
+    }
+  }
+
+  if (cpusets.empty() && FLAGS_slots > 0 && !allowed.empty()) {
+    const int num_slots = std::min<int>(FLAGS_slots, allowed.size());
+    for (int i = 0; i < num_slots; ++i) {
+      const int begin = allowed.size() * i / num_slots;
+      const int end = allowed.size() * (i + 1) / num_slots;
+      cpusets.emplace_back(allowed.begin() + begin, allowed.begin() + end);
+    }
+  }
+
+  for (auto&& cpus : cpusets) {
+    Slot slot;
+    slot.cpus = cpus;
+    slot.busy = false;
+    slot.runs = 0;
+    slot.busy_time = std::chrono::steady_clock::duration::zero();
+    slots_.push_back(slot);
+
+    std::stringstream cpulist;
+    for (int cpu : cpus) {
+      cpulist << cpu << " ";
+    }
+    LOG(INFO) << "slot " << slots_.size() - 1 << " pinned to cpus " <<
+      cpulist.str();
+  }
+
+  if (slots_.empty()) {
+    LOG(INFO) << "running without slots on " << num_cpus_ << " cpus";
+  }
+}
+
+int SlotManager::Acquire() {
+  if (slots_.empty()) {
+    return -1;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+      auto&& slot = slots_[i];
+      if (!slot.busy) {
+        slot.busy = true;
+        slot.busy_since = std::chrono::steady_clock::now();
+        ++slot.runs;
+        return i;
+      }
+    }
+    released_.wait(lock);
+  }
+}
+
+void SlotManager::Release(int slot_index) {
+  if (slot_index < 0) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto&& slot = slots_[slot_index];
+    slot.busy = false;
+    slot.busy_time += std::chrono::steady_clock::now() - slot.busy_since;
+  }
+  released_.notify_one();
+}
+
+void SlotManager::GetStatus(std::vector<SlotStatus> *statuses) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  const auto now = std::chrono::steady_clock::now();
+  const double uptime =
+    std::chrono::duration<double>(now - started_).count();
+
+  statuses->clear();
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    auto&& slot = slots_[i];
+    auto busy_time = slot.busy_time;
+    if (slot.busy) {
+      busy_time += now - slot.busy_since;
+    }
+
+    SlotStatus status;
+    status.index = i;
+    status.cpus = slot.cpus;
+    status.busy = slot.busy;
+    status.runs = slot.runs;
+    status.utilization = uptime > 0.0 ?
+      std::chrono::duration<double>(busy_time).count() / uptime : 0.0;
+    statuses->push_back(status);
+  }
+}
+
+SlotManager::Lease::Lease(SlotManager *slot_manager)
+    : slot_manager_(slot_manager)
+    , slot_(slot_manager->Acquire())
+    , pinned_(false) {
+  if (slot_ < 0) {
+    return;
+  }
+
+  CPU_ZERO(&original_cpus_);
+  if (pthread_getaffinity_np(pthread_self(),
+                             sizeof(original_cpus_), &original_cpus_)) {
+    LOG(ERROR) << "failed to get affinity of the thread; slot " << slot_ <<
+      " is not pinned";
+    return;
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int cpu : slot_manager_->slots_[slot_].cpus) {
+    CPU_SET(cpu, &cpus);
+  }
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+    LOG(ERROR) << "failed to pin the thread to slot " << slot_;
+    return;
+  }
+  pinned_ = true;
+}
+
+SlotManager::Lease::~Lease() {
+  // gRPC reuses the thread for later calls, so restore its affinity.
+  if (pinned_ &&
+      pthread_setaffinity_np(pthread_self(),
+                             sizeof(original_cpus_), &original_cpus_)) {
+    LOG(ERROR) << "failed to restore affinity of the thread";
+  }
+  slot_manager_->Release(slot_);
+}
+
+int SlotManager::Lease::num_cpus() const {
+  if (slot_ < 0) {
+    return slot_manager_->num_cpus();
+  }
+  return slot_manager_->slots_[slot_].cpus.size();
+}
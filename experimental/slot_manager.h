@@ -0,0 +1,76 @@
+#ifndef FRANCINE_SLOT_MANAGER_H_
+#define FRANCINE_SLOT_MANAGER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <sched.h>
+#include <vector>
+
+// Partitions the CPUs of the worker into a fixed number of task slots.
+// Each slot runs at most one render at a time, and the thread running it
+// is pinned to the disjoint cpuset (or NUMA node) owned by the slot.
+//
+// With --slots=0 the worker keeps the legacy behavior: any number of
+// concurrent renders, none of them pinned.
+class SlotManager {
+ public:
+  SlotManager();
+
+  struct SlotStatus {
+    int index;
+    std::vector<int> cpus;
+    bool busy;
+    uint64_t runs;
+    // Ratio of the time the slot has been busy since the worker started.
+    double utilization;
+  };
+
+  // Acquires a slot on construction and releases it on destruction.
+  // Blocks until a slot becomes available.
+  class Lease {
+   public:
+    explicit Lease(SlotManager *slot_manager);
+    ~Lease();
+
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+
+    // Returns -1 if the worker is not slotted.
+    int slot() const { return slot_; }
+    // Number of CPUs that the render may use.
+    int num_cpus() const;
+
+   private:
+    SlotManager *slot_manager_;
+    int slot_;
+    bool pinned_;
+    cpu_set_t original_cpus_;
+  };
+
+  int num_slots() const { return slots_.size(); }
+  int num_cpus() const { return num_cpus_; }
+
+  void GetStatus(std::vector<SlotStatus> *statuses);
+
+ private:
+  struct Slot {
+    std::vector<int> cpus;
+    bool busy;
+    uint64_t runs;
+    std::chrono::steady_clock::duration busy_time;
+    std::chrono::steady_clock::time_point busy_since;
+  };
+
+  int Acquire();
+  void Release(int slot);
+
+  std::vector<Slot> slots_;
+  int num_cpus_;
+  std::chrono::steady_clock::time_point started_;
+  std::mutex mutex_;
+  std::condition_variable released_;
+};
+
+#endif
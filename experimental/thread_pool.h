@@ -0,0 +1,38 @@
+#ifndef FRANCINE_THREAD_POOL_H_
+#define FRANCINE_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed number of threads running scheduled tasks in FIFO order.
+// Tasks must not wait for other tasks of the same pool.
+class ThreadPool {
+ public:
+  // num_threads = 0 uses one thread per hardware thread.
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Returns the future that becomes ready when the task finished.
+  std::future<void> Schedule(std::function<void()> task);
+
+  int num_threads() const { return threads_.size(); }
+
+ private:
+  void Loop();
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::packaged_task<void()>> tasks_;
+  bool stopped_;
+  std::vector<std::thread> threads_;
+};
+
+#endif
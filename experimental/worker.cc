@@ -1,19 +1,22 @@
 #include "worker.h"
 
+#include <algorithm>
+#include <csignal>
 #include <fstream>
+#include <future>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <limits>
 #include <sstream>
 #include <string>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
+#include "accumulate.h"
 #include "ao.h"
-#include "jpgd.h"
-#include "jpge.h"
-#include "lodepng.h"
-#include "tinyexr.h"
+#include "image_io.h"
+#include "partial_image.h"
 
 using francine::FrancineWorker;
 using francine::ImageType;
@@ -30,6 +33,13 @@ using francine::GetRequest;
 using francine::GetResponse;
 using francine::DeleteRequest;
 using francine::DeleteResponse;
+using francine::BatchDeleteRequest;
+using francine::BatchDeleteResponse;
+using francine::ListInventoryRequest;
+using francine::ListInventoryResponse;
+using francine::StatusRequest;
+using francine::StatusResponse;
+using francine::PngCompression;
 using grpc::CreateChannel;
 using grpc::ClientContext;
 using grpc::ClientReader;
@@ -43,287 +53,870 @@ using grpc::ServerReaderWriter;
 using grpc::ServerWriter;
 
 DEFINE_string(worker_address, "0.0.0.0:50052", "worker address to bind");
+DEFINE_string(pbrt, "/home/peryaudo/pbrt-v2/src/bin/pbrt", "PBRT binary");
+DEFINE_int32(inventory_page_size, 1000,
+    "default number of files listed per ListInventory page");
+DEFINE_string(pbrt_daemon, "",
+    "PBRT renderer daemon command; renders fork a fresh PBRT if empty");
+DEFINE_uint64(max_accumulators, 16,
+    "number of compose accumulators kept on the worker");
+DEFINE_int32(compose_threads, 0,
+    "number of threads decoding and accumulating images to compose; "
+    "0 for one per CPU");
 
 namespace {
 
-bool LoadPng(const std::string& content, std::vector<double>* image,
-             int* width, int* height) {
-  std::vector<unsigned char> png(content.size());
-  for (int i = 0; i < content.size(); ++i) {
-    png[i] = content[i];
+const char kPbrtScene[] = "buddha.pbrt";
+const char kPbrtOutput[] = "buddha.exr";
+// Scene file of AOBench among the files of the request, see LoadAoScene.
+const char kAoBenchScene[] = "scene.ao";
+
+// Number of channels in a block accumulated by a compose thread is a multiple
+// of this, so that the blocks are aligned to the SIMD kernels and cache lines.
+const size_t kComposeBlockAlignment = 64;
+
+// Identifies the scene loaded by a renderer daemon.
+// The file ids are already content hashes.
+std::string SceneKey(const RunRequest& request, int slot) {
+  std::vector<std::string> files;
+  for (auto&& file : request.files()) {
+    files.push_back(file.id() + " " + file.alias());
   }
+  std::sort(files.begin(), files.end());
 
-  std::vector<unsigned char> decoded_image;
-  unsigned unsigned_with, unsigned_height;
-
-  unsigned error = lodepng::decode(decoded_image,
-                                   unsigned_with, unsigned_height, png);
-  if (error) {
-    LOG(ERROR) << "failed to decode PNG image";
-    return true;
+  // Daemons inherit the cpuset of the slot that started them.
+  std::string key = std::to_string(request.renderer()) + "\n" +
+    std::to_string(slot) + "\n";
+  for (auto&& file : files) {
+    key += file + "\n";
   }
+  return key;
+}
 
-  *width = unsigned_with;
-  *height = unsigned_height;
-
-  image->resize(decoded_image.size());
-  for (int i = 0; i < decoded_image.size(); ++i) {
-    (*image)[i] = decoded_image[i];
+ImageFormat ToImageFormat(ImageType image_type) {
+  switch (image_type) {
+    case ImageType::PNG:
+      return kFormatPng;
+    case ImageType::JPEG:
+      return kFormatJpg;
+    case ImageType::EXR:
+      return kFormatExr;
+    case ImageType::PARTIAL:
+      return kFormatPartial;
+    default:
+      return kFormatError;
   }
-  return false;
 }
 
-/*
-bool LoadJpg(const std::string& content, std::vector<double>* image,
-             int* width, int* height) {
-  int actual_comps;
-
-  unsigned char* decoded_image =
-    jpgd::decompress_jpeg_image_from_file(file_name.c_str(),
-                                          width, height, &actual_comps, 4);
+PngProfile ToPngProfile(PngCompression compression) {
+  switch (compression) {
+    case PngCompression::PNG_BEST:
+      return kPngBest;
+    case PngCompression::PNG_FAST:
+      return kPngFast;
+    case PngCompression::PNG_RLE:
+      return kPngRle;
+    case PngCompression::PNG_STORE:
+      return kPngStore;
+    default:
+      return kPngError;
+  }
+}
 
-  if (decoded_image == NULL) {
-    LOG(ERROR) << "failed to decode JPEG image";
+// Images are decoded in memory; none of the codecs touch temporary files.
+bool LoadImage(ImageType image_type,
+    const std::string& content, DecodedImage* image) {
+  const ImageFormat format = ToImageFormat(image_type);
+  if (format == kFormatError ||
+      DetectImageFormat(content.data(), content.size()) != format) {
+    LOG(ERROR) << "image is not of the type " << image_type;
     return true;
   }
-
-  image->resize(*width * *height * 4);
-  for (int i = 0; i < image->size(); ++i) {
-    (*image)[i] = decoded_image[i];
+  if (DecodeImage(content.data(), content.size(), image)) {
+    LOG(ERROR) << "failed to decode image";
+    return true;
   }
   return false;
 }
 
-bool LoadExr(const std::string& content, std::vector<double>* image,
-             int* width, int* height) {
-  float* out_rgba;
-  const char* error;
+// Returns true if the tile is empty or not inside the width x height frame.
+bool InvalidTile(const francine::Tile& tile, uint32_t width, uint32_t height) {
+  return tile.width() == 0 || tile.height() == 0 ||
+    tile.x() >= width || tile.width() > width - tile.x() ||
+    tile.y() >= height || tile.height() > height - tile.y();
+}
 
-  if (LoadEXR(&out_rgba, width, height, file_name.c_str(), &error)) {
-    LOG(ERROR) << "failed to decode EXR image: " << error;
-    return true;
+// Sets the fields of the update that are set, i.e. not zero, on the
+// parameters, so that a Run message keeps the camera of the stream for the
+// fields it leaves out.
+void MergeAoBenchParameters(const francine::AoBenchParameters& update,
+                            francine::AoBenchParameters *parameters) {
+  if (update.width() > 0) {
+    parameters->set_width(update.width());
   }
-
-  image->resize(*width * *height * 4);
-  for (int i = 0; i < image->size(); ++i) {
-    (*image)[i] = out_rgba[i];
+  if (update.height() > 0) {
+    parameters->set_height(update.height());
+  }
+  if (update.subsamples() > 0) {
+    parameters->set_subsamples(update.subsamples());
+  }
+  if (update.ao_samples() > 0) {
+    parameters->set_ao_samples(update.ao_samples());
+  }
+  if (update.eye_size() == 3) {
+    *parameters->mutable_eye() = update.eye();
+  }
+  if (update.look_at_size() == 3) {
+    *parameters->mutable_look_at() = update.look_at();
+  }
+  if (update.fov() > 0.0) {
+    parameters->set_fov(update.fov());
   }
-  return false;
 }
-*/
 
-bool LoadImage(ImageType image_type,
-    const std::string& content, std::vector<double>* image,
-    int* width, int* height) {
-  if (image_type == ImageType::PNG) {
-    return LoadPng(content, image, width, height);
-  } else {
-    LOG(ERROR) << "unsupported image type to load";
-    return true;
-  }
+// Returns true if the parameters are out of the range that the master
+// accepts, e.g. from a client talking to the worker directly.
+bool InvalidAoBenchParameters(const francine::AoBenchParameters& parameters) {
+  return parameters.width() > static_cast<uint32_t>(kMaxAoBenchSize) ||
+    parameters.height() > static_cast<uint32_t>(kMaxAoBenchSize) ||
+    parameters.subsamples() > static_cast<uint32_t>(kMaxAoBenchSubsamples) ||
+    parameters.ao_samples() > static_cast<uint32_t>(kMaxAoBenchAoSamples) ||
+    !(parameters.fov() >= 0.0 && parameters.fov() < 180.0);
 }
 
-bool SavePng(const std::vector<double>& image,
-             int width, int height, std::string *content) {
-  std::vector<unsigned char> output_image(image.size());
-  for (int i = 0; i < image.size(); ++i) {
-    output_image[i] = image[i];
+// Options of AoBench for the parameters, with the defaults of AoBenchOptions
+// for those left unset. The parameters must not be invalid.
+AoBenchOptions ToAoBenchOptions(const francine::AoBenchParameters& parameters) {
+  AoBenchOptions options;
+  if (parameters.width() > 0) {
+    options.width = parameters.width();
   }
-
-  std::vector<unsigned char> png;
-  unsigned error = lodepng::encode(png, output_image, width, height);
-  if (error) {
-    LOG(ERROR) << "failed to encode PNG image";
-    return true;
+  if (parameters.height() > 0) {
+    options.height = parameters.height();
   }
+  if (parameters.subsamples() > 0) {
+    options.nsubsamples = parameters.subsamples();
+  }
+  if (parameters.ao_samples() > 0) {
+    options.nao_samples = parameters.ao_samples();
+  }
+  if (parameters.eye_size() == 3) {
+    std::copy(parameters.eye().begin(), parameters.eye().end(), options.eye);
+  }
+  if (parameters.look_at_size() == 3) {
+    std::copy(parameters.look_at().begin(), parameters.look_at().end(),
+              options.look_at);
+  }
+  if (parameters.fov() > 0.0) {
+    options.fov = parameters.fov();
+  }
+  return options;
+}
 
-  *content = std::string(png.begin(), png.end());
-
-  return false;
+// Adds weight times the squared colors of count pixels, from the pixel begin
+// of the frame in row-major order, to the variance tiles they fall in.
+void AddSquares(PixelType type, const unsigned char *pixels,
+    size_t begin, size_t count, size_t width,
+    size_t tile_size, size_t columns, double weight,
+    std::vector<double> *squares, std::vector<double> *weights) {
+  const size_t pixel_size = 4 * PixelTypeSize(type);
+  while (count > 0) {
+    const size_t x = begin % width;
+    const size_t y = begin / width;
+    const size_t n = std::min({count, tile_size - x % tile_size, width - x});
+    const size_t tile = y / tile_size * columns + x / tile_size;
+    (*squares)[tile] += weight * SumOfSquaredColors(type, pixels, n);
+    (*weights)[tile] += weight * 3 * n;
+    pixels += n * pixel_size;
+    begin += n;
+    count -= n;
+  }
 }
 
-bool SaveImage(ImageType image_type, const std::vector<double>& image,
-    int width, int height, std::string *content) {
-  if (image_type == ImageType::PNG) {
-    return SavePng(image, width, height, content);
-  } else {
+// samples and weight are kept by partial images only. PNG images are encoded
+// on num_threads threads.
+bool SaveImage(ImageType image_type, PngCompression png_compression,
+    const std::vector<float>& image, int width, int height,
+    uint64_t samples, uint64_t weight, int num_threads, std::string *content) {
+  const ImageFormat format = ToImageFormat(image_type);
+  if (format == kFormatError) {
     LOG(ERROR) << "unsupported image type to save";
     return true;
   }
-}
-
-/*
-bool SaveJpg(const std::vector<double>& image,
-             int width, int height, std::string *content) {
-  std::vector<unsigned char> three_channel_image(image.size() / 4 * 3);
-  for (int i = 0, i_max = image.size() / 4; i < i_max; ++i) {
-    three_channel_image[3 * i + 0] = image[4 * i + 0];
-    three_channel_image[3 * i + 1] = image[4 * i + 1];
-    three_channel_image[3 * i + 2] = image[4 * i + 2];
-  }
-  jpge::compress_image_to_jpeg_file(file_name.c_str(),
-                                    width, height, 3,
-                                    &three_channel_image[0]);
+  if (EncodeImage(format, image.data(), width, height,
+                  samples, weight, content, ToPngProfile(png_compression),
+                  num_threads)) {
+    LOG(ERROR) << "failed to encode image";
+    return true;
+  }
   return false;
 }
 
-bool SaveExr(const std::vector<double>& image,
-             int width, int height, std::string *content) {
-  EXRImage exr;
-
-  exr.num_channels = 4;
-
-  const char *channel_names[] = {"R", "G", "B", "A"};
-  exr.channel_names = channel_names;
-
-  int pixel_types[] = {
-    TINYEXR_PIXELTYPE_FLOAT,
-    TINYEXR_PIXELTYPE_FLOAT,
-    TINYEXR_PIXELTYPE_FLOAT,
-    TINYEXR_PIXELTYPE_FLOAT};
-  exr.pixel_types = pixel_types;
+}  // namespace
 
-  exr.width = width;
-  exr.height = height;
+bool FrancineWorkerServiceImpl::RenderAoBench(
+    const RunRequest& request, const AoScene *scene,
+    uint64_t *sample_offset, uint32_t passes, int num_threads,
+    ServerContext *context,
+    const std::function<bool(RunResponse*)>& on_pass) {
+  AoBenchOptions options = ToAoBenchOptions(request.aobench());
+  options.scene = scene;
+  if (request.has_tile()) {
+    options.tile_x = request.tile().x();
+    options.tile_y = request.tile().y();
+    options.tile_width = request.tile().width();
+    options.tile_height = request.tile().height();
+  }
+  options.seed = request.seed();
+  options.sample_offset = *sample_offset;
+  *sample_offset += static_cast<uint64_t>(passes) *
+    AoBenchOcclusionSamples(options);
+  options.num_threads = num_threads;
+  options.cancelled = [context]() { return context->IsCancelled(); };
+
+  return AoBenchPasses(options, passes,
+      [this, &request, num_threads, &on_pass](int,
+                                              const AoBenchImage& rendered) {
+    // Partial images skip quantizing the render and encoding it to PNG.
+    std::string image;
+    if (request.image_type() == ImageType::PARTIAL) {
+      if (EncodePartialImage(rendered.rgba.data(), rendered.width,
+                             rendered.height, rendered.samples,
+                             rendered.samples, kPixelFloat, kPartialRaw,
+                             &image)) {
+        LOG(ERROR) << "failed to encode aobench partial image";
+        return true;
+      }
+    } else if (EncodePngImage(QuantizeAoBenchImage(rendered).data(),
+                              rendered.width, rendered.height,
+                              ToPngProfile(request.png_compression()),
+                              &image, num_threads)) {
+      LOG(ERROR) << "failed to encode aobench image";
+      return true;
+    }
 
-  std::vector<std::vector<float> > output_image(
-      4,
-      std::vector<float>(2 * width * height));
+    std::string result_id;
+    uint64_t result_size;
+    if (file_manager_.Put(image, &result_id, &result_size)) {
+      LOG(INFO) << "failed to obtain aobench rendering result";
+      return true;
+    }
 
-  for (int i = 0, i_max = image.size() / 4; i < i_max; ++i) {
-    output_image[0][i] = image[4 * i + 0];
-    output_image[1][i] = image[4 * i + 1];
-    output_image[2][i] = image[4 * i + 2];
-    output_image[3][i] = image[4 * i + 3];
-  }
+    RunResponse response;
+    response.set_id(result_id);
+    response.set_file_size(result_size);
+    response.set_image_type(request.image_type());
+    response.set_samples(rendered.samples);
+    if (request.has_tile()) {
+      *response.mutable_tile() = request.tile();
+    }
+    return on_pass(&response);
+  });
+}
 
-  unsigned char *images[4];
-  for (int i = 0; i < 4; ++i) {
-    images[i] = reinterpret_cast<unsigned char*>(&output_image[i]);
+bool FrancineWorkerServiceImpl::RenderPbrt(
+    const std::string& tmpdir, RendererDaemon *daemon,
+    const std::string& update, ServerContext *context,
+    RunResponse *response) {
+  if (daemon) {
+    if (daemon->Render(kPbrtOutput, update,
+                       [context]() { return context->IsCancelled(); })) {
+      LOG(INFO) << "renderer daemon failed";
+      return true;
+    }
+  } else {
+    // Do not chdir() here; renders may run concurrently on other slots.
+    const std::string command =
+      "cd " + tmpdir + " && " + FLAGS_pbrt + " " + kPbrtScene;
+    system(command.c_str());
   }
 
-  exr.images = images;
-
-  const char *error;
-  if (SaveMultiChannelEXRToFile(&exr, file_name.c_str(), &error)) {
-    LOG(ERROR) << "failed to encode EXR image: " << error;
+  std::string result_id;
+  uint64_t result_size;
+  if (file_manager_.Retain(tmpdir, kPbrtOutput, &result_id, &result_size)) {
+    LOG(INFO) << "failed to obtain PBRT rendering result";
     return true;
   }
 
+  response->set_id(result_id);
+  response->set_file_size(result_size);
+  response->set_image_type(ImageType::EXR);
+  response->set_samples(1);
   return false;
 }
-*/
-
-}  // namespace
 
 Status FrancineWorkerServiceImpl::Run(
     ServerContext* context,
     ServerReaderWriter<RunResponse, RunRequest>* stream) {
   LOG(INFO) << "rendering started";
 
+  // The first request decides the renderer and the files. Following
+  // requests update the parameters and ask for more passes on the same
+  // renderer.
   RunRequest request;
-  // TODO(peryaudo): Accept streaming requests if the renderer supports
   if (!stream->Read(&request)) {
     return Status(grpc::INVALID_ARGUMENT, "");
   }
+  const Renderer renderer = request.renderer();
 
-  if (request.renderer() == Renderer::AOBENCH) {
-    RunResponse response;
-    std::string result_id;
-    uint64_t result_size;
-    if (file_manager_.Put(AoBench(), &result_id, &result_size)) {
-      LOG(INFO) << "failed to obtain aobench rendering result";
+  if (renderer != Renderer::AOBENCH && renderer != Renderer::PBRT) {
+    LOG(ERROR) << "the renderer type is not implemented";
+    return Status(grpc::UNIMPLEMENTED, "");
+  }
+
+  // The tile, the seed and the image type are fixed for the stream, as its
+  // passes are composed together. The AOBench parameters follow the
+  // updates.
+  RunRequest aobench_request = request;
+  const bool tiled = request.has_tile();
+  if (tiled && renderer != Renderer::AOBENCH) {
+    LOG(ERROR) << "the renderer does not support tiles";
+    return Status(grpc::UNIMPLEMENTED, "");
+  }
+  if (renderer == Renderer::AOBENCH &&
+      request.image_type() != ImageType::PNG &&
+      request.image_type() != ImageType::PARTIAL) {
+    LOG(ERROR) << "aobench renders PNG or partial images only";
+    return Status(grpc::UNIMPLEMENTED, "");
+  }
+
+  SlotManager::Lease lease(&slot_manager_);
+  if (lease.slot() >= 0) {
+    LOG(INFO) << "rendering on slot " << lease.slot();
+  }
+
+  // Keep the staged files for the whole stream, and for later streams
+  // with the same files if the renderer runs as a daemon.
+  std::string tmpdir;
+  std::string scene_key;
+  std::unique_ptr<RendererDaemon> daemon;
+  if (renderer == Renderer::PBRT && !FLAGS_pbrt_daemon.empty()) {
+    scene_key = SceneKey(request, lease.slot());
+    daemon = renderer_pool_.Acquire(scene_key);
+    if (daemon) {
+      LOG(INFO) << "reusing warm renderer daemon";
+      tmpdir = daemon->dirname();
+    }
+  }
+  // AOBench loads the scene once for the stream, and renders the default
+  // scene without files.
+  std::shared_ptr<const AoScene> aobench_scene;
+  if (renderer == Renderer::AOBENCH && request.files_size() > 0) {
+    std::vector<std::pair<std::string, std::string>> files;
+    for (auto&& file : request.files()) {
+      files.emplace_back(file.id(), file.alias());
+    }
+    std::string scene_dir;
+    if (file_manager_.CreateTmpDir(files, &scene_dir)) {
+      LOG(INFO) << "failed to create temporary directory";
       return Status(grpc::DATA_LOSS, "");
     }
-    response.set_id(result_id);
-    response.set_file_size(result_size);
-    response.set_image_type(ImageType::PNG);
-    stream->Write(response);
-  } else if (request.renderer() == Renderer::PBRT) {
+    aobench_scene = LoadAoScene(scene_dir + "/" + kAoBenchScene);
+    file_manager_.RemoveTmpDir(scene_dir);
+    if (!aobench_scene) {
+      LOG(ERROR) << "failed to load the AOBench scene";
+      return Status(grpc::INVALID_ARGUMENT, "");
+    }
+  }
+
+  if (renderer == Renderer::PBRT && !daemon) {
     std::vector<std::pair<std::string, std::string>> files;
     for (auto&& file : request.files()) {
       files.emplace_back(file.id(), file.alias());
     }
-    std::string tmpdir;
     if (file_manager_.CreateTmpDir(files, &tmpdir)) {
       LOG(INFO) << "failed to create temporary directory";
       return Status(grpc::DATA_LOSS, "");
     }
 
-    chdir(tmpdir.c_str());
-
-    system("/home/peryaudo/pbrt-v2/src/bin/pbrt buddha.pbrt");
+    if (!FLAGS_pbrt_daemon.empty()) {
+      daemon = RendererDaemon::Start(FLAGS_pbrt_daemon, kPbrtScene, tmpdir);
+      if (!daemon) {
+        LOG(ERROR) << "failed to start renderer daemon; "
+          "forking a renderer for each pass instead";
+      }
+    }
+  }
 
-    std::string result_id;
-    uint64_t result_size;
-    if (file_manager_.Retain(tmpdir, "buddha.exr", &result_id, &result_size)) {
-      LOG(INFO) << "failed to obtain PBRT rendering result";
-      file_manager_.RemoveTmpDir(tmpdir);
-      return Status(grpc::DATA_LOSS, "");
+  // The next occlusion sample of AOBench passes in the sequences. Each pass
+  // advances it by its own samples, since updates may change ao_samples.
+  uint64_t sample_offset = static_cast<uint64_t>(request.pass_offset()) *
+    AoBenchOcclusionSamples(ToAoBenchOptions(request.aobench()));
+
+  Status status = Status::OK;
+  uint32_t pass = 0;
+  do {
+    if (renderer == Renderer::AOBENCH) {
+      MergeAoBenchParameters(request.aobench(),
+                             aobench_request.mutable_aobench());
+      if (InvalidAoBenchParameters(aobench_request.aobench())) {
+        LOG(ERROR) << "the AOBench parameters are out of range";
+        status = Status(grpc::INVALID_ARGUMENT, "");
+        break;
+      }
+      const AoBenchOptions options =
+        ToAoBenchOptions(aobench_request.aobench());
+      if (tiled && InvalidTile(aobench_request.tile(),
+                               options.width, options.height)) {
+        LOG(ERROR) << "the tile is outside of the frame";
+        status = Status(grpc::INVALID_ARGUMENT, "");
+        break;
+      }
     }
 
-    RunResponse response;
-    response.set_id(result_id);
-    response.set_file_size(result_size);
-    response.set_image_type(ImageType::EXR);
-    stream->Write(response);
+    // Each pass is written as soon as it is rendered.
+    auto write_pass = [&stream, &status, &pass](RunResponse *response) {
+      response->set_pass(pass++);
+      if (!stream->Write(*response)) {
+        status = Status(grpc::CANCELLED, "");
+        return true;
+      }
+      return false;
+    };
+
+    const uint32_t passes = std::max<uint32_t>(request.passes(), 1);
+    if (renderer == Renderer::AOBENCH) {
+      // AOBench renders the passes progressively and drops the frame
+      // between rows once the client is gone.
+      if (RenderAoBench(aobench_request, aobench_scene.get(), &sample_offset,
+                        passes, lease.num_cpus(), context, write_pass) &&
+          status.ok()) {
+        status = context->IsCancelled() ?
+          Status(grpc::CANCELLED, "") : Status(grpc::DATA_LOSS, "");
+      }
+      continue;
+    }
 
+    for (uint32_t i = 0; i < passes && status.ok(); ++i) {
+      if (context->IsCancelled()) {
+        status = Status(grpc::CANCELLED, "");
+        break;
+      }
+
+      RunResponse response;
+      if (RenderPbrt(tmpdir, daemon.get(), request.update(), context,
+                     &response)) {
+        status = context->IsCancelled() ?
+          Status(grpc::CANCELLED, "") : Status(grpc::DATA_LOSS, "");
+        break;
+      }
+      write_pass(&response);
+    }
+  } while (status.ok() && stream->Read(&request));
+
+  if (daemon) {
+    // A daemon that failed to render may have lost its scene, and one
+    // whose render was cancelled has been killed.
+    if (status.error_code() == grpc::DATA_LOSS || daemon->failed()) {
+      renderer_pool_.Discard(std::move(daemon));
+    } else {
+      renderer_pool_.Release(scene_key, std::move(daemon));
+    }
+  } else if (renderer == Renderer::PBRT) {
     file_manager_.RemoveTmpDir(tmpdir);
+  }
 
-    LOG(INFO) << "rendering finished";
-    return grpc::Status::OK;
-  } else {
-    LOG(ERROR) << "the renderer type is not implemented";
-    return Status(grpc::UNIMPLEMENTED, "");
+  LOG(INFO) << "rendering finished; " << pass << " passes";
+  return status;
+}
+
+FrancineWorkerServiceImpl::FrancineWorkerServiceImpl()
+    : renderer_pool_(file_manager_)
+    , compose_pool_(FLAGS_compose_threads) {
+}
+
+Status FrancineWorkerServiceImpl::AccumulateImages(
+    const ComposeRequest* request, ComposeState* state) {
+  struct PendingImage : DecodedImage {
+    Status status;
+  };
+
+  // Sets up the variance tiles once the frame size is known.
+  auto reset_variance = [state]() {
+    const uint32_t tile_size = state->variance_tile_size;
+    if (tile_size == 0) {
+      return;
+    }
+    state->variance_columns = (state->width + tile_size - 1) / tile_size;
+    const size_t num_tiles = static_cast<size_t>(state->variance_columns) *
+      ((state->height + tile_size - 1) / tile_size);
+    state->squares.assign(num_tiles, 0.0);
+    state->square_weights.assign(num_tiles, 0.0);
+    state->tile_images.assign(num_tiles, 0);
+  };
+
+  const bool fresh = state->width < 0;
+  if (fresh) {
+    state->variance_tile_size = request->variance_tile_size();
+  } else if (request->variance_tile_size() > 0 &&
+             request->variance_tile_size() != state->variance_tile_size) {
+    LOG(ERROR) << "compose failed; variance tile size does not match";
+    return Status(grpc::INVALID_ARGUMENT, "");
   }
 
-  LOG(INFO) << "rendering finished";
-  return grpc::Status::OK;
+  // Tiles are stitched into the frame of the size given by the request.
+  if (request->width() > 0 || request->height() > 0) {
+    if (fresh && request->width() > 0 && request->height() > 0) {
+      state->width = request->width();
+      state->height = request->height();
+      state->accumulator.Reset(
+          static_cast<size_t>(state->width) * state->height * 4);
+      reset_variance();
+    }
+    if (request->width() != static_cast<uint32_t>(state->width) ||
+        request->height() != static_cast<uint32_t>(state->height)) {
+      LOG(ERROR) << "compose failed; frame size does not match";
+      return Status(grpc::INVALID_ARGUMENT, "");
+    }
+    if (state->coverage.empty()) {
+      // Untiled images so far cover every pixel with their weight.
+      const uint64_t num_pixels =
+        static_cast<uint64_t>(state->width) * state->height;
+      state->coverage.assign(num_pixels, state->weight);
+      state->weight *= num_pixels;
+      state->samples *= num_pixels;
+    }
+  }
+  const bool tiled = !state->coverage.empty();
+
+  const int num_images = request->images_size();
+  std::vector<PendingImage> images(num_images);
+  std::vector<std::future<void>> decoded(num_images);
+
+  // Fetch and decode a few images ahead of the accumulation, in the pool.
+  const int window = compose_pool_.num_threads() * 2;
+  auto decode = [this, request, &images, &decoded](int i) {
+    decoded[i] = compose_pool_.Schedule([this, request, &images, i]() {
+      const auto& image = request->images(i);
+      PendingImage& result = images[i];
+
+      std::string content;
+      if (file_manager_.Get(image.id(), &content)) {
+        LOG(ERROR) << "compose failed; image " << image.id() << "not found";
+        result.status = Status(grpc::DATA_LOSS, "");
+        return;
+      }
+
+      if (LoadImage(image.image_type(), content, &result)) {
+        LOG(ERROR) << "compose failed; loading image " << image.id() <<
+          "failed";
+        result.status = Status(grpc::INTERNAL, "");
+      }
+    });
+  };
+  for (int i = 0; i < num_images && i < window; ++i) {
+    decode(i);
+  }
+
+  Accumulator& accumulator = state->accumulator;
+  Status status;
+
+  // Images are accumulated in the request order so that the result does not
+  // depend on the scheduling, while blocks of each image are added in
+  // parallel.
+  for (int i = 0; i < num_images; ++i) {
+    decoded[i].wait();
+    if (i + window < num_images) {
+      decode(i + window);
+    }
+
+    PendingImage& image = images[i];
+    if (!status.ok()) {
+      continue;
+    }
+    if (!image.status.ok()) {
+      status = image.status;
+      continue;
+    }
+
+    // Images without a tile cover the whole frame.
+    const auto& requested = request->images(i);
+    francine::Tile tile = requested.tile();
+    if (!requested.has_tile()) {
+      tile.set_width(image.width);
+      tile.set_height(image.height);
+    }
+
+    const size_t size = image.pixels.size() / PixelTypeSize(image.type);
+    if (tiled) {
+      if (InvalidTile(tile, state->width, state->height) ||
+          tile.width() != static_cast<uint32_t>(image.width) ||
+          tile.height() != static_cast<uint32_t>(image.height)) {
+        LOG(ERROR) << "compose failed; image " << requested.id() <<
+          " does not match its tile in the frame";
+        status = Status(grpc::INVALID_ARGUMENT, "");
+        continue;
+      }
+    } else if (requested.has_tile()) {
+      LOG(ERROR) << "compose failed; image " << requested.id() <<
+        " has a tile but the frame size is not given";
+      status = Status(grpc::INVALID_ARGUMENT, "");
+      continue;
+    } else if (state->width < 0) {
+      accumulator.Reset(size);
+      state->width = image.width;
+      state->height = image.height;
+      reset_variance();
+    } else if (size != accumulator.size()) {
+      LOG(ERROR) << "compose failed; size of image " <<
+        requested.id() << " does not match";
+      status = Status(grpc::INVALID_ARGUMENT, "");
+      continue;
+    }
+
+    // Composed images merge by the weight of the images they came from.
+    const uint64_t weight =
+      requested.weight() > 0 ? requested.weight() : image.weight;
+    uint64_t samples = requested.samples();
+    if (samples == 0) {
+      samples = image.samples > 0 ? image.samples : weight;
+    }
+    const uint64_t area = tiled ?
+      static_cast<uint64_t>(tile.width()) * tile.height() : 1;
+    state->weight += weight * area;
+    state->samples += samples * area;
+
+    // Each block sums the squares for the variance map on its own.
+    struct BlockSquares {
+      std::vector<double> squares;
+      std::vector<double> weights;
+    };
+    const size_t num_blocks = compose_pool_.num_threads();
+    std::vector<BlockSquares> block_squares(num_blocks);
+    for (auto&& sums : block_squares) {
+      sums.squares.assign(state->squares.size(), 0.0);
+      sums.weights.assign(state->squares.size(), 0.0);
+    }
+    auto add_squares = [state, &image, weight](
+        const unsigned char *pixels, size_t begin, size_t count,
+        BlockSquares *sums) {
+      if (state->variance_tile_size > 0) {
+        AddSquares(image.type, pixels, begin, count, state->width,
+                   state->variance_tile_size, state->variance_columns,
+                   weight, &sums->squares, &sums->weights);
+      }
+    };
+
+    std::vector<std::future<void>> blocks;
+    if (tiled) {
+      // Blocks of rows of the tile, each row added at its place in the frame.
+      const uint32_t block_rows =
+        (tile.height() + num_blocks - 1) / num_blocks;
+      for (uint32_t row = 0; row < tile.height(); row += block_rows) {
+        const uint32_t rows = std::min(block_rows, tile.height() - row);
+        BlockSquares *sums = &block_squares[blocks.size()];
+        blocks.push_back(compose_pool_.Schedule(
+              [state, &image, &tile, &add_squares, weight, row, rows, sums]() {
+          const size_t stride = static_cast<size_t>(tile.width()) * 4;
+          for (uint32_t y = row; y < row + rows; ++y) {
+            const size_t offset =
+              (static_cast<size_t>(tile.y() + y) * state->width + tile.x());
+            const unsigned char *pixels =
+              image.pixels.data() + y * stride * PixelTypeSize(image.type);
+            state->accumulator.AddRange(
+                image.type, pixels, weight, offset * 4, stride);
+            float *coverage = state->coverage.data() + offset;
+            for (uint32_t x = 0; x < tile.width(); ++x) {
+              coverage[x] += weight;
+            }
+            add_squares(pixels, offset, tile.width(), sums);
+          }
+        }));
+      }
+    } else {
+      const size_t block_size =
+        ((size + num_blocks - 1) / num_blocks + kComposeBlockAlignment - 1) /
+        kComposeBlockAlignment * kComposeBlockAlignment;
+      for (size_t begin = 0; begin < size; begin += block_size) {
+        const size_t count = std::min(block_size, size - begin);
+        BlockSquares *sums = &block_squares[blocks.size()];
+        blocks.push_back(compose_pool_.Schedule(
+              [&accumulator, &image, &add_squares, weight, begin, count,
+               sums]() {
+          const unsigned char *pixels =
+            image.pixels.data() + begin * PixelTypeSize(image.type);
+          accumulator.AddRange(image.type, pixels, weight, begin, count);
+          add_squares(pixels, begin / 4, count / 4, sums);
+        }));
+      }
+    }
+    for (auto&& block : blocks) {
+      block.wait();
+    }
+
+    if (state->variance_tile_size > 0) {
+      for (auto&& sums : block_squares) {
+        for (size_t t = 0; t < state->squares.size(); ++t) {
+          state->squares[t] += sums.squares[t];
+          state->square_weights[t] += sums.weights[t];
+        }
+      }
+      const uint32_t tile_size = state->variance_tile_size;
+      for (uint32_t y = tile.y() / tile_size;
+           y <= (tile.y() + tile.height() - 1) / tile_size; ++y) {
+        for (uint32_t x = tile.x() / tile_size;
+             x <= (tile.x() + tile.width() - 1) / tile_size; ++x) {
+          ++state->tile_images[y * state->variance_columns + x];
+        }
+      }
+    }
+
+    std::vector<unsigned char>().swap(image.pixels);
+  }
+
+  return status;
+}
+
+Status FrancineWorkerServiceImpl::GetAccumulator(
+    const std::string& id, bool create,
+    std::shared_ptr<ComposeState> *state) {
+  std::lock_guard<std::mutex> lock(accumulators_mutex_);
+
+  auto it = accumulators_.find(id);
+  if (create && it != accumulators_.end()) {
+    LOG(ERROR) << "accumulator " << id << " already exists";
+    return Status(grpc::ALREADY_EXISTS, "");
+  }
+  if (!create && it == accumulators_.end()) {
+    // Starting over would compose only the images added from now on.
+    LOG(ERROR) << "accumulator " << id << " does not exist";
+    return Status(grpc::NOT_FOUND, "");
+  }
+  if (create) {
+    // Evict the least recently used accumulator.
+    if (accumulators_.size() >= FLAGS_max_accumulators &&
+        !accumulators_.empty()) {
+      auto oldest = accumulators_.begin();
+      for (auto jt = accumulators_.begin(); jt != accumulators_.end(); ++jt) {
+        if (jt->second->last_used < oldest->second->last_used) {
+          oldest = jt;
+        }
+      }
+      LOG(INFO) << "evicting accumulator " << oldest->first;
+      accumulators_.erase(oldest);
+    }
+    it = accumulators_.insert(
+        std::make_pair(id, std::make_shared<ComposeState>())).first;
+  }
+
+  it->second->last_used = std::chrono::steady_clock::now();
+  *state = it->second;
+  return Status::OK;
+}
+
+void FrancineWorkerServiceImpl::ReleaseAccumulator(const std::string& id) {
+  std::lock_guard<std::mutex> lock(accumulators_mutex_);
+  accumulators_.erase(id);
 }
 
 Status FrancineWorkerServiceImpl::Compose(
     ServerContext* context,
     const ComposeRequest* request, ComposeResponse* response) {
-  double weight_sum = 0.0;
+  const std::string& accumulator_id = request->accumulator_id();
+  if (request->images_size() == 0 && request->release_accumulator() &&
+      !accumulator_id.empty()) {
+    ReleaseAccumulator(accumulator_id);
+    return Status::OK;
+  }
 
-  std::vector<double> accumulated;
-  int width = -1, height = -1;
+  std::shared_ptr<ComposeState> state;
+  if (accumulator_id.empty()) {
+    state = std::make_shared<ComposeState>();
+  } else {
+    auto status = GetAccumulator(
+        accumulator_id, request->create_accumulator(), &state);
+    if (!status.ok()) {
+      return status;
+    }
+  }
 
-  for (auto&& image : request->images()) {
-    const double weight = image.weight();
-    weight_sum += weight;
+  // Calls on the same accumulator fold their images one after another.
+  std::unique_lock<std::mutex> lock(state->mutex);
 
-    std::string content;
-    if (file_manager_.Get(image.id(), &content)) {
-      LOG(ERROR) << "compose failed; image " << image.id() << "not found";
-      return Status(grpc::DATA_LOSS, "");
+  auto status = AccumulateImages(request, state.get());
+  if (status.ok() && state->weight == 0) {
+    LOG(ERROR) << "compose failed; no images";
+    status = Status(grpc::INVALID_ARGUMENT, "");
+  }
+  if (!status.ok()) {
+    // The accumulator may have some of the images added.
+    if (!accumulator_id.empty()) {
+      ReleaseAccumulator(accumulator_id);
     }
+    return status;
+  }
+
+  const int width = state->width;
+  const int height = state->height;
+  uint64_t weight_sum = state->weight;
+  uint64_t samples_sum = state->samples;
 
-    std::vector<double> decoded;
-    int current_width, current_height;
-    if (LoadImage(image.image_type(), content,
-          &decoded, &current_width, &current_height)) {
-      LOG(ERROR) << "compose failed; loading image " << image.id() << "failed";
-      return Status(grpc::INTERNAL, "");
+  std::vector<float> accumulated(state->accumulator.size());
+  if (state->coverage.empty()) {
+    state->accumulator.Resolve(1.0 / weight_sum, accumulated.data());
+  } else {
+    // Each pixel is normalized by the weight of the tiles covering it.
+    const float *sum = state->accumulator.sum();
+    for (size_t i = 0; i < accumulated.size(); ++i) {
+      const float coverage = state->coverage[i / 4];
+      accumulated[i] = coverage > 0 ? sum[i] / coverage : 0.0f;
     }
+    const uint64_t num_pixels = static_cast<uint64_t>(width) * height;
+    weight_sum = std::max<uint64_t>(weight_sum / num_pixels, 1);
+    samples_sum /= num_pixels;
+  }
 
-    if (accumulated.size() == 0) {
-      accumulated.resize(decoded.size());
-      width = current_width;
-      height = current_height;
+  francine::VarianceMap variance;
+  if (state->variance_tile_size > 0) {
+    const uint32_t tile_size = state->variance_tile_size;
+    const uint32_t columns = state->variance_columns;
+    const size_t num_tiles = state->squares.size();
+
+    // Mean squares of the composed colors over the covered pixels.
+    std::vector<double> mean_squares(num_tiles, 0.0);
+    std::vector<size_t> num_colors(num_tiles, 0);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const size_t pixel = static_cast<size_t>(y) * width + x;
+        if (!state->coverage.empty() && state->coverage[pixel] <= 0) {
+          continue;
+        }
+        const size_t tile = y / tile_size * columns + x / tile_size;
+        for (int c = 0; c < 3; ++c) {
+          const double value = accumulated[pixel * 4 + c];
+          mean_squares[tile] += value * value;
+        }
+        num_colors[tile] += 3;
+      }
     }
 
-    for (int j = 0; j < accumulated.size(); ++j) {
-      accumulated[j] += decoded[j] * weight;
+    // The variance of the colors between the images is their mean square
+    // less the square of their mean, and the mean of n images has 1/n of
+    // it, corrected for the bias of the sample variance.
+    variance.set_tile_size(tile_size);
+    variance.set_columns(columns);
+    variance.set_rows(num_tiles / columns);
+    for (size_t t = 0; t < num_tiles; ++t) {
+      const uint32_t n = state->tile_images[t];
+      if (n < 2 || num_colors[t] == 0) {
+        variance.add_variance(std::numeric_limits<float>::infinity());
+        continue;
+      }
+      const double spread = state->squares[t] / state->square_weights[t] -
+        mean_squares[t] / num_colors[t];
+      variance.add_variance(std::max(spread, 0.0) / (n - 1));
     }
   }
+  lock.unlock();
 
-  for (int i = 0; i < accumulated.size(); ++i) {
-    accumulated[i] /= weight_sum;
+  if (request->release_accumulator() && !accumulator_id.empty()) {
+    ReleaseAccumulator(accumulator_id);
   }
 
   std::string result;
-  if (SaveImage(request->image_type(), accumulated, width, height, &result)) {
+  if (SaveImage(request->image_type(), request->png_compression(),
+                accumulated, width, height, samples_sum, weight_sum,
+                compose_pool_.num_threads(), &result)) {
     LOG(ERROR) << "compose failed; failed to encode";
     return Status(grpc::INTERNAL, "");
   }
@@ -337,6 +930,13 @@ Status FrancineWorkerServiceImpl::Compose(
 
   response->set_id(result_id);
   response->set_file_size(result_size);
+  response->set_weight(weight_sum);
+  response->set_samples(samples_sum);
+  response->set_width(width);
+  response->set_height(height);
+  if (variance.tile_size() > 0) {
+    *response->mutable_variance() = std::move(variance);
+  }
 
   return grpc::Status::OK;
 }
@@ -439,7 +1039,74 @@ Status FrancineWorkerServiceImpl::Delete(
   return Status::OK;
 }
 
+Status FrancineWorkerServiceImpl::BatchDelete(
+    ServerContext* context,
+    const BatchDeleteRequest* request, BatchDeleteResponse* response) {
+  LOG(INFO) << "batch delete of " << request->ids_size() << " files requested";
+
+  std::vector<std::string> ids(request->ids().begin(), request->ids().end());
+  std::vector<std::string> missing_ids;
+  file_manager_.BatchDelete(ids, &missing_ids);
+
+  for (auto&& id : missing_ids) {
+    response->add_missing_ids(id);
+  }
+  if (!missing_ids.empty()) {
+    LOG(ERROR) << missing_ids.size() << " files did not exist; ignore";
+  }
+
+  return Status::OK;
+}
+
+Status FrancineWorkerServiceImpl::ListInventory(
+    ServerContext* context,
+    const ListInventoryRequest* request, ListInventoryResponse* response) {
+  const int page_size = request->page_size() > 0 ?
+    request->page_size() : FLAGS_inventory_page_size;
+
+  std::vector<std::pair<WorkerFileManager::Id, uint64_t>> files;
+  std::string next_page_token;
+  file_manager_.List(request->page_token(), page_size,
+                     &files, &next_page_token);
+
+  for (auto&& file : files) {
+    auto entry = response->add_files();
+    entry->set_id(file.first);
+    entry->set_file_size(file.second);
+  }
+  response->set_next_page_token(next_page_token);
+
+  return Status::OK;
+}
+
+Status FrancineWorkerServiceImpl::GetStatus(
+    ServerContext* context,
+    const StatusRequest* request, StatusResponse* response) {
+  std::vector<SlotManager::SlotStatus> statuses;
+  slot_manager_.GetStatus(&statuses);
+
+  for (auto&& status : statuses) {
+    auto slot = response->add_slots();
+    slot->set_index(status.index);
+    for (int cpu : status.cpus) {
+      slot->add_cpus(cpu);
+    }
+    slot->set_busy(status.busy);
+    slot->set_runs(status.runs);
+    slot->set_utilization(status.utilization);
+
+    VLOG(1) << "slot " << status.index << " utilization " <<
+      status.utilization;
+  }
+  response->set_num_cpus(slot_manager_.num_cpus());
+
+  return Status::OK;
+}
+
 void RunWorker() {
+  // Do not die on writes to renderer daemons that have exited.
+  signal(SIGPIPE, SIG_IGN);
+
   FrancineWorkerServiceImpl service;
   ServerBuilder builder;
 
@@ -1,15 +1,28 @@
 #ifndef FRANCINE_WORKER_H_
 #define FRANCINE_WORKER_H_
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <grpc++/grpc++.h>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <string>
 
+#include "accumulate.h"
+#include "ao.h"
 #include "francine.grpc.pb.h"
+#include "renderer_pool.h"
+#include "slot_manager.h"
+#include "thread_pool.h"
 #include "worker_file_manager.h"
 
 class FrancineWorkerServiceImpl final
     : public francine::FrancineWorker::Service {
  public:
+  FrancineWorkerServiceImpl();
+
   virtual grpc::Status Run(
       grpc::ServerContext* context,
       grpc::ServerReaderWriter<francine::RunResponse, francine::RunRequest>*
@@ -40,8 +53,83 @@ class FrancineWorkerServiceImpl final
       const francine::DeleteRequest* request,
       francine::DeleteResponse* response) override;
 
+  virtual grpc::Status BatchDelete(
+      grpc::ServerContext* context,
+      const francine::BatchDeleteRequest* request,
+      francine::BatchDeleteResponse* response) override;
+
+  virtual grpc::Status ListInventory(
+      grpc::ServerContext* context,
+      const francine::ListInventoryRequest* request,
+      francine::ListInventoryResponse* response) override;
+
+  virtual grpc::Status GetStatus(
+      grpc::ServerContext* context,
+      const francine::StatusRequest* request,
+      francine::StatusResponse* response) override;
+
  private:
+  // Render passes of the tile of the request, or of the whole frame, of the
+  // scene, or of the default scene if null, on num_threads threads, and
+  // store the image of each. The passes draw the samples of the sequences
+  // from *sample_offset, which is advanced past them. on_pass takes the
+  // response of each pass as soon as it is stored, and stops the render by
+  // returning true. The render also stops between rows once the context is
+  // cancelled. Returns true if failed or stopped.
+  bool RenderAoBench(
+      const francine::RunRequest& request, const AoScene *scene,
+      uint64_t *sample_offset, uint32_t passes, int num_threads,
+      grpc::ServerContext *context,
+      const std::function<bool(francine::RunResponse*)>& on_pass);
+  // Renders with the daemon if given, or forks a fresh renderer otherwise.
+  // Renders of the daemon stop when the context is cancelled.
+  bool RenderPbrt(const std::string& tmpdir, RendererDaemon *daemon,
+                  const std::string& update, grpc::ServerContext *context,
+                  francine::RunResponse *response);
+
+  // Weighted sum of composed images. Compose calls with an accumulator id
+  // keep it between them, so that new images are added in O(new) work.
+  struct ComposeState {
+    std::mutex mutex;
+    Accumulator accumulator;
+    int width = -1;
+    int height = -1;
+    // Sums over the images. When stitching tiles, each image counts in
+    // proportion to the pixels it covers, times the frame size.
+    uint64_t weight = 0;
+    uint64_t samples = 0;
+    // Sum of the weights added to each pixel when stitching tiles, since
+    // tiles may cover the frame unevenly. Empty if the images are not tiled.
+    std::vector<float> coverage;
+    // Sums over the tiles of the variance map, if any: weighted squares of
+    // the colors, weights of the colors, and images covering each tile.
+    uint32_t variance_tile_size = 0;
+    uint32_t variance_columns = 0;
+    std::vector<double> squares;
+    std::vector<double> square_weights;
+    std::vector<uint32_t> tile_images;
+    std::chrono::steady_clock::time_point last_used;
+  };
+
+  // Gets the accumulator with the id, or creates it if create is set,
+  // evicting the least recently used one if there are too many.
+  // Returns NOT_FOUND or ALREADY_EXISTS if it does not or does exist.
+  grpc::Status GetAccumulator(const std::string& id, bool create,
+                              std::shared_ptr<ComposeState> *state);
+  void ReleaseAccumulator(const std::string& id);
+
+  // Fetches, decodes and adds the images of the request to the state.
+  grpc::Status AccumulateImages(const francine::ComposeRequest* request,
+                                ComposeState* state);
+
   WorkerFileManager file_manager_;
+  SlotManager slot_manager_;
+  RendererPool renderer_pool_;
+  // Decodes and accumulates images for Compose.
+  ThreadPool compose_pool_;
+
+  std::mutex accumulators_mutex_;
+  std::map<std::string, std::shared_ptr<ComposeState>> accumulators_;
 };
 
 void RunWorker();
@@ -1,8 +1,13 @@
 #include "worker_file_manager.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <dirent.h>
 #include <tuple>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -12,6 +17,55 @@
 DEFINE_string(tmpdir, "/tmp", "temporary directory to store files");
 DEFINE_int64(inmemory_threshold, 0, "temporary directory to store files");
 
+namespace {
+
+// picosha2 loses carries of the data length if it is given 64KiB or more
+// at once, so always feed it smaller chunks.
+const size_t kHashChunkSize = 32 * 1024;
+
+std::string HashContent(const std::string& content) {
+  picosha2::hash256_one_by_one hasher;
+  for (size_t i = 0; i < content.size(); i += kHashChunkSize) {
+    const size_t end = std::min(i + kHashChunkSize, content.size());
+    hasher.process(content.begin() + i, content.begin() + end);
+  }
+  hasher.finish();
+
+  std::string hash;
+  picosha2::get_hash_hex_string(hasher, hash);
+  return hash;
+}
+
+bool IsContentId(const std::string& name) {
+  return name.size() == 64 &&
+    std::all_of(name.begin(), name.end(), [](char c) {
+        return ('0' <= c && c <= '9') || ('a' <= c && c <= 'f');
+      });
+}
+
+}  // namespace
+
+WorkerFileManager::WorkerFileManager() {
+  DIR *dir = opendir(FLAGS_tmpdir.c_str());
+  if (dir == NULL) {
+    LOG(ERROR) << "failed to open " << FLAGS_tmpdir;
+    return;
+  }
+
+  while (struct dirent *entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    struct stat file_stat;
+    if (IsContentId(name) &&
+        !stat((FLAGS_tmpdir + "/" + name).c_str(), &file_stat) &&
+        S_ISREG(file_stat.st_mode)) {
+      inventory_[name] = file_stat.st_size;
+    }
+  }
+  closedir(dir);
+
+  LOG(INFO) << inventory_.size() << " files found in " << FLAGS_tmpdir;
+}
+
 bool WorkerFileManager::Get(const std::string& id, std::string *content) {
   std::lock_guard<std::mutex> lock(mutex_);
 
@@ -34,10 +88,10 @@ bool WorkerFileManager::Put(const std::string& content,
                             std::string *id, uint64_t *size) {
   std::lock_guard<std::mutex> lock(mutex_);
 
-  std::string hash;
-  picosha2::hash256_hex_string(content, hash);
+  const std::string hash = HashContent(content);
   *id = hash;
   *size = content.size();
+  inventory_[hash] = content.size();
 
   if (content.size() > FLAGS_inmemory_threshold) {
     std::ofstream ofs(FLAGS_tmpdir + "/" + hash);
@@ -51,17 +105,56 @@ bool WorkerFileManager::Put(const std::string& content,
 
 bool WorkerFileManager::Delete(const std::string& id) {
   std::lock_guard<std::mutex> lock(mutex_);
+  return DeleteWithoutLock(id);
+}
+
+void WorkerFileManager::BatchDelete(const std::vector<std::string>& ids,
+                                    std::vector<std::string> *missing_ids) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  missing_ids->clear();
+  for (auto&& id : ids) {
+    if (DeleteWithoutLock(id)) {
+      missing_ids->push_back(id);
+    }
+  }
+}
+
+void WorkerFileManager::List(const std::string& page_token, int page_size,
+                             std::vector<std::pair<Id, uint64_t>> *files,
+                             std::string *next_page_token) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  files->clear();
+  next_page_token->clear();
+
+  const size_t max_files = std::max(page_size, 0);
+  auto it = inventory_.upper_bound(page_token);
+  for (; it != inventory_.end() && files->size() < max_files; ++it) {
+    files->emplace_back(it->first, it->second);
+  }
+
+  if (it != inventory_.end() && !files->empty()) {
+    *next_page_token = files->back().first;
+  }
+}
+
+bool WorkerFileManager::DeleteWithoutLock(const std::string& id) {
+  // Never touch anything in tmpdir other than the stored files.
+  if (!inventory_.erase(id)) {
+    return true;
+  }
 
   if (inmemory_files_.count(id)) {
     inmemory_files_.erase(id);
-    LOG(INFO) << "inmemory file deleted";
+    VLOG(1) << "inmemory file deleted";
     return false;
   }
 
   const std::string filename = FLAGS_tmpdir + '/' + id;
 
   if (!remove(filename.c_str())) {
-    LOG(INFO) << "on disk file deleted";
+    VLOG(1) << "on disk file deleted";
     return false;
   }
 
@@ -71,16 +164,96 @@ bool WorkerFileManager::Delete(const std::string& id) {
 bool WorkerFileManager::Retain(
     const std::string dirname,
     const std::string& filename, std::string *id, uint64_t *size) {
-  // Do not acquire lock here.
+  const std::string path = dirname + "/" + filename;
 
-  std::ifstream ifs(dirname + "/" + filename);
-  if (ifs.good()) {
-    std::string content((std::istreambuf_iterator<char>(ifs)),
-        std::istreambuf_iterator<char>());
-    return Put(content, id, size);
+  // Hash the file in place instead of reading it into memory.
+  std::ifstream ifs(path, std::ios::binary);
+  if (!ifs.good()) {
+    return true;
   }
 
-  return true;
+  picosha2::hash256_one_by_one hasher;
+  std::vector<char> buffer(kHashChunkSize);
+  uint64_t file_size = 0;
+  while (ifs) {
+    ifs.read(buffer.data(), buffer.size());
+    const auto count = ifs.gcount();
+    hasher.process(buffer.begin(), buffer.begin() + count);
+    file_size += count;
+  }
+  if (ifs.bad()) {
+    LOG(ERROR) << "failed to read " << path;
+    return true;
+  }
+  ifs.close();
+  hasher.finish();
+
+  std::string hash;
+  picosha2::get_hash_hex_string(hasher, hash);
+
+  const std::string stored = FLAGS_tmpdir + "/" + hash;
+  bool cross_device = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    struct stat stored_stat;
+    if (inmemory_files_.count(hash) || !stat(stored.c_str(), &stored_stat)) {
+      // The same content is already stored.
+      remove(path.c_str());
+    } else if (rename(path.c_str(), stored.c_str())) {
+      if (errno != EXDEV) {
+        LOG(ERROR) << "failed to move " << path << " into the store";
+        return true;
+      }
+      cross_device = true;
+    }
+
+    // The file is listed only once it is in the store.
+    if (!cross_device) {
+      inventory_[hash] = file_size;
+      *id = hash;
+      *size = file_size;
+      return false;
+    }
+  }
+
+  // The renderer wrote to another file system. Copy the file next to the
+  // store without holding the lock, then move it in.
+  std::string copied = stored + ".XXXXXX";
+  const int fd = mkstemp(&copied[0]);
+  if (fd < 0) {
+    LOG(ERROR) << "failed to create a copy of " << path;
+    return true;
+  }
+  close(fd);
+
+  std::ifstream src(path, std::ios::binary);
+  std::ofstream dst(copied, std::ios::binary);
+  uint64_t copied_size = 0;
+  while (src && dst) {
+    src.read(buffer.data(), buffer.size());
+    dst.write(buffer.data(), src.gcount());
+    copied_size += src.gcount();
+  }
+  dst.close();
+  if (src.bad() || !dst) {
+    LOG(ERROR) << "failed to copy " << path << " into the store";
+    remove(copied.c_str());
+    return true;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (rename(copied.c_str(), stored.c_str())) {
+    LOG(ERROR) << "failed to move " << copied << " into the store";
+    remove(copied.c_str());
+    return true;
+  }
+  remove(path.c_str());
+
+  inventory_[hash] = copied_size;
+  *id = hash;
+  *size = copied_size;
+  return false;
 }
 
 bool WorkerFileManager::CreateTmpDir(
@@ -88,15 +261,14 @@ bool WorkerFileManager::CreateTmpDir(
     std::string *dirname) {
   std::lock_guard<std::mutex> lock(mutex_);
 
-  std::stringstream tmp_dir_name;
-  tmp_dir_name<<FLAGS_tmpdir<<"/"<<tmp_cnt_;
-  *dirname = tmp_dir_name.str();
-  ++tmp_cnt_;
-
-  if (!mkdir(dirname->c_str(), 0755)) {
-    LOG(ERROR) << "failed to create tmpdir " << *dirname;
-    return false;
+  // Directories of runs before a restart are left in tmpdir, so names are
+  // picked by mkdtemp rather than counted from 0.
+  std::string name = FLAGS_tmpdir + "/run.XXXXXX";
+  if (mkdtemp(&name[0]) == NULL) {
+    LOG(ERROR) << "failed to create a tmpdir in " << FLAGS_tmpdir;
+    return true;
   }
+  *dirname = name;
 
   for (auto&& file : files) {
     std::string id, alias;
@@ -114,7 +286,13 @@ bool WorkerFileManager::CreateTmpDir(
     const auto from = FLAGS_tmpdir + "/" + id;
     const auto to = *dirname + "/" + alias;
 
-    if (!symlink(from.c_str(), to.c_str())) {
+    // Create intermediate directories of aliases such as textures/a.exr.
+    for (auto slash = alias.find('/'); slash != std::string::npos;
+         slash = alias.find('/', slash + 1)) {
+      mkdir((*dirname + "/" + alias.substr(0, slash)).c_str(), 0755);
+    }
+
+    if (symlink(from.c_str(), to.c_str())) {
       LOG(ERROR) << "symlink failed. Id: " << id << " Alias: " << alias;
       RemoveTmpDir(*dirname);
       return true;
@@ -126,7 +304,7 @@ bool WorkerFileManager::CreateTmpDir(
 
 void WorkerFileManager::RemoveTmpDir(const std::string& dirname) {
   // Do not acquire lock here.
-  std::string cmd = "rm - rf ";
+  std::string cmd = "rm -rf ";
   cmd += dirname;
-  system(dirname.c_str());
+  system(cmd.c_str());
 }
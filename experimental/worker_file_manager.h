@@ -1,6 +1,8 @@
 #ifndef FRANCINE_WORKER_FILE_MANAGER_H_
 #define FRANCINE_WORKER_FILE_MANAGER_H_
 
+#include <cstdint>
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <mutex>
@@ -8,8 +10,8 @@
 
 class WorkerFileManager {
  public:
-  WorkerFileManager() : tmp_cnt_(0) {
-  }
+  // Files left in --tmpdir by a previous run are taken into the inventory.
+  WorkerFileManager();
 
   // Returns true if failed.
   // All the function calls to this class are thread-safe.
@@ -19,11 +21,23 @@ class WorkerFileManager {
   bool Put(const std::string& content, std::string *id, uint64_t *size);
   bool Delete(const std::string& id);
 
-  // Retain a renderer created file.
+  // Ids of the files that did not exist are stored in missing_ids.
+  void BatchDelete(const std::vector<std::string>& ids,
+                   std::vector<std::string> *missing_ids);
+
+  using Id = std::string;
+
+  // List at most page_size stored files with their sizes in the order of ids,
+  // starting after page_token. next_page_token is empty on the last page.
+  void List(const std::string& page_token, int page_size,
+            std::vector<std::pair<Id, uint64_t>> *files,
+            std::string *next_page_token);
+
+  // Retain a renderer created file by moving it into the store.
+  // The file is removed if the same content is already stored.
   bool Retain(const std::string dirname,
               const std::string& filename, std::string *id, uint64_t *size);
 
-  using Id = std::string;
   using Alias = std::string;
   bool CreateTmpDir(
       const std::vector<std::pair<Id, Alias>>& files,
@@ -31,9 +45,12 @@ class WorkerFileManager {
   void RemoveTmpDir(const std::string& dirname);
 
  private:
+  bool DeleteWithoutLock(const std::string& id);
+
   std::unordered_map<std::string, std::string> inmemory_files_;
+  // Sizes of all the stored files, whether in memory or on disk.
+  std::map<Id, uint64_t> inventory_;
   std::mutex mutex_;
-  int tmp_cnt_;
 };
 
 #endif
@@ -240,7 +240,7 @@ function _queueTasksForExecution(executionName) {
 
   function queueMediumReducingTask(current, retry) {
     var taskName = _this.createReducingTask(
-      session, execution, current);
+      session, execution, current, false);
     _this.scheduler.schedule();
 
     numMediumReducingInQueue++;
@@ -278,7 +278,7 @@ function _queueTasksForExecution(executionName) {
   function queueFinalReducingTask(retry) {
     _this.log('Master', 'Final Reducing Task queued!');
     var taskName = _this.createReducingTask(
-      session, execution, mediumReduced);
+      session, execution, mediumReduced, true);
     _this.scheduler.schedule();
 
     isInFinalReducing = true;
@@ -5,9 +5,127 @@ var spawn = require('child_process').spawn;
 var fs = require('fs');
 var request = require('request');
 
+// A long-running compositor process that composes one request at a time,
+// so that reductions do not pay a process spawn each. The images pass
+// through its stdin and stdout instead of files.
+// It is restarted on the next request if it exits.
+function CompositorServer(worker) {
+  var _this = this;
+  _this.worker = worker;
+  _this.process = null;
+  _this.buffer = new Buffer(0);
+  // Deferreds of the requests waiting for the replies, in order.
+  _this.pending = [];
+}
+
+// Resolves the pending requests with the complete replies in the buffer.
+// A reply is a line of "ok" and the size of the image separated by a tab
+// followed by the image, or a line of "error".
+CompositorServer.prototype._parseReplies = function _parseReplies() {
+  for (;;) {
+    var newline = -1;
+    for (var i = 0; i < this.buffer.length; i++) {
+      if (this.buffer[i] === 10) {
+        newline = i;
+        break;
+      }
+    }
+    if (newline < 0) {
+      return;
+    }
+
+    var header = this.buffer.slice(0, newline).toString('utf-8').split('\t');
+    var size = 0;
+    if (header[0] === 'ok') {
+      size = parseInt(header[1], 10);
+      if (this.buffer.length < newline + 1 + size) {
+        return;
+      }
+    }
+
+    var content = this.buffer.slice(newline + 1, newline + 1 + size);
+    this.buffer = this.buffer.slice(newline + 1 + size);
+
+    var d = this.pending.shift();
+    if (!d) {
+      continue;
+    }
+    if (header[0] === 'ok') {
+      d.resolve(content);
+    } else {
+      d.reject('Compositor failed: ' + header.join(' '));
+    }
+  }
+};
+
+CompositorServer.prototype._failPending = function _failPending(error) {
+  var pending = this.pending;
+  this.pending = [];
+  pending.forEach(function(d) {
+    d.reject(error);
+  });
+};
+
+CompositorServer.prototype._start = function _start() {
+  var _this = this;
+
+  var spawned = spawn(
+    __dirname + '/../../compositor/compositor', ['--server']);
+  _this.process = spawned;
+  _this.buffer = new Buffer(0);
+
+  spawned.stdout.on('data', function(data) {
+    _this.buffer = Buffer.concat([_this.buffer, data]);
+    _this._parseReplies();
+  });
+
+  spawned.stderr.on('data', function(data) {
+    _this.worker.log('CompositorReducer', data.toString('utf-8'));
+  });
+
+  function stopped(error) {
+    if (_this.process === spawned) {
+      _this.process = null;
+      _this._failPending(error);
+    }
+  }
+
+  spawned.on('exit', function(code) {
+    _this.worker.log(
+      'CompositorReducer',
+      'Compositor server exited with code: ' + code);
+    stopped('Compositor server exited with code: ' + code);
+  });
+
+  spawned.on('error', stopped);
+  spawned.stdin.on('error', stopped);
+};
+
+// Composes the images of {content, weight} into an image of the format.
+// Resolves with the content of the composed image.
+CompositorServer.prototype.compose = function compose(format, images) {
+  if (!this.process) {
+    this._start();
+  }
+
+  var d = Q.defer();
+  this.pending.push(d);
+
+  var stdin = this.process.stdin;
+  stdin.write(['--buffers', format, images.length].join('\t') + '\n');
+  images.forEach(function(image) {
+    stdin.write(
+      Math.floor(image.weight).toString() + '\t' +
+      image.content.length + '\n');
+    stdin.write(image.content);
+  });
+  return d.promise;
+};
+
 function CompositorReducer(worker) {
   var _this = this;
   _this.worker = worker;
+  _this.server = new CompositorServer(worker);
 }
 
 function _retrieve(worker, source) {
@@ -24,17 +142,10 @@ function _retrieve(worker, source) {
       d.reject(source.worker.host + ':' + source.worker.resourcePort + ': ' +
         error.toString());
     } else {
-      var savedFileName = worker.getTemporaryDirectory() +
-        '/results/' + source.taskName;
-      fs.writeFile(savedFileName, body, function(error) {
-        if (error) {
-          d.reject(error);
-        } else {
-          d.resolve({
-            savedFileName: savedFileName,
-            weight: source.weight
-          });
-        }
+      // Kept in memory; the compositor server takes it through its stdin.
+      d.resolve({
+        content: body,
+        weight: source.weight
       });
     }
   });
@@ -42,52 +153,30 @@ function _retrieve(worker, source) {
   return d.promise;
 }
 
-function _save(task, worker) {
+function _save(task, worker, server) {
   return function(images) {
-    var d = Q.defer();
-
     if (images.length === 0) {
+      var d = Q.defer();
       d.reject('No images to compose (All the sources are dead)');
       return d.promise;
     }
 
-    var spawned = spawn(
-      __dirname + '/../../compositor/compositor',
-      [
-        '--weight',
-        task.session.format,
-        worker.getTemporaryDirectory() + '/results/' + task.name
-      ].concat(
-        Array.prototype.concat.apply([],
-          images.map(function(image) {
-            return [Math.floor(image.weight).toString(), image.savedFileName];
-          }))));
-
-    spawned.stdout.on('data', function(data) {
-      worker.log('CompositorReducer', data.toString('utf-8'));
-    });
-
-    spawned.stderr.on('data', function(data) {
-      worker.log('CompositorReducer', data.toString('utf-8'));
-    });
-
-    spawned.on('exit', function(code) {
-      if (code !== 0) {
-        worker.log(
-          'CompositorReducer',
-          'Returned with non-zero code: ' + code);
-        d.reject('Returned with non-zero code: ' + code);
-        return;
-      }
-
-      d.resolve();
-    });
-
-    spawned.on('error', function(error) {
-      d.reject(error);
+    return server.compose(
+      task.isFinal ? task.session.format : 'partial', images)
+    .then(function(content) {
+      // Only the result is written, to be served to the next reduction.
+      var d = Q.defer();
+      fs.writeFile(
+        worker.getTemporaryDirectory() + '/results/' + task.name, content,
+        function(error) {
+          if (error) {
+            d.reject(error);
+          } else {
+            d.resolve();
+          }
+        });
+      return d.promise;
     });
-
-    return d.promise;
   };
 }
 
@@ -129,7 +218,7 @@ CompositorReducer.prototype.reduce = function reduce(task) {
 
     return d.promise;
   })
-  .then(_save(task, _this.worker))
+  .then(_save(task, _this.worker, _this.server))
   .then(function() {
     var d = Q.defer();
     d.resolve(weight);
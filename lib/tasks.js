@@ -43,8 +43,10 @@ function createProducingTask(session, execution, seed) {
   return taskName;
 };
 
+// The final reducing task encodes the image in the session format, while
+// medium ones keep it as a lossless partial image for the next reduction.
 Tasks.createReducingTask =
-function createReducingTask(session, execution, producings) {
+function createReducingTask(session, execution, producings, isFinal) {
   var _this = this;
 
   var taskName = 'task' + _this.getId();
@@ -68,7 +70,8 @@ function createReducingTask(session, execution, producings) {
     name: taskName,
     type: 'REDUCING',
     session: session,
-    execution: execution
+    execution: execution,
+    isFinal: isFinal
   });
 
   return taskName;